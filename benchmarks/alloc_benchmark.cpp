@@ -0,0 +1,156 @@
+/*========================="Allocation" Benchmark==========================//
+Counts the heap allocations made by the nuSQUIDSDecay hot paths during
+steady-state derivative evaluations. A small MicroBooNE-like system
+(3+1 neutrinos, scalar couplings, m_4->m_3 decay only) is evolved once
+over a short baseline so that every buffer is set up; the decay part of
+the right-hand side (AddToPreDerive(), then GammaRho() and
+InteractionsRho() for every energy node and neutrino type) is then
+repeated while every call to the C allocation functions is counted.
+Interactions are switched off, since the nuSQuIDS interaction terms
+allocate by design and are not part of this measurement.
+	With decay regeneration in batched mode, AddToPreDerive(), GammaRho()
+and InteractionsRho() must not allocate at all. The program prints the
+allocation count per evaluation of each piece and returns a non-zero
+exit code if any of the three allocates.
+//==========================================================================*/
+
+#include <vector>
+#include <iostream>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include "nusquids_decay.h"
+
+//Interpose the glibc allocation functions, so that allocations from the
+//SQuIDS and nuSQuIDS shared libraries are counted as well.
+static std::atomic<unsigned long> allocation_count(0);
+
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+
+void* malloc(size_t size){
+	allocation_count++;
+	return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size){
+	allocation_count++;
+	return __libc_calloc(n,size);
+}
+void* realloc(void* ptr, size_t size){
+	allocation_count++;
+	return __libc_realloc(ptr,size);
+}
+void* memalign(size_t alignment, size_t size){
+	allocation_count++;
+	return __libc_memalign(alignment,size);
+}
+void* aligned_alloc(size_t alignment, size_t size){
+	allocation_count++;
+	return __libc_memalign(alignment,size);
+}
+int posix_memalign(void** ptr, size_t alignment, size_t size){
+	allocation_count++;
+	*ptr = __libc_memalign(alignment,size);
+	return *ptr ? 0 : ENOMEM;
+}
+}
+
+using namespace nusquids;
+
+//Exposes the protected hot paths of nuSQUIDSDecay.
+class nuSQUIDSDecayProbe : public nuSQUIDSDecay {
+public:
+	using nuSQUIDSDecay::nuSQUIDSDecay;
+	using nuSQUIDSDecay::AddToPreDerive;
+	using nuSQUIDSDecay::GammaRho;
+	using nuSQUIDSDecay::InteractionsRho;
+};
+
+int main(){
+	const unsigned int numneu = 4;
+	const unsigned int repetitions = 100;
+	const squids::Const units;
+	double nu4mass = 1.0;
+	std::vector<double> nu_mass{0.0,sqrt(7.65e-05),sqrt(0.0024),nu4mass};
+
+	gsl_matrix* couplings = gsl_matrix_alloc(numneu,numneu);
+	gsl_matrix_set_zero(couplings);
+	gsl_matrix_set(couplings,3,2,1.0); //g_43
+
+	bool iinteraction=false;
+	bool decay_regen=true;
+	bool pscalar=false;
+	nuSQUIDSDecayProbe nus(linspace(2.5e-2*units.GeV,9.975e0*units.GeV,200),numneu,both,iinteraction,
+							decay_regen,pscalar,nu_mass,couplings);
+	gsl_matrix_free(couplings);
+
+	nus.Set_Body(std::make_shared<ConstantDensity>(2.5,0.3));
+	nus.Set_Track(std::make_shared<ConstantDensity::Track>(0.47*units.km));
+	nus.Set_MixingAngle(0,1,0.563942);
+	nus.Set_MixingAngle(0,2,0.154085);
+	nus.Set_MixingAngle(1,2,0.785398);
+	nus.Set_MixingAngle(1,3,0.5*0.785398);
+	nus.Set_SquareMassDifference(1,7.65e-05);
+	nus.Set_SquareMassDifference(2,0.00247);
+	nus.Set_SquareMassDifference(3,nu4mass*nu4mass);
+	nus.Set_rel_error(1.0e-8);
+	nus.Set_abs_error(1.0e-8);
+
+	marray<double,3> inistate {nus.GetNumE(),2,numneu};
+	std::fill(inistate.begin(),inistate.end(),0);
+	for (unsigned int ie = 0; ie < nus.GetNumE(); ie++){
+		inistate[ie][0][1] = 1.0;
+		inistate[ie][1][1] = 1.0;
+	}
+	nus.Set_initial_state(inistate,flavor);
+	//Set up every buffer and leave the state and projectors at the final position.
+	nus.EvolveState();
+
+	double x = nus.Get_t();
+	unsigned int ne = nus.GetNumE();
+	unsigned long prederive_allocations = 0;
+	unsigned long gamma_allocations = 0;
+	unsigned long interaction_allocations = 0;
+	double checksum = 0;
+	//The first iteration is a warm-up.
+	for (unsigned int r = 0; r <= repetitions; r++){
+		unsigned long start = allocation_count;
+		nus.AddToPreDerive(x);
+		unsigned long after_prederive = allocation_count;
+		for (unsigned int ie = 0; ie < ne; ie++){
+			for (unsigned int irho = 0; irho < 2; irho++){
+				checksum += nus.GammaRho(ie,irho)[0];
+			}
+		}
+		unsigned long after_gamma = allocation_count;
+		for (unsigned int ie = 0; ie < ne; ie++){
+			for (unsigned int irho = 0; irho < 2; irho++){
+				checksum += nus.InteractionsRho(ie,irho)[0];
+			}
+		}
+		unsigned long after_interactions = allocation_count;
+		if (r == 0){
+			continue;
+		}
+		prederive_allocations += after_prederive - start;
+		gamma_allocations += after_gamma - after_prederive;
+		interaction_allocations += after_interactions - after_gamma;
+	}
+
+	std::cout << "energy nodes: " << ne << ", evaluations: " << repetitions << std::endl;
+	std::cout << "allocations per evaluation:" << std::endl;
+	std::cout << "  AddToPreDerive  " << double(prederive_allocations)/repetitions << std::endl;
+	std::cout << "  GammaRho        " << double(gamma_allocations)/repetitions << std::endl;
+	std::cout << "  InteractionsRho " << double(interaction_allocations)/repetitions << std::endl;
+	std::cout << "(checksum " << checksum << ")" << std::endl;
+	if (prederive_allocations != 0 || gamma_allocations != 0 || interaction_allocations != 0){
+		std::cout << "FAIL: AddToPreDerive/GammaRho/InteractionsRho allocate in steady state" << std::endl;
+		return 1;
+	}
+	std::cout << "PASS: AddToPreDerive/GammaRho/InteractionsRho do not allocate in steady state" << std::endl;
+	return 0;
+}
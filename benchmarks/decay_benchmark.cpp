@@ -0,0 +1,269 @@
+/*========================="Decay" Benchmark==========================//
+Times the nuSQUIDSDecay hot paths over a grid of problem sizes and
+physics modes, and prints the results as CSV so that they can be
+compared between versions.
+	For every number of states, number of energy nodes, number of
+zenith bins and mode (interactions and decay regeneration on or off),
+a nuSQUIDSAtm<nuSQUIDSDecay> object is built on a shared DecayModel
+(m_n->m_{n-1} decay only, scalar couplings) and evolved through the
+Earth. The benchmarks are:
+ - evolve: one full EvolveState() of the atmospheric object.
+ - prederive: AddToPreDerive() of every zenith bin.
+ - gamma: GammaRho() of every energy node, rho and zenith bin.
+ - interactions: InteractionsRho() of every energy node, rho and zenith bin.
+ - model: DecayModel::With_Masses(), which recomputes the rate matrices,
+   DT, the parent energy bounds (nearest_element()) and the regeneration
+   kernel. It does not depend on the zenith bins or the mode, which are
+   left empty.
+The last four are evaluated on the final state of the evolution, and are
+repeated "reps" times after a warm-up; seconds_per_call is the mean time
+of one call of the whole loop.
+	Arguments are key=value pairs, with comma separated lists:
+   numneu=3,4,5,6 ne=50,200,1000 zenith=2,10 modes=0,1,2,3 reps=20
+   benchmarks=evolve,prederive,gamma,interactions,model
+where mode bit 1 is interactions and bit 0 is decay regeneration.
+The defaults are the values above, except ne=50,200, since the full
+evolution of the largest problems takes a long time.
+//==========================================================================*/
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <stdexcept>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include "nusquids_decay.h"
+
+using namespace nusquids;
+
+//Exposes the protected hot paths of nuSQUIDSDecay.
+class nuSQUIDSDecayProbe : public nuSQUIDSDecay {
+public:
+	using nuSQUIDSDecay::nuSQUIDSDecay;
+	using nuSQUIDSDecay::AddToPreDerive;
+	using nuSQUIDSDecay::GammaRho;
+	using nuSQUIDSDecay::InteractionsRho;
+};
+
+struct Settings {
+	std::vector<unsigned int> numneu{3,4,5,6};
+	std::vector<unsigned int> ne{50,200};
+	std::vector<unsigned int> zenith{2,10};
+	std::vector<unsigned int> modes{0,1,2,3};
+	std::vector<std::string> benchmarks{"evolve","prederive","gamma","interactions","model"};
+	unsigned int reps=20;
+
+	bool Runs(const std::string& name) const {
+		return std::find(benchmarks.begin(),benchmarks.end(),name) != benchmarks.end();
+	}
+};
+
+std::vector<std::string> Split(const std::string& list){
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss,item,',')){
+		items.push_back(item);
+	}
+	return items;
+}
+
+std::vector<unsigned int> Split_Unsigned(const std::string& list){
+	std::vector<unsigned int> values;
+	for (const std::string& item : Split(list)){
+		values.push_back(std::stoul(item));
+	}
+	return values;
+}
+
+Settings Parse(int argc, char** argv){
+	Settings settings;
+	for (int i = 1; i < argc; i++){
+		std::string arg(argv[i]);
+		size_t eq = arg.find('=');
+		if (eq == std::string::npos){
+			throw std::runtime_error("expected key=value, got " + arg);
+		}
+		std::string key = arg.substr(0,eq);
+		std::string value = arg.substr(eq+1);
+		if (key == "numneu"){ settings.numneu = Split_Unsigned(value); }
+		else if (key == "ne"){ settings.ne = Split_Unsigned(value); }
+		else if (key == "zenith"){ settings.zenith = Split_Unsigned(value); }
+		else if (key == "modes"){ settings.modes = Split_Unsigned(value); }
+		else if (key == "reps"){ settings.reps = std::stoul(value); }
+		else if (key == "benchmarks"){ settings.benchmarks = Split(value); }
+		else{ throw std::runtime_error("unknown argument " + key); }
+	}
+	for (unsigned int n : settings.numneu){
+		if (n < 3 || n > 6){ throw std::runtime_error("numneu must be between 3 and 6"); }
+	}
+	for (unsigned int n : settings.ne){
+		if (n < 2){ throw std::runtime_error("ne must be at least 2"); }
+	}
+	for (unsigned int n : settings.zenith){
+		if (n < 2){ throw std::runtime_error("zenith must be at least 2"); }
+	}
+	return settings;
+}
+
+//Masses of the three light states, then 1, 2 and 3 eV for the sterile ones.
+std::vector<double> Masses(unsigned int numneu){
+	std::vector<double> masses{0.0,sqrt(7.65e-05),sqrt(0.0024)};
+	for (unsigned int i = 3; i < numneu; i++){
+		masses.push_back(i-2.0);
+	}
+	return masses;
+}
+
+std::shared_ptr<const DecayModel> Model(unsigned int numneu, unsigned int ne){
+	const squids::Const units;
+	gsl_matrix* couplings = gsl_matrix_alloc(numneu,numneu);
+	gsl_matrix_set_zero(couplings);
+	gsl_matrix_set(couplings,numneu-1,numneu-2,1.0);
+	std::shared_ptr<const DecayModel> model;
+	try{
+		model = std::make_shared<const DecayModel>(logspace(1.e2*units.GeV,1.e6*units.GeV,ne-1),
+													numneu,false,Masses(numneu),couplings);
+	}
+	catch(...){
+		gsl_matrix_free(couplings);
+		throw;
+	}
+	gsl_matrix_free(couplings);
+	return model;
+}
+
+void Set_Oscillations(nuSQUIDSAtm<nuSQUIDSDecayProbe>& atm, unsigned int numneu){
+	std::vector<double> masses = Masses(numneu);
+	atm.Set_MixingAngle(0,1,0.563942);
+	atm.Set_MixingAngle(0,2,0.154085);
+	atm.Set_MixingAngle(1,2,0.785398);
+	for (unsigned int i = 3; i < numneu; i++){
+		atm.Set_MixingAngle(1,i,0.2);
+	}
+	atm.Set_SquareMassDifference(1,7.65e-05);
+	atm.Set_SquareMassDifference(2,0.00247);
+	for (unsigned int i = 3; i < numneu; i++){
+		atm.Set_SquareMassDifference(i,masses[i]*masses[i]);
+	}
+	atm.Set_rel_error(1.0e-8);
+	atm.Set_abs_error(1.0e-8);
+}
+
+template<typename Function>
+double Time(unsigned int reps, Function f){
+	f(); //warm-up
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int r = 0; r < reps; r++){
+		f();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count()/reps;
+}
+
+void Print(const std::string& benchmark, unsigned int numneu, unsigned int ne, const std::string& zenith,
+		   const std::string& interactions, const std::string& regeneration, unsigned int reps,
+		   double seconds, double checksum){
+	std::cout << benchmark << ',' << numneu << ',' << ne << ',' << zenith << ',' << interactions << ','
+			  << regeneration << ',' << reps << ',' << seconds << ',' << checksum << std::endl;
+}
+
+int main(int argc, char** argv){
+	Settings settings;
+	try{
+		settings = Parse(argc,argv);
+	}
+	catch(std::exception& e){
+		std::cerr << "decay_benchmark: " << e.what() << std::endl;
+		return 1;
+	}
+	std::cout.precision(6);
+	std::cout << "benchmark,numneu,ne,zenith,interactions,regeneration,reps,seconds_per_call,checksum" << std::endl;
+
+	for (unsigned int numneu : settings.numneu){
+		for (unsigned int ne : settings.ne){
+			std::shared_ptr<const DecayModel> model = Model(numneu,ne);
+			if (settings.Runs("model")){
+				std::vector<double> masses = Masses(numneu);
+				double checksum = 0;
+				double seconds = Time(settings.reps,[&](){
+					checksum += model->With_Masses(masses)->GetRegenerationKernel(DecayModel::CPP).size();
+				});
+				Print("model",numneu,ne,"","","",settings.reps,seconds,checksum);
+			}
+
+			for (unsigned int nzenith : settings.zenith){
+				for (unsigned int mode : settings.modes){
+					bool iinteraction = mode & 2;
+					bool decay_regen = mode & 1;
+					std::string zenith = std::to_string(nzenith);
+					std::string interactions = iinteraction ? "1" : "0";
+					std::string regeneration = decay_regen ? "1" : "0";
+
+					nuSQUIDSAtm<nuSQUIDSDecayProbe> atm(linspace(-1.,0.,nzenith-1),model,both,iinteraction,decay_regen);
+					Set_Oscillations(atm,numneu);
+					marray<double,4> inistate {atm.GetNumCos(),atm.GetNumE(),2,numneu};
+					std::fill(inistate.begin(),inistate.end(),0);
+					for (unsigned int ci = 0; ci < atm.GetNumCos(); ci++){
+						for (unsigned int ie = 0; ie < atm.GetNumE(); ie++){
+							inistate[ci][ie][0][1] = 1.0;
+							inistate[ci][ie][1][1] = 1.0;
+						}
+					}
+					atm.Set_initial_state(inistate,flavor);
+
+					//The evolution also sets up every buffer for the other benchmarks.
+					auto start = std::chrono::steady_clock::now();
+					atm.EvolveState();
+					std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+					if (settings.Runs("evolve")){
+						double checksum = atm.EvalFlavor(1,-0.5,1.e3*squids::Const().GeV,0);
+						Print("evolve",numneu,ne,zenith,interactions,regeneration,1,elapsed.count(),checksum);
+					}
+
+					if (settings.Runs("prederive")){
+						double seconds = Time(settings.reps,[&](){
+							for (unsigned int ci = 0; ci < atm.GetNumCos(); ci++){
+								nuSQUIDSDecayProbe& nus = atm.GetnuSQuIDS(ci);
+								nus.AddToPreDerive(nus.Get_t());
+							}
+						});
+						Print("prederive",numneu,ne,zenith,interactions,regeneration,settings.reps,seconds,0);
+					}
+					if (settings.Runs("gamma")){
+						double checksum = 0;
+						double seconds = Time(settings.reps,[&](){
+							for (unsigned int ci = 0; ci < atm.GetNumCos(); ci++){
+								nuSQUIDSDecayProbe& nus = atm.GetnuSQuIDS(ci);
+								for (unsigned int ie = 0; ie < ne; ie++){
+									for (unsigned int irho = 0; irho < 2; irho++){
+										checksum += nus.GammaRho(ie,irho)[0];
+									}
+								}
+							}
+						});
+						Print("gamma",numneu,ne,zenith,interactions,regeneration,settings.reps,seconds,checksum);
+					}
+					if (settings.Runs("interactions")){
+						double checksum = 0;
+						double seconds = Time(settings.reps,[&](){
+							for (unsigned int ci = 0; ci < atm.GetNumCos(); ci++){
+								nuSQUIDSDecayProbe& nus = atm.GetnuSQuIDS(ci);
+								for (unsigned int ie = 0; ie < ne; ie++){
+									for (unsigned int irho = 0; irho < 2; irho++){
+										checksum += nus.InteractionsRho(ie,irho)[0];
+									}
+								}
+							}
+						});
+						Print("interactions",numneu,ne,zenith,interactions,regeneration,settings.reps,seconds,checksum);
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
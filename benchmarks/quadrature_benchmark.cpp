@@ -0,0 +1,89 @@
+/*========================="Quadrature" Benchmark==========================//
+Measures the convergence of the quadrature rules of the decay regeneration
+integral (see DecayModel::Quadrature) with the number of energy nodes.
+	The regeneration integral of the m_4->m_3 channel (scalar couplings,
+m_4 = 1 eV) is evaluated with the precomputed kernel of DecayModel for a
+parent density falling as E^-2.7, on logarithmic grids from 100 GeV to
+1 PeV whose nodes are nested: every grid contains all the nodes of the
+coarser ones. The errors are measured at the nodes of the coarsest grid,
+against the Simpson rule on the finest grid, and the largest relative
+error of each rule, grid and process (CPP, CVP) is printed as CSV:
+   quadrature,ne,process,max_rel_error
+Arguments: the number of intervals of the coarsest grid and the number of
+grids (default: 25 6), each grid having twice the intervals of the last.
+//==========================================================================*/
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include "nusquids_decay_model.h"
+
+using namespace nusquids;
+
+//Regeneration integral of channel (3,2) at every daughter node of a model, for parent density E^-2.7.
+std::vector<double> Regeneration(const DecayModel& model, unsigned int chi){
+	const unsigned int numneu = model.GetNumNeu();
+	const marray<double,1>& e_range = model.GetERange();
+	unsigned int ne = e_range.size();
+	const std::vector<size_t>& offsets = model.GetRegenerationKernelOffset();
+	const std::vector<double>& kernel = model.GetRegenerationKernel(chi);
+	std::vector<double> result(ne,0);
+	for (unsigned int ie = 0; ie < ne; ie++){
+		size_t channel = (3*numneu + 2)*ne + ie;
+		for (size_t n = offsets[channel]; n < offsets[channel+1]; n++){
+			double eparent = e_range[ie + n - offsets[channel]];
+			result[ie] += kernel[n]*std::pow(eparent/e_range[0],-2.7);
+		}
+	}
+	return result;
+}
+
+int main(int argc, char** argv){
+	unsigned int coarse = (argc >= 2) ? std::stoul(argv[1]) : 25;
+	unsigned int ngrids = (argc >= 3) ? std::stoul(argv[2]) : 6;
+	const squids::Const units;
+	const unsigned int numneu = 4;
+	std::vector<double> nu_mass{0.0,sqrt(7.65e-05),sqrt(0.0024),1.0};
+	gsl_matrix* couplings = gsl_matrix_alloc(numneu,numneu);
+	gsl_matrix_set_zero(couplings);
+	gsl_matrix_set(couplings,3,2,1.0); //g_43
+
+	const std::vector<std::pair<std::string,DecayModel::Quadrature>> rules{
+		{"left",DecayModel::Quadrature::Left},
+		{"trapezoid",DecayModel::Quadrature::Trapezoid},
+		{"simpson",DecayModel::Quadrature::Simpson},
+		{"log_trapezoid",DecayModel::Quadrature::LogTrapezoid}};
+	const char* process[2] = {"CPP","CVP"};
+
+	auto grid = [&](unsigned int g){ return logspace(1.e2*units.GeV,1.e6*units.GeV,coarse << g); };
+	//Reference: the Simpson rule on the finest grid, at the nodes of the coarsest one.
+	unsigned int finest = ngrids-1;
+	DecayModel reference_model(grid(finest),numneu,false,nu_mass,couplings,DecayModel::Quadrature::Simpson);
+	std::vector<double> reference[2];
+	for (unsigned int chi = 0; chi < 2; chi++){
+		reference[chi] = Regeneration(reference_model,chi);
+	}
+
+	std::cout << "quadrature,ne,process,max_rel_error" << std::endl;
+	for (const auto& rule : rules){
+		for (unsigned int g = 0; g < finest; g++){
+			DecayModel model(grid(g),numneu,false,nu_mass,couplings,rule.second);
+			for (unsigned int chi = 0; chi < 2; chi++){
+				std::vector<double> result = Regeneration(model,chi);
+				double error = 0;
+				for (unsigned int ic = 0; ic <= coarse; ic++){
+					double ref = reference[chi][ic << finest];
+					if (ref != 0){
+						error = std::max(error,std::fabs(result[ic << g]/ref - 1));
+					}
+				}
+				std::cout << rule.first << ',' << model.GetERange().size() << ',' << process[chi] << ',' << error << std::endl;
+			}
+		}
+	}
+	gsl_matrix_free(couplings);
+	return 0;
+}
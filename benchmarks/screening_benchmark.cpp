@@ -0,0 +1,201 @@
+/*========================="Screening" Benchmark==========================//
+Compares the mixed precision screening mode of nuSQUIDSDecay (see
+nuSQUIDSDecay::Set_ScreeningMode()) with the full precision evolution, and
+prints the results as CSV.
+	For every number of states and number of energy nodes, a nuSQUIDSDecay
+object with interactions and decay regeneration (m_n->m_{n-1} decay only,
+scalar couplings) evolves a muon flavor flux of 1 at every node, for both nu
+and nubar, through a constant density layer: once in double precision with
+the reference tolerance, and once in screening mode with the screening
+tolerance. Each line gives, for one of the two runs:
+ - seconds: wall time of EvolveState(),
+ - rhs_evaluations: derivative evaluations of the integrator,
+ - max_abs_deviation: the largest difference of a flavor flux at a node
+   from the double precision run (0 for that run),
+ - max_rel_deviation: the same relative to the double precision flux, over
+   the fluxes above 1e-6.
+	Arguments are key=value pairs, with comma separated lists:
+   numneu=3,4 ne=50,200 tolerance=1e-12 screening_tolerance=1e-6
+   coupling=1 length=3000
+where length is the layer thickness in km.
+//==========================================================================*/
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <stdexcept>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include "nusquids_decay.h"
+
+using namespace nusquids;
+
+struct Settings {
+	std::vector<unsigned int> numneu{3,4};
+	std::vector<unsigned int> ne{50,200};
+	double tolerance=1e-12;
+	double screening_tolerance=1e-6;
+	double coupling=1;
+	double length=3000;
+};
+
+std::vector<unsigned int> Split_Unsigned(const std::string& list){
+	std::vector<unsigned int> values;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss,item,',')){
+		values.push_back(std::stoul(item));
+	}
+	return values;
+}
+
+Settings Parse(int argc, char** argv){
+	Settings settings;
+	for (int i = 1; i < argc; i++){
+		std::string arg(argv[i]);
+		size_t eq = arg.find('=');
+		if (eq == std::string::npos){
+			throw std::runtime_error("expected key=value, got " + arg);
+		}
+		std::string key = arg.substr(0,eq);
+		std::string value = arg.substr(eq+1);
+		if (key == "numneu"){ settings.numneu = Split_Unsigned(value); }
+		else if (key == "ne"){ settings.ne = Split_Unsigned(value); }
+		else if (key == "tolerance"){ settings.tolerance = std::stod(value); }
+		else if (key == "screening_tolerance"){ settings.screening_tolerance = std::stod(value); }
+		else if (key == "coupling"){ settings.coupling = std::stod(value); }
+		else if (key == "length"){ settings.length = std::stod(value); }
+		else{ throw std::runtime_error("unknown argument " + key); }
+	}
+	for (unsigned int n : settings.numneu){
+		if (n < 3 || n > 6){ throw std::runtime_error("numneu must be between 3 and 6"); }
+	}
+	for (unsigned int n : settings.ne){
+		if (n < 2){ throw std::runtime_error("ne must be at least 2"); }
+	}
+	return settings;
+}
+
+//Masses of the three light states, then 1, 2 and 3 eV for the sterile ones.
+std::vector<double> Masses(unsigned int numneu){
+	std::vector<double> masses{0.0,sqrt(7.65e-05),sqrt(0.0024)};
+	for (unsigned int i = 3; i < numneu; i++){
+		masses.push_back(i-2.0);
+	}
+	return masses;
+}
+
+std::shared_ptr<const DecayModel> Model(unsigned int numneu, unsigned int ne, double coupling){
+	const squids::Const units;
+	gsl_matrix* couplings = gsl_matrix_alloc(numneu,numneu);
+	gsl_matrix_set_zero(couplings);
+	gsl_matrix_set(couplings,numneu-1,numneu-2,coupling);
+	std::shared_ptr<const DecayModel> model;
+	try{
+		model = std::make_shared<const DecayModel>(logspace(1.e2*units.GeV,1.e6*units.GeV,ne-1),
+													numneu,false,Masses(numneu),couplings);
+	}
+	catch(...){
+		gsl_matrix_free(couplings);
+		throw;
+	}
+	gsl_matrix_free(couplings);
+	return model;
+}
+
+struct Run {
+	double seconds = 0;
+	unsigned long rhs_evaluations = 0;
+	//! Flavor fluxes, indexed (ie*numneu + flavor)*2 + irho.
+	std::vector<double> flux;
+};
+
+Run Evolve(std::shared_ptr<const DecayModel> model, const Settings& settings, bool screening){
+	const squids::Const units;
+	unsigned int numneu = model->GetNumNeu();
+	unsigned int ne = model->GetERange().size();
+	nuSQUIDSDecay nus(model,both,true,true);
+	nus.Set_ProgressBar(false);
+	nus.Set_Body(std::make_shared<ConstantDensity>(5.0,0.5));
+	nus.Set_Track(std::make_shared<ConstantDensity::Track>(settings.length*units.km));
+	std::vector<double> masses = Masses(numneu);
+	nus.Set_MixingAngle(0,1,0.563942);
+	nus.Set_MixingAngle(0,2,0.154085);
+	nus.Set_MixingAngle(1,2,0.785398);
+	for (unsigned int i = 3; i < numneu; i++){
+		nus.Set_MixingAngle(1,i,0.2);
+	}
+	nus.Set_SquareMassDifference(1,7.65e-05);
+	nus.Set_SquareMassDifference(2,0.00247);
+	for (unsigned int i = 3; i < numneu; i++){
+		nus.Set_SquareMassDifference(i,masses[i]*masses[i]);
+	}
+	nus.Set_rel_error(settings.tolerance);
+	nus.Set_abs_error(settings.tolerance);
+	if (screening){
+		nus.Set_ScreeningMode(true,settings.screening_tolerance);
+	}
+	marray<double,3> inistate {ne,2,numneu};
+	std::fill(inistate.begin(),inistate.end(),0);
+	for (unsigned int ie = 0; ie < ne; ie++){
+		inistate[ie][0][1] = 1.0;
+		inistate[ie][1][1] = 1.0;
+	}
+	nus.Set_initial_state(inistate,flavor);
+
+	Run run;
+	auto start = std::chrono::steady_clock::now();
+	nus.EvolveState();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	run.seconds = elapsed.count();
+	run.rhs_evaluations = nus.Get_Stats().rhs_evaluations;
+	for (unsigned int ie = 0; ie < ne; ie++){
+		for (unsigned int flv = 0; flv < numneu; flv++){
+			for (unsigned int irho = 0; irho < 2; irho++){
+				run.flux.push_back(nus.EvalFlavorAtNode(flv,ie,irho));
+			}
+		}
+	}
+	return run;
+}
+
+void Print(const std::string& mode, unsigned int numneu, unsigned int ne, double tolerance,
+		   const Run& run, const Run& reference){
+	double max_abs = 0, max_rel = 0;
+	for (size_t i = 0; i < run.flux.size(); i++){
+		double deviation = std::abs(run.flux[i] - reference.flux[i]);
+		max_abs = std::max(max_abs,deviation);
+		if (std::abs(reference.flux[i]) > 1e-6){
+			max_rel = std::max(max_rel,deviation/std::abs(reference.flux[i]));
+		}
+	}
+	std::cout << mode << ',' << numneu << ',' << ne << ',' << tolerance << ',' << run.seconds << ','
+			  << run.rhs_evaluations << ',' << max_abs << ',' << max_rel << std::endl;
+}
+
+int main(int argc, char** argv){
+	Settings settings;
+	try{
+		settings = Parse(argc,argv);
+	}
+	catch(std::exception& e){
+		std::cerr << "screening_benchmark: " << e.what() << std::endl;
+		return 1;
+	}
+	std::cout.precision(6);
+	std::cout << "mode,numneu,ne,tolerance,seconds,rhs_evaluations,max_abs_deviation,max_rel_deviation" << std::endl;
+
+	for (unsigned int numneu : settings.numneu){
+		for (unsigned int ne : settings.ne){
+			std::shared_ptr<const DecayModel> model = Model(numneu,ne,settings.coupling);
+			Run reference = Evolve(model,settings,false);
+			Run screening = Evolve(model,settings,true);
+			Print("double",numneu,ne,settings.tolerance,reference,reference);
+			Print("screening",numneu,ne,settings.screening_tolerance,screening,reference);
+		}
+	}
+	return 0;
+}
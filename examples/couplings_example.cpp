@@ -30,6 +30,8 @@ automatically, so we do not need to set the majorana flag.
 #include <nuSQuIDS/marray.h>
 #include <nuSQuIDS/tools.h>
 #include "nusquids_decay.h"
+#include "nusquids_decay_flux.h"
+#include "nusquids_decay_atm.h"
 
 using namespace nusquids;
 
@@ -56,23 +58,25 @@ void ReadFlux(std::shared_ptr<nuSQUIDSAtm<nuSQUIDSDecay>> nusquids, marray<doubl
 				std::string input_flux_path, std::string modelname, double GeV){
 
 	std::fill(inistate.begin(),inistate.end(),0);
-	// read file
-	marray<double,2> input_flux = quickread(input_flux_path + "/" + "initial_"+ type + "_atmopheric_" + modelname + ".dat");
+	// read file, through its binary sidecar (see FluxTable)
+	std::shared_ptr<const FluxTable> input_flux = FluxTable::Open(input_flux_path + "/" + "initial_"+ type + "_atmopheric_" + modelname + ".dat");
 
 	marray<double,1> cos_range = nusquids->GetCosthRange();
 	marray<double,1> e_range = nusquids->GetERange();
+	// interpolate the table (cos(zenith), energy [GeV], nu_mu, nu_mu_bar) onto the simulation nodes
+	FluxResampler resample(*input_flux,0,1,GeV,cos_range,e_range);
 	for ( int ci = 0 ; ci < nusquids->GetNumCos(); ci++){
 		for ( int ei = 0 ; ei < nusquids->GetNumE(); ei++){
 			double enu = e_range[ei]/GeV;
 			double cth = cos_range[ci];
 
 			inistate[ci][ei][0][0] = 0.;
-			inistate[ci][ei][0][1] = input_flux[ci*e_range.size() + ei][2];
+			inistate[ci][ei][0][1] = resample(*input_flux,2,ei,ci);
 			inistate[ci][ei][0][2] = 0.;
 			inistate[ci][ei][0][3] = 0.;
 
 			inistate[ci][ei][1][0] = 0.;
-			inistate[ci][ei][1][1] = input_flux[ci*e_range.size() + ei][3];
+			inistate[ci][ei][1][1] = resample(*input_flux,3,ei,ci);
 			inistate[ci][ei][1][2] = 0.;
 			inistate[ci][ei][1][3] = 0.;
 		}
@@ -84,6 +88,8 @@ void ReadFlux(std::shared_ptr<nuSQUIDSAtm<nuSQUIDSDecay>> nusquids, marray<doubl
 int main(int argc, char** argv){
 	bool oscillogram = true;
 	bool quiet = false;
+	// number of threads evolving the zenith bins, from the first argument
+	unsigned int nthreads = (argc>=2) ? std::stoi(argv[1]) : 1;
 	// getting input parameters
 	double nu4mass, theta24;
 	nu4mass = 1.0; //Set the mass of the sterile neutrino (eV)
@@ -124,18 +130,20 @@ int main(int argc, char** argv){
 	gsl_matrix_set(couplings,3,2,coupling); //g_43
 
 	//Declare NuSQuIDSDecay objects. They are declared within a NuSQuIDSAtm wrapper to incorporate atmospheric simulation.
-	//Here, we use the partial rate constructor of NuSQuIDSDecay. One object is created for the kaon flux component, and
+	//Here, we use the model constructor of NuSQuIDSDecay, with a coupling DecayModel. One object is created for the kaon flux component, and
 	//one for the pion flux component.
-	//The first two arguments (linspaces) define ranges of cos(zenith) and energy over which to simulate, respectively.
-	//The cos(zenith) argument is passed to the wrapping class. The arguments to nuSQUIDSDecay begin at the energy argument.
+	//The decay model (masses, rates, DT and regeneration kernel) is built once on the energy grid, and is shared
+	//by every zenith bin of both objects.
+	//The first argument (linspace) defines the range of cos(zenith) over which to simulate, and is passed to the
+	//wrapping class. The arguments to nuSQUIDSDecay begin at the model argument.
 	if(!quiet){std::cout << "Declaring nuSQuIDSDecay atmospheric objects" << std::endl;}
+	std::shared_ptr<const DecayModel> decay_model = std::make_shared<const DecayModel>(logspace(1.e2*units.GeV,1.e6*units.GeV,150),
+																numneu,pscalar,nu_mass,couplings);
 	std::shared_ptr<nuSQUIDSAtm<nuSQUIDSDecay>> nusquids_pion = std::make_shared<nuSQUIDSAtm<nuSQUIDSDecay>>(linspace(-1.,0.2,40),
-																logspace(1.e2*units.GeV,1.e6*units.GeV,150),numneu,both,iinteraction,
-																decay_regen,pscalar,nu_mass,couplings);
+																decay_model,both,iinteraction,decay_regen);
 
 	std::shared_ptr<nuSQUIDSAtm<nuSQUIDSDecay>> nusquids_kaon = std::make_shared<nuSQUIDSAtm<nuSQUIDSDecay>>(linspace(-1.,1.0,2),
-																logspace(1.e2*units.GeV,1.e6*units.GeV,150),numneu,both,iinteraction,
-																decay_regen,pscalar,nu_mass,couplings);
+																decay_model,both,iinteraction,decay_regen);
 
 	//Include tau regeneration in simulation.
 	nusquids_kaon->Set_TauRegeneration(true);
@@ -189,11 +197,6 @@ int main(int argc, char** argv){
 	nusquids_kaon->Set_initial_state(inistate_kaon,flavor);
 	//Write initial flux to text file.
 	if(oscillogram){WriteFlux(nusquids_kaon, std::string("kaon_initial"));}
-	//Evolve flux through the earth. 
-	if(!quiet){std::cout << "Evolving the kaon fluxes." << std::endl;}
-	nusquids_kaon->EvolveState();
-	//Write final flux to text file.
-	if(oscillogram){WriteFlux(nusquids_kaon, std::string("kaon_final"));}
 
 	//Read pion flux and initialize nusquids object with it.
 	marray<double,4> inistate_pion {nusquids_pion->GetNumCos(),nusquids_pion->GetNumE(),2,numneu};
@@ -201,10 +204,15 @@ int main(int argc, char** argv){
 	nusquids_pion->Set_initial_state(inistate_pion,flavor);
 	//Write initial flux to text file.
 	if(oscillogram){WriteFlux(nusquids_pion, std::string("pion_initial"));}
-	//Evolve flux through the earth. 
-	if(!quiet){std::cout << "Evolving the pion fluxes." << std::endl;}
-	nusquids_pion->EvolveState();
-	//Write final flux to text file.
+
+	//Evolve both fluxes through the earth. The zenith bins of the kaon and
+	//pion objects are independent, and are spread over nthreads threads.
+	if(!quiet){std::cout << "Evolving the kaon and pion fluxes on " << nthreads << " threads." << std::endl;}
+	//EarthAtm is not safe to read from several threads, so each thread gets its own.
+	EvolveStateParallel<nuSQUIDSDecay>({nusquids_kaon.get(),nusquids_pion.get()},nthreads,
+		[](){ return std::make_shared<EarthAtm>(); });
+	//Write final fluxes to text files.
+	if(oscillogram){WriteFlux(nusquids_kaon, std::string("kaon_final"));}
 	if(oscillogram){WriteFlux(nusquids_pion, std::string("pion_final"));}
 
 	//Free memory for couplings 
@@ -28,14 +28,21 @@ automatically, so we do not need to set the majorana flag.
 #include <limits>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 #include <nuSQuIDS/nuSQuIDS.h>
 #include <nuSQuIDS/marray.h>
 #include <nuSQuIDS/tools.h>
 #include "nusquids_decay.h"
+#include "nusquids_decay_scan.h"
+#include "nusquids_decay_hdf5.h"
+#include "nusquids_decay_flux.h"
+#include "nusquids_decay_xsection.h"
+#include "nusquids_decay_mpi.h"
 
 using namespace nusquids;
 
-bool progressbar = 1; //show progress bar
+bool progressbar = 0; //show progress bar, see also print_stats
+bool print_stats = DecayStats::enabled; //print the counters of nuSQUIDSDecay, if compiled with NUSQUIDS_DECAY_INSTRUMENTATION
 double error = 1.0e-15;
 double density = 2.5; // gr/cm^3
 double ye = 0.3; //dimensionless electron fraction
@@ -59,33 +66,87 @@ void WriteFlux(std::shared_ptr<nuSQUIDSDecay> nusquids, std::string fname){
 }
 
 //Convenience function to read a flux file into an marray input for nuSQuIDS.
-void ReadFlux(std::shared_ptr<nuSQUIDSDecay> nusquids, marray<double,3>& inistate, std::string type,
+void ReadFlux(const marray<double,1>& e_range, marray<double,3>& inistate, std::string type,
 				std::string input_flux_path, std::string modelname, double GeV){
 
 	std::fill(inistate.begin(),inistate.end(),0);
-	// read file
-	// marray<double,2> input_flux = quickread(input_flux_path + "/" + "initial_"+ type + "_atmopheric_" + modelname + ".dat");
-	marray<double,2> input_flux = quickread(input_flux_path + "/" + "MicroBooNE_SQuIDSFormat_Flux_All.dat");
-	// marray<double,2> input_flux = quickread(input_flux_path + "/" + "initial_pion_atmopheric_PolyGonato_QGSJET-II-04.dat");
-
-
-	marray<double,1> e_range = nusquids->GetERange();
-	
-	for ( int ei = 0 ; ei < nusquids->GetNumE(); ei++){
+	// read file, through its binary sidecar (see FluxTable)
+	// std::shared_ptr<const FluxTable> input_flux = FluxTable::Open(input_flux_path + "/" + "initial_"+ type + "_atmopheric_" + modelname + ".dat");
+	std::shared_ptr<const FluxTable> input_flux = FluxTable::Open(input_flux_path + "/" + "MicroBooNE_SQuIDSFormat_Flux_All.dat");
+	// std::shared_ptr<const FluxTable> input_flux = FluxTable::Open(input_flux_path + "/" + "initial_pion_atmopheric_PolyGonato_QGSJET-II-04.dat");
+	// interpolate the table (energy [GeV], nu_e, nu_e_bar, nu_mu, nu_mu_bar) onto the simulation nodes
+	FluxResampler resample(*input_flux,0,GeV,e_range);
+
+	for ( unsigned int ei = 0 ; ei < e_range.size(); ei++){
 		double enu = e_range[ei]/GeV;
 
-		inistate[ei][0][0] = input_flux[ei][1];
-		inistate[ei][0][1] = input_flux[ei][3];
+		inistate[ei][0][0] = resample(*input_flux,1,ei);
+		inistate[ei][0][1] = resample(*input_flux,3,ei);
 		inistate[ei][0][2] = 0.;
 		inistate[ei][0][3] = 0.;
 
-		inistate[ei][1][0] = input_flux[ei][2];
-		inistate[ei][1][1] = input_flux[ei][4];
+		inistate[ei][1][0] = resample(*input_flux,2,ei);
+		inistate[ei][1][1] = resample(*input_flux,4,ei);
 		inistate[ei][1][2] = 0.;
 		inistate[ei][1][3] = 0.;
 	}
 }
 
+//Name of the output file of a parameter point.
+std::string OutputName(double nu4mass, double theta24, double coupling, std::string file_output){
+	std::ostringstream tempObj;
+	// Set Fixed -Point Notation
+	tempObj << std::fixed;
+	// Set precision to 2 digits
+	tempObj << std::setprecision(3);
+
+	std::string outstr = "ub_";
+				outstr += file_output;
+        outstr += "_m";
+	tempObj << nu4mass;
+        outstr += tempObj.str();
+        outstr += "_t";
+	tempObj.str(std::string());
+	tempObj << theta24;
+        outstr += tempObj.str();
+        outstr += "_c";
+	tempObj.str(std::string());
+	tempObj << coupling;
+        outstr += tempObj.str();
+	return outstr;
+}
+
+//Sets the oscillation parameters and integration settings of a parameter point.
+void SetParameters(nuSQUIDSDecay& nusquids, double nu4mass, double theta24, double L){
+	const squids::Const units;
+	double dm41sq = nu4mass*nu4mass; // assume m_1 is massless
+
+	//Include tau regeneration in simulation.
+	nusquids.Set_TauRegeneration(true);
+
+	//Set mixing angles and masses.
+	nusquids.Set_MixingAngle(0,1,0.563942);
+	nusquids.Set_MixingAngle(0,2,0.154085);
+	nusquids.Set_MixingAngle(1,2,0.785398);
+	nusquids.Set_MixingAngle(0,3,0.0);
+	nusquids.Set_MixingAngle(1,3,theta24*0.785398); //percent of max
+	nusquids.Set_MixingAngle(2,3,0.0);
+
+	nusquids.Set_SquareMassDifference(1,7.65e-05);
+	nusquids.Set_SquareMassDifference(2,0.00247);
+	nusquids.Set_SquareMassDifference(3,dm41sq);
+	nusquids.Set_CPPhase(0,2,0.0);
+	nusquids.Set_CPPhase(0,3,0.0);
+	nusquids.Set_CPPhase(1,3,0.0);
+
+	//Setup integration settings
+	nusquids.Set_GSL_step(gsl_odeiv2_step_rkf45);
+	nusquids.Set_rel_error(error);
+	nusquids.Set_abs_error(error);
+	nusquids.Set_h(L/500*units.km); //initial integration step size
+	nusquids.Set_h_max(L/4*units.km); //maximum integration step size
+}
+
 //====================================DECAY_EVOLVE=========================================//
 
 int Decay_Evolve(double nu4mass, double theta24, double coupling, double L = 0.47, std::string file_output="def"){
@@ -106,7 +167,6 @@ int Decay_Evolve(double nu4mass, double theta24, double coupling, double L = 0.4
 	// oscillation physics parameters and nusquids setup
 	// Note: only m_1 may be set to zero. Our computations
 	// do not apply if more than one neutrino mass is zero!
-	double dm41sq = nu4mass*nu4mass; // assume m_1 is massless
 	const unsigned int numneu = 4;
 	const squids::Const units;
 	double m1 = 0.0;
@@ -139,56 +199,13 @@ int Decay_Evolve(double nu4mass, double theta24, double coupling, double L = 0.4
   std::shared_ptr<ConstantDensity::Track> track = std::make_shared<ConstantDensity::Track>(layer);	
 
 
-	//Include tau regeneration in simulation.	
-	nusquids_pion->Set_TauRegeneration(true);
-
-	//Include tau regeneration in simulation.
 	nusquids_pion->Set_Body(constdens);
 	nusquids_pion->Set_Track(track);
 
-
-	//Set mixing angles and masses.
-	nusquids_pion->Set_MixingAngle(0,1,0.563942);
-	nusquids_pion->Set_MixingAngle(0,2,0.154085);
-	nusquids_pion->Set_MixingAngle(1,2,0.785398);
-	nusquids_pion->Set_MixingAngle(0,3,0.0);
-	nusquids_pion->Set_MixingAngle(1,3,theta24*0.785398); //percent of max
-	nusquids_pion->Set_MixingAngle(2,3,0.0);
-
-	nusquids_pion->Set_SquareMassDifference(1,7.65e-05);
-	nusquids_pion->Set_SquareMassDifference(2,0.00247);
-	nusquids_pion->Set_SquareMassDifference(3,dm41sq);
-	nusquids_pion->Set_CPPhase(0,2,0.0);
-	nusquids_pion->Set_CPPhase(0,3,0.0);
-	nusquids_pion->Set_CPPhase(1,3,0.0);
-
-	//Setup integration settings
-	nusquids_pion->Set_GSL_step(gsl_odeiv2_step_rkf45);
-	nusquids_pion->Set_rel_error(error);
-	nusquids_pion->Set_abs_error(error);
-	nusquids_pion->Set_h(L/500*units.km); //initial integration step size
-	nusquids_pion->Set_h_max(L/4*units.km); //maximum integration step size
+	SetParameters(*nusquids_pion, nu4mass, theta24, L);
 	nusquids_pion->Set_ProgressBar(progressbar);
 
-	std::ostringstream tempObj;
-	// Set Fixed -Point Notation
-	tempObj << std::fixed;
-	// Set precision to 2 digits
-	tempObj << std::setprecision(3);
-
-	std::string outstr = "ub_";
-				outstr += file_output;
-        outstr += "_m";
-	tempObj << nu4mass;
-        outstr += tempObj.str();
-        outstr += "_t";
-	tempObj.str(std::string());
-	tempObj << theta24;
-        outstr += tempObj.str();
-        outstr += "_c";
-	tempObj.str(std::string());
-	tempObj << coupling;
-        outstr += tempObj.str();
+	std::string outstr = OutputName(nu4mass, theta24, coupling, file_output);
         std::cout << outstr << '\n';
 
 
@@ -199,7 +216,7 @@ int Decay_Evolve(double nu4mass, double theta24, double coupling, double L = 0.4
 	//Read pion flux and initialize nusquids object with it.
 	marray<double,3> inistate_pion {nusquids_pion->GetNumE(),2,numneu};
 	std::cout << "Made Object\n";
-	ReadFlux(nusquids_pion,inistate_pion,std::string("NOT_USED"),input_flux_path,modelname,units.GeV);
+	ReadFlux(nusquids_pion->GetERange(),inistate_pion,std::string("NOT_USED"),input_flux_path,modelname,units.GeV);
 	std::cout << "Read Object\n";
 	nusquids_pion->Set_initial_state(inistate_pion,flavor);
 	std::cout << "Initial State Set\n";
@@ -209,6 +226,7 @@ int Decay_Evolve(double nu4mass, double theta24, double coupling, double L = 0.4
 	//Evolve flux through the earth.
 	if(!quiet){std::cout << "Evolving the pion fluxes." << std::endl;}
 	nusquids_pion->EvolveState();
+	if(print_stats){nusquids_pion->Get_Stats().Write(std::cout,numneu);}
 	//Write final flux to text file.
 	if(oscillogram){WriteFlux(nusquids_pion, outstr);}
 	std::cout << "Wrote Final\n";
@@ -223,10 +241,190 @@ int Decay_Evolve(double nu4mass, double theta24, double coupling, double L = 0.4
 
 
 
+//====================================DECAY_BASELINES=========================================//
+
+//Evolves the flux of Decay_Evolve() once to the farthest of several baselines (in km), and writes the
+//fluxes at every baseline, observed on the way (see nuSQUIDSDecay::Set_Observer()), to the HDF5 file
+//../output/<OutputName()>_baselines.h5 (see DecayObservationStore for the layout).
+int Decay_Baselines(double nu4mass, double theta24, double coupling,
+					std::vector<double> baselines = {0.11,0.47,0.6}, std::string file_output="def"){
+	const unsigned int numneu = 4;
+	const squids::Const units;
+	std::vector<double> nu_mass{0.0, sqrt(7.65e-05), sqrt(0.0024), nu4mass};
+	gsl_matrix* couplings = gsl_matrix_alloc(numneu,numneu);
+	gsl_matrix_set_zero(couplings);
+	gsl_matrix_set(couplings,3,2,coupling); //g_43
+	std::shared_ptr<nuSQUIDSDecay> nusquids = std::make_shared<nuSQUIDSDecay>(linspace(2.5e-2*units.GeV,9.975e0*units.GeV,200),numneu,both,true,
+																			true,false,nu_mass,couplings);
+	gsl_matrix_free(couplings);
+
+	std::sort(baselines.begin(),baselines.end());
+	double L = baselines.back();
+	nusquids->Set_Body(std::make_shared<ConstantDensity>(density,ye));
+	nusquids->Set_Track(std::make_shared<ConstantDensity::Track>(L*units.km));
+	SetParameters(*nusquids, nu4mass, theta24, L);
+	nusquids->Set_ProgressBar(progressbar);
+
+	marray<double,3> inistate {nusquids->GetNumE(),2,numneu};
+	ReadFlux(nusquids->GetERange(),inistate,std::string("NOT_USED"),"../fluxes","PolyGonato_QGSJET-II-04",units.GeV);
+	nusquids->Set_initial_state(inistate,flavor);
+
+	std::vector<double> positions;
+	for (double baseline : baselines){positions.push_back(baseline*units.km);}
+	DecayObservationStore store("../output/" + OutputName(nu4mass, theta24, coupling, file_output) + "_baselines.h5",
+								positions, nusquids->GetERange(), numneu, 2);
+	nusquids->Set_Observer(positions, store.Observer());
+	std::cout << "Evolving the pion fluxes through " << baselines.size() << " baselines." << std::endl;
+	nusquids->EvolveState();
+	if(print_stats){nusquids->Get_Stats().Write(std::cout,numneu);}
+	return 0;
+}
+
+//====================================DECAY_SCAN=========================================//
+
+//Parameter grid of the scans: (nu4mass, theta24, coupling).
+DecayScanAxes Decay_Scan_Axes(){
+	DecayScanAxes axes;
+	for (double mi = 0; mi <= 50; mi++){axes.nu4mass.push_back(mi/10);}
+	for (double ti = 0; ti <= 20; ti++){axes.theta24.push_back(ti/20);}
+	for (double ci = 0; ci <= 40; ci++){axes.coupling.push_back(ci/4);}
+	return axes;
+}
+
+//Settings shared by every point of the scans: energy grid, flux, body and cross sections.
+//The cross sections are tabulated on the nodes once and kept on disk for the next scans;
+//if compute_xs is false, the table must already be on disk.
+DecayScanSettings Decay_Scan_Settings(double L, bool compute_xs = true){
+	const unsigned int numneu = 4;
+	const squids::Const units;
+
+	DecayScanSettings settings;
+	settings.e_nodes = linspace(2.5e-2*units.GeV,9.975e0*units.GeV,200);
+	settings.numneu = numneu;
+	settings.iinteraction = true;
+	settings.decay_regen = true;
+	settings.pscalar = false;
+	settings.light_masses = {0.0, sqrt(7.65e-05), sqrt(0.0024)};
+	settings.parent = 3; //g_43
+	settings.daughter = 2;
+	const std::string xs_file = "../output/ub_xs_cache.h5";
+	std::shared_ptr<const NeutrinoCrossSections> xs = std::make_shared<const NeutrinoDISCrossSectionsFromTablesExtended>();
+	std::shared_ptr<DecayCrossSectionCache> xs_cache = compute_xs ?
+		DecayCrossSectionCache::Load_Or_Compute(xs_file,xs,settings.e_nodes) :
+		DecayCrossSectionCache::Load(xs_file,xs,settings.e_nodes);
+	settings.ncs = DecayCrossSectionCache::Library(xs_cache);
+	settings.body = std::make_shared<ConstantDensity>(density,ye);
+	const double layer = L*units.km;
+	settings.make_track = [layer](){ return std::make_shared<ConstantDensity::Track>(layer); };
+	std::shared_ptr<marray<double,3>> inistate = std::make_shared<marray<double,3>>(marray<double,3>{settings.e_nodes.size(),2,numneu});
+	ReadFlux(settings.e_nodes,*inistate,std::string("NOT_USED"),"../fluxes","PolyGonato_QGSJET-II-04",units.GeV);
+	settings.initial_flux = inistate;
+	settings.configure = [L](nuSQUIDSDecay& nusquids, const DecayScanPoint& point){
+		SetParameters(nusquids, point.nu4mass, point.theta24, L);
+	};
+	return settings;
+}
+
+//Prints the progress of a scan every 10 seconds.
+void Print_Scan_Progress(DecayScan& scan){
+	scan.Set_ProgressCallback([](const DecayScanProgress& p){
+		std::cout << "progress " << p.done + p.skipped << "/" << p.total << " failed " << p.failed
+				  << " points/s " << p.points_per_second << " rhs/s " << p.rhs_per_second << std::endl;
+	}, 10);
+}
+
+//Runs Decay_Evolve() over the full (nu4mass, theta24, coupling) grid in one process.
+//The energy grid, flux, body and cross sections are set up once and shared by all points,
+//and the points are spread over nthreads threads. All final fluxes are written to a single
+//HDF5 file, ../output/ub_<file_output>_scan.h5 (see DecayScanStore for the layout).
+int Decay_Scan(unsigned int nthreads, bool adaptive = false, double L = 0.47, std::string file_output="def"){
+	DecayScanAxes axes = Decay_Scan_Axes();
+	DecayScanSettings settings = Decay_Scan_Settings(L);
+
+	DecayScan scan(axes, settings);
+	scan.Set_NumThreads(nthreads);
+	//An existing file of the same grid is resumed: its completed points are not evaluated again.
+	DecayScanStore store("../output/ub_" + file_output + "_scan.h5", axes, settings, settings.initial_flux.get(), true);
+	size_t written = 0;
+	scan.Set_ResultCallback([&](const DecayScanResult& result){
+		if (!result.success){
+			std::cout << "Point " << result.point.index << " failed: " << result.error << std::endl;
+		}
+		store.Write(result);
+		//Keep the file readable if the scan is interrupted.
+		if (++written % 100 == 0){store.Flush();}
+	});
+	Print_Scan_Progress(scan);
+	std::cout << "Scanning " << axes.Size() << " points on " << nthreads << " threads" << std::endl;
+	if (adaptive){
+		//Evaluates a coarse grid, and refines it only where the fluxes change.
+		scan.Run_Adaptive();
+	}
+	else{
+		scan.Run(store.Completed());
+	}
+	if(print_stats){scan.Get_Stats().Write(std::cout,settings.numneu);}
+	return 0;
+}
+
+#ifdef NUSQUIDS_DECAY_MPI
+//Runs the same grid as Decay_Scan() over the ranks of MPI_COMM_WORLD, each with nthreads threads
+//(e.g. mpirun -n 4 ./uBFlux_example.exe mpi_scan 8). Every rank writes its own points to the shared file
+//../output/ub_<file_output>_scan.h5, through parallel HDF5.
+int Decay_Scan_MPI(int& argc, char**& argv, unsigned int nthreads, double L = 0.47, std::string file_output="def"){
+	int provided = MPI_THREAD_SINGLE;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_SERIALIZED,&provided);
+	int rank = 0;
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	{
+		DecayScanAxes axes = Decay_Scan_Axes();
+		//Rank 0 tabulates the cross sections if needed, so the other ranks only read them.
+		std::unique_ptr<DecayScanSettings> settings;
+		if (rank == 0){settings.reset(new DecayScanSettings(Decay_Scan_Settings(L)));}
+		MPI_Barrier(MPI_COMM_WORLD);
+		if (rank != 0){settings.reset(new DecayScanSettings(Decay_Scan_Settings(L,false)));}
+
+		DecayScan scan(axes, *settings);
+		scan.Set_NumThreads(nthreads);
+		DecayScanStore store("../output/ub_" + file_output + "_scan.h5", axes, *settings, settings->initial_flux.get(), MPI_COMM_WORLD);
+		scan.Set_ResultCallback([&](const DecayScanResult& result){
+			if (!result.success){
+				std::cout << "Point " << result.point.index << " failed: " << result.error << std::endl;
+			}
+			store.Write(result);
+		});
+		DecayMPIScan mpi_scan(scan, MPI_COMM_WORLD);
+		if (rank == 0){
+			std::cout << "Scanning " << axes.Size() << " points on " << mpi_scan.Get_Size()
+					  << " ranks of " << nthreads << " threads" << std::endl;
+		}
+		mpi_scan.Run();
+		std::cout << "Rank " << rank << " evaluated " << mpi_scan.Get_Evaluated() << " points" << std::endl;
+		if(print_stats){scan.Get_Stats().Write(std::cout,settings->numneu);}
+	}
+	MPI_Finalize();
+	return 0;
+}
+#endif
+
 //====================================MAIN=========================================//
 
 int main(int argc, char** argv){
 
+	// "scan [nthreads]" evaluates the full parameter grid in this process,
+	// "adaptive_scan [nthreads]" only where the fluxes change (see DecayScan::Run_Adaptive()).
+	if (argc>=2 && (std::string(argv[1])=="scan" || std::string(argv[1])=="adaptive_scan")){
+	  unsigned int nthreads = (argc>=3) ? std::stoi(argv[2]) : std::thread::hardware_concurrency();
+	  return Decay_Scan(nthreads, std::string(argv[1])=="adaptive_scan");
+	}
+#ifdef NUSQUIDS_DECAY_MPI
+	// "mpi_scan [nthreads]" shares the full grid between the ranks of the MPI job.
+	if (argc>=2 && std::string(argv[1])=="mpi_scan"){
+	  unsigned int nthreads = (argc>=3) ? std::stoi(argv[2]) : std::thread::hardware_concurrency();
+	  return Decay_Scan_MPI(argc, argv, nthreads);
+	}
+#endif
+
 	// getting input parameters
 	double nu4mass, theta24, coupling;
 	if (argc>=4){
@@ -244,20 +442,12 @@ int main(int argc, char** argv){
 	  coupling=1.0;
 	}
 
+	// "... baselines" observes the SBN baselines in one evolution, see Decay_Baselines().
+	if (argc>=5 && std::string(argv[4])=="baselines"){
+	  return Decay_Baselines(nu4mass, theta24, coupling);
+	}
+
 	Decay_Evolve(nu4mass, theta24, coupling);
-	
-	/*		
-	for (double ci= 0; ci <= 40; ci++){
-	  for (double ti = 0; ti <= 20; ti ++){
-	      for (double mi = 0; mi <= 50; mi++){
-		nu4mass = mi/10;
-		theta24 = ti/20;
-		coupling = ci/4;
-		Decay_Evolve(nu4mass, theta24, coupling);
-	      }
-	    }
-       	}
-*/	
 
 	return 0;
 }
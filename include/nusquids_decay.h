@@ -19,27 +19,28 @@ Janet Conrad (conrad@mit.edu)
 
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <new>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_odeiv2.h>
 #include <nuSQuIDS/nuSQuIDS.h>
 #include "exCross.h"
+#include "nusquids_decay_threads.h"
+#include "nusquids_decay_model.h"
+#include "nusquids_decay_expm.h"
+#include "nusquids_decay_stats.h"
+#include "nusquids_decay_simd.h"
+#include "nusquids_decay_snapshot.h"
+#include "nusquids_decay_observer.h"
 
 namespace nusquids {
 
 class nuSQUIDSDecay : public nuSQUIDS {
 private:
 	//-----------------------------Variables----------------------------//
-	//! Toggles Majorana or Dirac neutrinos
-	/*!
-	If neutrinos are Dirac, the chirality violating process
-	induces decay into right-handed neutrinos, which do not
-	contribute to regeneration.
-	If neutrinos are Majorana, the chirality violating process
-	induces decay into left-handed antineutrinos, which do contribute
-	to regeneration. This switch alters the regeneration calculation
-	(see InteractionsRho())
-	Default: false.
-	*/
-	bool majorana=false;
-
 	//! Toggles additional incoherent interactions
 	/*!
 	See Set_DecayRegeneration() for details.
@@ -47,337 +48,516 @@ private:
 	bool ihard_interactions=false;
 
 	//Chirality Preserving Process or Chirality Violating Process
-	enum{CPP,CVP};
+	enum{CPP=DecayModel::CPP,CVP=DecayModel::CVP};
 
-	//! Toggles scalar or pseudoscalar couplings.
+	//! The decay physics: masses, couplings, rates, DT and the regeneration kernel.
 	/*!
-	For the time being, we are considering either purely scalar or
-	purely pseudoscalar couplings. This switch takes the value false in the 
-	scalar case, and true in the pseudoscalar case. Its value will be set in 
-	the constructor.
+	Read only, and possibly shared with other objects on the same energy grid.
+	See DecayModel and Set_DecayModel().
 	*/
-	bool pscalar;
+	std::shared_ptr<const DecayModel> model;
 
-	//Parent<->Row, Daughter<->Column (lower triangular)
-	//One for each of {CPP,CVP}
+	//! The "Gamma" matrix in evolving basis.
+	std::vector<squids::SU_vector> DT_evol;
 
-	//! The coupling matrices, g_ij.
+	//! Model for which DT_evol and #DT_evol_scaled were prepared, see Prepare_DT().
 	/*!
-	The row index corresponds to the parent mass state, and the column to
-	the daughter. The matrix will then be strictly lower triangular.
+	Held so that a new model is never mistaken for a freed one at the same address.
 	*/
-	gsl_matrix* couplings;
+	std::shared_ptr<const DecayModel> DT_model;
+
+	//! True if DT commutes with H0, so that DT_evol is DT at all times. See Prepare_DT().
+	bool DT_static=false;
 
-	//! The decay rate matrices, Gamma_ij.
+	//! True if DT is zero, i.e. there is no decay.
+	bool DT_zero=false;
+
+	//! H0(E_range[ie], 0), cached for the evolution of a DT which does not commute with it.
+	std::vector<squids::SU_vector> H0_mass;
+
+	//! Components of DT_evol[ie]*(0.5/E_range[ie]), the decay term returned by GammaRho().
 	/*!
-	There are two rate matrices, one for each element of
-	{CPP,CVP}. The row index of each
-	corresponds to the parent mass state, and the column to
-	the daughter. The matrix is then strictly lower-triangular.
-	These decay rates are computed in the *rest frame* of the
-	parent. Eqns. (2) and (3) in [1] are lab-frame, and differ
-	by a factor of 1/gamma.
+	The nsun*nsun components of each energy node are stored contiguously, see Buffer_View().
+	Filled by Prepare_DT(), and updated in AddToPreDerive() only if DT does not commute
+	with H0, so that GammaRho() does not need to construct a new SU_vector.
 	*/
-	gsl_matrix* rate_matrices[2];
+	std::vector<double> DT_evol_scaled;
+
+	//! Toggles decay regeneration. See Set_DecayRegeneration().
+	bool idecay_regeneration=false;
 
-	//! Vector of neutrino masses.
+	//! Toggles the batched evaluation of the regeneration term.
 	/*!
-	The lightest mass may be zero, but all other neutrino masses
-	must be non-zero.
+	See Set_BatchedRegeneration().
+	Default: true.
 	*/
-	std::vector<double> m_nu;
+	bool ibatched_regeneration=true;
 
-	//! The "Gamma" matrix appearing in the full Hamiltonian.
+	//! Toggles the analytic evolution of constant density problems without regeneration.
 	/*!
-	Encodes the loss of probability current from a given energy bin,
-	due to decay.
+	See Set_AnalyticEvolution() and EvolveState().
+	Default: true.
 	*/
-	squids::SU_vector DT;
+	bool ianalytic_evolution=true;
 
-	//! The "Gamma" matrix in evolving basis.
-	std::vector<squids::SU_vector> DT_evol;
+	//! Parent densities projected onto the mass states, at the current derivative evaluation.
+	/*!
+	Entry (irho*numneu + i)*ne + ie holds state[ie].rho[irho]*evol_b0_proj[irho][i][ie].
+	Only filled in batched mode, see Compute_Decay_Regeneration().
+	*/
+	std::vector<double> parent_projections;
 
-	//----------------------------------Functions---------------------------------//
-	//Trying to keep the "model-specific" functions in private,
-	//and have moved all functions related to more general decay models
-	//to protected.
+	//! #parent_projections in single precision, used instead of it in screening mode.
+	/*!
+	See Set_ScreeningMode() and Screening().
+	*/
+	std::vector<float> parent_projections_single;
+
+	//! Components of the decay regeneration term of every energy node at the current derivative evaluation.
+	/*!
+	Entry irho*ne + ie (see Buffer_View()) is returned by InteractionsRho(ie,irho) in batched mode.
+	*/
+	std::vector<double> decay_regeneration_cache;
+
+	//! Weight of each SU_vector component in the dot product of two SU_vectors.
+	/*!
+	The SU(N) basis of SQuIDS is orthogonal, so that a*b is the sum over the
+	components k of component_weights[k]*a[k]*b[k]. The weights let the
+	batched regeneration kernels compute the projections on raw components. Filled by
+	Compute_Component_Weights().
+	*/
+	std::vector<double> component_weights;
 
-	//! Kinematic funtion m_j*f(x_i/x_j), related to equation (4a) in [1].
+	//! Threads used to split the per-energy work of AddToPreDerive().
 	/*!
-	In this and the other auxiliary kinematic function definitions, the modification
-	is to make the m_j->0 limit numerically well defined. Luckily, the cmath pow()
-	function implicitly takes the limit: pow(0,0)=1, so we're happy.
-	\param m_i is the parent neutrino mass.
-	\param m_j is the daughter neutrino mass.
+	Null unless more than one thread was requested with Set_NumThreads().
 	*/
-	double f(double m_i, double m_j) const {
-		double result = m_i/2.0 + 2.0*m_j + (2.0*m_j/m_i)*(m_j*log(m_i) - log(pow(m_j,m_j))) - (2.0*m_j*m_j*m_j/(m_i*m_i)) - (m_j*m_j*m_j*m_j/(2.0*m_i*m_i*m_i));
-		return result;
+	std::unique_ptr<DecayThreadPool> thread_pool;
+
+	//! Instrumentation counters, see Get_Stats(). Only updated with NUSQUIDS_DECAY_INSTRUMENTATION.
+	mutable DecayStats stats;
+
+	//! Accepted steps of the last numerical evolution, see Get_Snapshot().
+	/*!
+	Recorded by Record_Attempt(). Clearing it keeps its capacity, so once an
+	evolution grew it, the next evolutions record their steps without allocating.
+	*/
+	DecayEvolutionSnapshot snapshot;
+
+	//! Step type of the numerical integration, see Set_GSL_step(). The integrator calls it through Recording_Step_Type().
+	const gsl_odeiv2_step_type* step_type = nullptr;
+
+	//! Initial step last set with Set_h() or Warm_Start(), or 0 if none was.
+	/*!
+	The integrator overwrites its step as it goes, so EvolveComponents() keeps
+	this one to start every component from the same step.
+	*/
+	double requested_h = 0;
+
+	//! Tolerances last set with Set_rel_error() and Set_abs_error(), or 0 if none was.
+	/*!
+	Set_ScreeningMode() relaxes the tolerances of the integrator, and restores
+	these ones when the mode is switched off.
+	*/
+	double requested_rel_error = 0;
+	double requested_abs_error = 0;
+
+	//! True while Set_ScreeningMode() holds relaxed tolerances in place of the requested ones.
+	bool screening_tolerances = false;
+
+	//! Final states of the flux components of the last EvolveComponents().
+	/*!
+	Entry [k][ie*nrhos + irho] is the density matrix of component k, in the
+	interaction picture at the end of the track. See Superpose().
+	*/
+	std::vector<std::vector<squids::SU_vector>> component_states;
+
+	//! Positions of the track observed by EvolveState(), in increasing order. See Set_Observer().
+	std::vector<double> observer_positions;
+
+	//! Called at each of #observer_positions, or empty.
+	DecayObserver observer;
+
+	//! Fluxes of the current observation, reused at every position. See Observe().
+	std::vector<double> observation_flux;
+
+	//----------------------------------Functions---------------------------------//
+	//The decay model itself (kinematics, rates, DT and the regeneration kernel)
+	//lives in DecayModel. Functions which depend on the state are in protected.
+
+	//! Returns the model, or throws if none was set.
+	const DecayModel& Model() const {
+		if (!model){
+			throw std::runtime_error("nuSQUIDSDecay: no decay model was set.");
+		}
+		return *model;
+	}
+
+	//! True if the regeneration kernels of the model are stored in single precision, see Set_ScreeningMode().
+	bool Screening() const {
+		return Model().GetPrecision() == DecayModel::Precision::Single;
+	}
+
+	//! Checks that a model can be used by this object.
+	void Check_Model(const std::shared_ptr<const DecayModel>& model_) const {
+		if (!model_){
+			throw std::runtime_error("nuSQUIDSDecay: the decay model is null.");
+		}
+		if (model_->GetNumNeu() != numneu || !model_->Matches(E_range)){
+			throw std::runtime_error("nuSQUIDSDecay: the decay model does not match the neutrino states or energy nodes.");
+		}
+	}
+
+	//! Returns a model, or throws if it is null. Used by the "model" constructor.
+	static const DecayModel& Non_Null(const std::shared_ptr<const DecayModel>& model_){
+		if (!model_){
+			throw std::runtime_error("nuSQUIDSDecay: the decay model is null.");
+		}
+		return *model_;
 	}
-	//! Kinematic funtion m_j*g(x_i/x_j), related to equation (4b) in [1].
+
+	//! Sets decay regeneration, which the model may not allow.
 	/*!
-	\param m_i is the parent neutrino mass.
-	\param m_j is the daughter neutrino mass.
+	If the neutrino is majorana, both CPP and CVP processes contribute to regeneration,
+	and CVP sends neutrinos to antineutrinos. If the neutrino is Dirac, there is no CPP,
+	and the CVP sends left-handed neutrinos to right-handed neutrinos, which are sterile,
+	and therefore do not contribute to regeneration of visible neutrino flux. That is to say,
+	the regeneration terms are automatically zero if the neutrino is Dirac.
 	*/
-	double g(double m_i, double m_j) const {
-		double result = m_i/2.0 - 2.0*m_j + (2.0*m_j/m_i)*(m_j*log(m_i) - log(pow(m_j,m_j))) + (2.0*m_j*m_j*m_j/(m_i*m_i)) - (m_j*m_j*m_j*m_j/(2.0*m_i*m_i*m_i));
-		return result;
+	void Set_Regeneration_For_Model(bool decay_regen_){
+		if (Model().IsMajorana()){
+			Set_DecayRegeneration(decay_regen_);
+		}
+		else{
+			Set_DecayRegeneration(false);
+		}
 	}
-	//! Kinematic funtion m_j*k(x_i/x_j), related to equation (4c) in [1].
+
+	//! nuSQUIDS::GammaRho(), timed as DecayStats::base_gamma.
+	squids::SU_vector Base_GammaRho(unsigned int ie, unsigned int irho) const {
+		NUSQUIDS_DECAY_TIME(base_gamma);
+		return nuSQUIDS::GammaRho(ie, irho);
+	}
+
+	//! nuSQUIDS::InteractionsRho(), timed as DecayStats::base_interactions.
+	squids::SU_vector Base_InteractionsRho(unsigned int ie, unsigned int irho) const {
+		NUSQUIDS_DECAY_TIME(base_interactions);
+		return nuSQUIDS::InteractionsRho(ie, irho);
+	}
+
+	//! Adds evaluations of a regeneration channel to DecayStats::channel_evaluations.
+	void Count_Channel(const DecayChannel& c, unsigned long evaluations) const {
+		stats.channel_evaluations.resize(numneu*numneu,0);
+		stats.channel_evaluations[c.parent*numneu + c.daughter] += evaluations;
+	}
+
+	//! Records a step attempted by the integrator from t, of size h.
 	/*!
-	\param m_i is the parent neutrino mass.
-	\param m_j is the daughter neutrino mass.
+	Called by the recording step type (see Recording_Step_Type()) for every
+	step the chosen step type computed. The adaptive integrator retries a
+	rejected step from the same start with a smaller size, and only moves on
+	once it accepted one, so the last attempt from each start is the accepted
+	step. The snapshot has capacity for the steps of the last evolutions (see
+	EvolveState()), so this does not allocate in steady state.
 	*/
-	double k(double m_i, double m_j) const {
-		double result = m_i/2.0 - (2.0*m_j/m_i)*(m_j*log(m_i) - log(pow(m_j,m_j))) - (m_j*m_j*m_j*m_j/(2.0*m_i*m_i*m_i));
-		return result;
+	void Record_Attempt(double t, double h){
+		double start = t - Get_t_initial();
+		if (!snapshot.step_times.empty() && snapshot.step_times.back() == start){
+			snapshot.step_sizes.back() = h;
+		}
+		else{
+			snapshot.step_times.push_back(start);
+			snapshot.step_sizes.push_back(h);
+		}
 	}
 
-	//! Computes the four decay rate matrices using the coupling matrix couplings.
+	//! State of a recording step type: the state of the wrapped step type, allocated on the first step.
+	struct Recording_Step_State {
+		const gsl_odeiv2_step_type* type;
+		void* state;
+		const gsl_odeiv2_driver* driver;
+	};
+
+	//! Returns a step type which forwards every step to the one set with Set_GSL_step(), and records it.
 	/*!
-	This function implements equations (2) and (3) of [1] to generate the two partial
-	rate matrices corresponding to each decay channel in {CPP,CVP}.
-	Decay rates are in the rest frame of the parent neutrino.
+	The step functions of GSL only see the ODE system, whose parameters SQuIDS
+	sets to the object itself: the wrapper finds the object, and the step type
+	it wraps, from there. There is one wrapper per wrapped type, created on
+	first use and kept for the life of the program, so that the integrator can
+	keep a pointer to it through moves of the object.
 	*/
-	void Compute_Rate_Matrices(){
-		//Compute *rest frame* decay rate matrices.
-		if (!pscalar){
-			//CPP,SCALAR
-			rate_matrices[CPP] = gsl_matrix_alloc(numneu,numneu);
-			for (unsigned int i=0; i<numneu; i++){
-				for (unsigned int j=0; j<i; j++){
-					double g_ij = gsl_matrix_get(couplings,i,j);
-					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*f(m_nu[i],m_nu[j]);
-					gsl_matrix_set(rate_matrices[CPP],i,j,rate);
-				}
+	static const gsl_odeiv2_step_type* Recording_Step_Type(const gsl_odeiv2_step_type* type){
+		static std::mutex mutex;
+		static std::map<const gsl_odeiv2_step_type*, gsl_odeiv2_step_type> types;
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = types.find(type);
+		if (it == types.end()){
+			gsl_odeiv2_step_type recording = {type->name, type->can_use_dydt_in, type->gives_exact_dydt_out,
+				&Recording_Alloc, &Recording_Apply, &Recording_Set_Driver, &Recording_Reset, &Recording_Order,
+				&Recording_Free};
+			it = types.emplace(type, recording).first;
+		}
+		return &it->second;
+	}
+
+	static void* Recording_Alloc(size_t){
+		return new (std::nothrow) Recording_Step_State{nullptr, nullptr, nullptr};
+	}
+
+	static int Recording_Apply(void* vstate, size_t dim, double t, double h, double y[], double yerr[],
+							   const double dydt_in[], double dydt_out[], const gsl_odeiv2_system* sys){
+		Recording_Step_State* s = static_cast<Recording_Step_State*>(vstate);
+		nuSQUIDSDecay* self = dynamic_cast<nuSQUIDSDecay*>(static_cast<squids::SQuIDS*>(sys->params));
+		if (!self){
+			return GSL_EFAILED;
+		}
+		if (s->type != self->step_type){
+			if (s->state){
+				s->type->free(s->state);
 			}
-			//CVP,SCALAR
-			rate_matrices[CVP] = gsl_matrix_alloc(numneu,numneu);
-			for (unsigned int i=0; i<numneu; i++){
-				for (unsigned int j=0; j<i; j++){
-					double g_ij = gsl_matrix_get(couplings,i,j);
-					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*k(m_nu[i],m_nu[j]);
-					gsl_matrix_set(rate_matrices[CVP],i,j,rate);
-				}
+			s->type = self->step_type;
+			s->state = s->type->alloc(dim);
+			if (!s->state){
+				s->type = nullptr;
+				return GSL_ENOMEM;
+			}
+			if (s->driver && s->type->set_driver){
+				s->type->set_driver(s->state, s->driver);
 			}
 		}
-		if (pscalar){
-			//CPP,PSEUDOSCALAR
-			rate_matrices[CPP] = gsl_matrix_alloc(numneu,numneu);
-			for (unsigned int i=0; i<numneu; i++){
-				for (unsigned int j=0; j<i; j++){
-					double g_ij = gsl_matrix_get(couplings,i,j);
-					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*g(m_nu[i],m_nu[j]);
-					gsl_matrix_set(rate_matrices[CPP],i,j,rate);
+		int status = s->type->apply(s->state, dim, t, h, y, yerr, dydt_in, dydt_out, sys);
+		if (status == GSL_SUCCESS){
+			self->Record_Attempt(t, h);
+		}
+		return status;
+	}
+
+	static int Recording_Set_Driver(void* vstate, const gsl_odeiv2_driver* d){
+		Recording_Step_State* s = static_cast<Recording_Step_State*>(vstate);
+		s->driver = d;
+		if (s->state && s->type->set_driver){
+			return s->type->set_driver(s->state, d);
+		}
+		return GSL_SUCCESS;
+	}
+
+	static int Recording_Reset(void* vstate, size_t dim){
+		Recording_Step_State* s = static_cast<Recording_Step_State*>(vstate);
+		return s->state ? s->type->reset(s->state, dim) : GSL_SUCCESS;
+	}
+
+	//! The step size control only asks for the order after a step, when the wrapped state exists.
+	static unsigned int Recording_Order(void* vstate){
+		Recording_Step_State* s = static_cast<Recording_Step_State*>(vstate);
+		return s->state ? s->type->order(s->state) : 1;
+	}
+
+	static void Recording_Free(void* vstate){
+		Recording_Step_State* s = static_cast<Recording_Step_State*>(vstate);
+		if (s->state){
+			s->type->free(s->state);
+		}
+		delete s;
+	}
+
+	//! Returns true if EvolveState() can skip the numerical integration.
+	/*!
+	The propagator of Evolve_Analytically() updates a state stored in the
+	interaction picture, the default of nuSQuIDS: an object set to another
+	basis with Set_Basis() is integrated numerically.
+	*/
+	bool Analytic_Evolution_Applies() const {
+		return ianalytic_evolution && !ihard_interactions && !idecay_regeneration
+			&& basis == interaction && body && body->IsConstantDensity();
+	}
+
+	//! Evolves the state to the end of the track with a matrix exponential per energy node.
+	/*!
+	Without interactions or regeneration, the density matrix of each energy node
+	and rho obeys drho/dt = -i[H,rho] - {Gamma,rho}, with H = H0 + HI and Gamma
+	the decay term, and in a constant density both are constant in the
+	Schroedinger picture. The solution over the step dt is then
+	rho(dt) = U rho U^dagger, with U = exp((-iH - Gamma) dt).
+	The state is stored in the interaction picture of H0, so with HI and Gamma
+	taken in the interaction picture at the current time, as returned by HI() and
+	GammaRho(), the update of the stored state is rho -> V rho V^dagger with
+	V = exp(iH0 dt) exp((-i(H0 + HI) - Gamma) dt). H0 is diagonal in the mass
+	basis, where all matrices are expressed, so the first factor is a phase.
+	\param x_end is the position of the track to evolve to.
+	*/
+	void Evolve_Analytically(double x_end){
+		Check_Track();
+		NUSQUIDS_DECAY_COUNT(stats.analytic_evolutions++;)
+		double dt = x_end - track->GetX();
+		//Brings DT_evol_scaled, and the evolved projectors used by HI(), to the current time.
+		PreDerive(Get_t());
+		Parallel_Nodes([&](size_t begin, size_t end){
+			for (size_t ie = begin; ie < end; ie++){
+				for (unsigned int irho = 0; irho < nrhos; irho++){
+					DecayComplexMatrix v = Analytic_Propagator(ie, irho, dt);
+					DecayComplexMatrix rho(state[ie].rho[irho]);
+					state[ie].rho[irho] = (v*rho*v.Adjoint()).Hermitian_Part();
 				}
 			}
-			//CVP,PSEUDOSCALAR
-			rate_matrices[CVP] = gsl_matrix_alloc(numneu,numneu);
-			for (unsigned int i=0; i<numneu; i++){
-				for (unsigned int j=0; j<i; j++){
-					double g_ij = gsl_matrix_get(couplings,i,j);
-					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*k(m_nu[i],m_nu[j]);
-					gsl_matrix_set(rate_matrices[CVP],i,j,rate);
-				}
+		});
+		t += dt;
+		track->SetX(x_end);
+	}
+
+	//! Returns the propagator V of Evolve_Analytically() over dt, for energy node ie and rho irho.
+	/*!
+	PreDerive() must have been called at the current time.
+	*/
+	DecayComplexMatrix Analytic_Propagator(size_t ie, unsigned int irho, double dt){
+		squids::SU_vector h0 = H0(E_range[ie], irho);
+		squids::SU_vector h = h0;
+		if (CoherentRhoTerms){
+			h += HI(ie, irho);
+		}
+		DecayComplexMatrix generator(h);
+		generator *= std::complex<double>(0,-dt);
+		//Without interactions, GammaRho() is the decay term alone.
+		DecayComplexMatrix gamma(Buffer_View(DT_evol_scaled, ie));
+		gamma *= -dt;
+		generator += gamma;
+		DecayComplexMatrix v = generator.Exp();
+		DecayComplexMatrix h0_matrix(h0);
+		for (unsigned int i = 0; i < nsun; i++){
+			std::complex<double> phase = std::exp(std::complex<double>(0,h0_matrix(i,i).real()*dt));
+			for (unsigned int j = 0; j < nsun; j++){
+				v(i,j) *= phase;
 			}
 		}
+		return v;
 	}
 
-	//! Returns a sum of all Hamiltonian interaction terms except DT, the "Gamma" matrix.
+	//! Evolves the flux components together: each propagator of Evolve_Analytically() is computed once and applied to all.
 	/*!
-	The contribution from decay regeneration (the "R" terms from eqns. (18) and (19) in [1]) is computed,
-	and then additional incoherent interactions are added internally by nuSQuIDS if iinteractions is true.
-	These additional interaction regeneration terms are described in the nuSQUIDS documentation under "InteractionsRho".
-	If majorana is true, there are regeneration contributions from both CVP and CPP. Otherwise, there is no contribution 
-	because right-handed neutrinos are sterile.
-	Note that the contribution from CVP in the majorana case converts neutrinos to antineutrinos.
-	\param iedaughter is the energy index of the daughter density matrix.
-	\param irho is the neutrino/antineutrino index of the desired matrix.
-	\return the incoherent interaction matrix.
+	component_states must hold the initial states of the components.
 	*/
-
-	squids::SU_vector InteractionsRho(unsigned int iedaughter, unsigned int irho) const {
-		squids::SU_vector decay_regeneration(numneu);
-		// Get the daughter neutrino energy.
-		double edaughter = E_range[iedaughter];
-		// j-daughter index
-		for (size_t j = 0; j < numneu; j++) {
-			// i-parent index: sum over contributions from all
-			// states heavier than m_i
-			for (size_t i = j+1; i < numneu; i++) {
-				/*
-				Decay kinematics dictate an integral of the regeneration
-				contribution over parent momenta in the range [edaughter,edaughter*x_ij^2]
-				See (18) and (19) in [1]. Here, we approximate the integral with a
-				left-rectangular sum over energy bins in this range.
-				We change from x_ij to y_ij=1/x_ij to clean up behavior in the m_j-> case.
-				This is just an algebraic manipulation to keep everything stable.
-				*/
-
-				//parent-to-daughter mass ratio
-				double xij = m_nu[i]/m_nu[j];
-				double ieparent_high = nearest_element(edaughter*(xij*xij));
-				//Check that m_nu[j] is not too close to zero.
-				//if it isn't, we can use the formulae directly from the paper.	
-				if (fabs(m_nu[j]-0.0)>1e-6){
-					// i-energy (parent energy) index
-					//left-rectangular integral approximation
-					for (size_t ieparent = iedaughter; ieparent < ieparent_high-1; ieparent++) {
-						//get parent neutrino energy
-						double eparent = E_range[ieparent];
-						//boost factor to lab frame
-						double gamma = eparent/m_nu[i];
-						double delta_eparent = E_range[ieparent+1]-E_range[ieparent];
-						if (!pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[irho]
-												*evol_b0_proj[irho][i][ieparent])*
-												(xij*xij/(xij*xij-1))*
-												(1/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CPP],i,j)/gamma)*
-												pow(eparent+xij*edaughter,2)/pow(xij+1,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-						if (pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[irho]
-												*evol_b0_proj[irho][i][ieparent])*
-												(xij*xij/(xij*xij-1))*
-												(1/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CPP],i,j)/gamma)*
-												pow(eparent-xij*edaughter,2)/pow(xij-1,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-					}
-	
-					//Include chirality-violating term. Majorana CVP sends nu to nubar.
-					//The procedure is the same, but the parent irho index is inverted.
-					unsigned int parent_irho;
-					if (irho==0) parent_irho=1;
-					if (irho==1) parent_irho=0;
-					// i-energy (parent energy) index
-					//left-rectangular integral approximation
-					for (size_t ieparent = iedaughter; ieparent < ieparent_high-1; ieparent++) {
-						double eparent = E_range[ieparent];
-						double gamma = eparent/m_nu[i];
-						double delta_eparent = E_range[ieparent+1]-E_range[ieparent];
-						if (!pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[parent_irho]
-												*evol_b0_proj[parent_irho][i][ieparent])*
-												(xij*xij/(xij*xij-1))*
-												((eparent-edaughter)/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CVP],i,j)/gamma)*
-												(edaughter*pow(xij,2)-eparent)/pow(xij+1,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-						if (pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[parent_irho]
-												*evol_b0_proj[parent_irho][i][ieparent])*
-												(xij*xij/(xij*xij-1))*
-												((eparent-edaughter)/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CVP],i,j)/gamma)*
-												(edaughter*pow(xij,2)-eparent)/pow(xij-1,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
+	void Evolve_Components_Analytically(){
+		Check_Track();
+		NUSQUIDS_DECAY_COUNT(stats.analytic_evolutions++;)
+		double dt = track->GetFinalX() - track->GetX();
+		PreDerive(Get_t());
+		Parallel_Nodes([&](size_t begin, size_t end){
+			for (size_t ie = begin; ie < end; ie++){
+				for (unsigned int irho = 0; irho < nrhos; irho++){
+					DecayComplexMatrix v = Analytic_Propagator(ie, irho, dt);
+					DecayComplexMatrix v_adjoint = v.Adjoint();
+					for (std::vector<squids::SU_vector>& component : component_states){
+						squids::SU_vector& rho = component[ie*nrhos + irho];
+						rho = (v*DecayComplexMatrix(rho)*v_adjoint).Hermitian_Part();
 					}
 				}
-				
-				//If m_nu[j] is too close to zero, xij diverges, and we switch to an alternative
-				//form for the differential decay rates, in terms of yij=1/xij.
-				else{
-					double yij = m_nu[j]/m_nu[i];
-	
-					for (size_t ieparent = iedaughter; ieparent < ieparent_high-1; ieparent++) {
-						//get parent neutrino energy
-						double eparent = E_range[ieparent];
-						//boost factor to lab frame
-						double gamma = eparent/m_nu[i];
-						double delta_eparent = E_range[ieparent+1]-E_range[ieparent];
-						if (!pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[irho]
-												*evol_b0_proj[irho][i][ieparent])*
-												(1/(1-yij*yij))*
-												(1/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CPP],i,j)/gamma)*
-												pow(eparent*yij+edaughter,2)/pow(yij+1,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-						if (pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[irho]
-												*evol_b0_proj[irho][i][ieparent])*
-												(1/(1-yij*yij))*
-												(1/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CPP],i,j)/gamma)*
-												pow(eparent*yij-edaughter,2)/pow(1-yij,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-					}
-	
-	
-					//Include chirality-violating term. Majorana CVP sends nu to nubar.
-					//The procedure is the same, but the parent irho index is inverted.
-					unsigned int parent_irho;
-					if (irho==0) parent_irho=1;
-					if (irho==1) parent_irho=0;
-					// i-energy (parent energy) index
-					//left-rectangular integral approximation
-					for (size_t ieparent = iedaughter; ieparent < ieparent_high-1; ieparent++) {
-						double eparent = E_range[ieparent];
-						double gamma = eparent/m_nu[i];
-						double delta_eparent = E_range[ieparent+1]-E_range[ieparent];
-						if (!pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[parent_irho]
-												*evol_b0_proj[parent_irho][i][ieparent])*
-												(1/(1-yij*yij))*
-												((eparent-edaughter)/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CVP],i,j)/gamma)*
-												(edaughter-pow(yij,2)*eparent)/pow(yij+1,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-						if (pscalar){
-							decay_regeneration += (delta_eparent)*(state[ieparent].rho[parent_irho]
-												*evol_b0_proj[parent_irho][i][ieparent])*
-												(1/(1-yij*yij))*
-												((eparent-edaughter)/(eparent*eparent*edaughter))*
-												((gsl_matrix_get(rate_matrices[CVP],i,j)/gamma)*
-												(edaughter-pow(yij,2)*eparent)/pow(1-yij,2))*
-												(evol_b0_proj[irho][j][iedaughter]);
-						}
-					} 
+			}
+		});
+		t += dt;
+		track->SetX(track->GetFinalX());
+	}
 
-				} //Close second m_nu[j] conditional.
-			} //Close i loop
-		} //Close j loop 
+	void Check_Track() const {
+		if (!track){
+			throw std::runtime_error("nuSQUIDSDecay: no track was set.");
+		}
+	}
 
-		//Toggling additional regeneration terms (from nuSQuIDS).
-		if (ihard_interactions){
-			return nuSQUIDS::InteractionsRho(iedaughter, irho) + decay_regeneration;
+	//! Calls evolve_nodes(begin,end) on the energy nodes, split between the threads set with Set_NumThreads().
+	template<typename Function>
+	void Parallel_Nodes(Function evolve_nodes){
+		if (thread_pool){
+			thread_pool->ParallelFor(ne,[&](size_t begin, size_t end, unsigned int){ evolve_nodes(begin,end); });
 		}
 		else{
-			return decay_regeneration;
+			evolve_nodes(0,ne);
 		}
 	}
 
-protected:
-	//! Given a double, finds the nearest double in the E_range array.
+	//! Returns a copy of the state, indexed ie*nrhos + irho.
+	std::vector<squids::SU_vector> Copy_State() const {
+		std::vector<squids::SU_vector> copy;
+		copy.reserve(ne*nrhos);
+		for (size_t ie = 0; ie < ne; ie++){
+			for (unsigned int irho = 0; irho < nrhos; irho++){
+				copy.push_back(state[ie].rho[irho]);
+			}
+		}
+		return copy;
+	}
+
+	//! Evolves the state to the end of the track, analytically if possible, without observing it.
+	void Evolve_To_End(){
+		if (Analytic_Evolution_Applies()){
+			Evolve_Analytically(track->GetFinalX());
+		}
+		else{
+			nuSQUIDS::EvolveState();
+		}
+	}
+
+	//! Evolves the state to the end of the track, stopping at each of #observer_positions to call the observer.
 	/*!
-	Given a double argument, searches E_range for the element of smallest
-	absolute value difference from the argument.
-	\param value is the argument whose closest match in E_range we're looking for.
-	\return the index of the closest element in E_range to value.
+	The stops split one evolution into segments: the numerical integration goes
+	on from each position with the step it had reached, and the analytic
+	evolution applies the propagator of each segment. Only the last segment is
+	integrated by nuSQUIDS::EvolveState(); the others by SQuIDS::Evolve(), so
+	the checks of nuSQUIDS::EvolveState() are made here first, and the
+	positivity constraint, which nuSQUIDS::EvolveState() enforces between its
+	own segments, is refused.
 	*/
-	unsigned int nearest_element(double value) const {
-		//If value is larger than last element, return
-		//last element.
-		if (value>E_range[E_range.size()-1]){
-			return E_range.size()-1;
+	void Evolve_Observed(){
+		Check_Track();
+		if (!ibody || !body){
+			throw std::runtime_error("nuSQUIDSDecay: no body was set.");
+		}
+		if (!istate){
+			throw std::runtime_error("nuSQUIDSDecay: no initial state was set.");
+		}
+		double x_start = track->GetX();
+		double x_end = track->GetFinalX();
+		if (observer_positions.front() < x_start || observer_positions.back() > x_end){
+			throw std::runtime_error("nuSQUIDSDecay: an observed position is outside the track.");
 		}
-		//Otherwise, search in range.
-		std::vector<double> diffs(E_range.size());
-		for (size_t i = 0; i < E_range.size(); i++) {
-			diffs[i] = fabs(value - E_range[i]);
+		bool analytic = Analytic_Evolution_Applies();
+		if (!analytic && positivization){
+			throw std::runtime_error("nuSQUIDSDecay: an observed numerical evolution does not support the positivity constraint.");
+		}
+		for (size_t i = 0; i < observer_positions.size(); i++){
+			double x = observer_positions[i];
+			if (x > track->GetX()){
+				if (analytic){
+					Evolve_Analytically(x);
+				}
+				else{
+					if (squids::SQuIDS::Evolve(x - track->GetX()) != 0){
+						throw std::runtime_error("nuSQUIDSDecay: the integration to an observed position failed.");
+					}
+					track->SetX(x);
+				}
+			}
+			Observe(i, x);
 		}
-		return std::distance(diffs.begin(),std::min_element(diffs.begin(), diffs.end()));
+		if (x_end > track->GetX()){
+			Evolve_To_End();
+		}
+	}
+
+	//! Evaluates the flavor fluxes of every energy node into #observation_flux, and passes them to the observer.
+	void Observe(size_t index, double x){
+		observation_flux.resize(ne*numneu*nrhos);
+		Parallel_Nodes([&](size_t begin, size_t end){
+			for (size_t ie = begin; ie < end; ie++){
+				for (unsigned int flv = 0; flv < numneu; flv++){
+					for (unsigned int irho = 0; irho < nrhos; irho++){
+						observation_flux[(ie*numneu + flv)*nrhos + irho] = EvalFlavorAtNode(flv, ie, irho);
+					}
+				}
+			}
+		});
+		observer(DecayObservation{index, x, observation_flux});
 	}
 
+protected:
 	//! Prints the contents of a squids::SU_vector. (Useful for debugging)
 	/*!
 	\param mat is the SU_vector.
@@ -414,96 +594,313 @@ protected:
 		std::cout << std::endl;
 	}
 
-	//! Checks a pair of gsl_matrices for matching row and column dimensions.
+	//! Returns an SU_vector which uses element index of a buffer as its storage.
+	/*!
+	Buffers hold nsun*nsun components per SU_vector, contiguously. The returned SU_vector
+	does not own its storage, so neither constructing nor returning it allocates memory,
+	and writing to it writes to the buffer. Views returned by the const overrides
+	GammaRho() and InteractionsRho() are only read by SQuIDS.
+	\param buffer is the storage, with at least (index+1)*nsun*nsun elements.
+	\param index is the index of the SU_vector in the buffer.
+	*/
+	squids::SU_vector Buffer_View(const std::vector<double>& buffer, size_t index) const {
+		return squids::SU_vector(nsun, const_cast<double*>(buffer.data()) + index*nsun*nsun);
+	}
+
+	//! Fills #component_weights from the SU_vector dot product of each basis element.
+	void Compute_Component_Weights(){
+		component_weights.resize(nsun*nsun);
+		for (unsigned int k = 0; k < nsun*nsun; k++){
+			squids::SU_vector basis(nsun);
+			basis[k] = 1.0;
+			component_weights[k] = basis*basis;
+		}
+	}
+
+	//! Number of states of a kernel: NumNeu if it is fixed at compile time, #numneu if it is 0.
+	template<unsigned int NumNeu>
+	unsigned int Kernel_NumNeu() const { return NumNeu ? NumNeu : numneu; }
+
+	//! Projects the parent densities of energy nodes [ie_begin,ie_end) onto the mass states.
 	/*!
-	\param m1 the first matrix.
-	\param m2 the second matrix.
+	Fills the corresponding entries of #parent_projections. See Compute_Decay_Regeneration().
+	Dispatches to Compute_Parent_Projections_N() for the number of states of the system.
+	\param ie_begin is the first energy index.
+	\param ie_end is one past the last energy index.
 	*/
-	void Check_Matrix_Size(gsl_matrix* m1, gsl_matrix* m2) const {
-		if (m1->size1 != m2->size1){
-			throw std::runtime_error("size1 mismatch while copying matrix.");
+	void Compute_Parent_Projections(size_t ie_begin, size_t ie_end){
+		if (Screening()){
+			Compute_Parent_Projections_T(ie_begin,ie_end,parent_projections_single.data());
+		}
+		else{
+			Compute_Parent_Projections_T(ie_begin,ie_end,parent_projections.data());
 		}
-		if (m1->size2 != m2->size2){
-			throw std::runtime_error("size2 mismatch while copying matrix.");
+	}
+
+	//! Compute_Parent_Projections() into projections, stored as Real.
+	template<typename Real>
+	void Compute_Parent_Projections_T(size_t ie_begin, size_t ie_end, Real* projections){
+		switch (numneu){
+			case 3: Compute_Parent_Projections_N<3>(ie_begin,ie_end,projections); break;
+			case 4: Compute_Parent_Projections_N<4>(ie_begin,ie_end,projections); break;
+			case 5: Compute_Parent_Projections_N<5>(ie_begin,ie_end,projections); break;
+			case 6: Compute_Parent_Projections_N<6>(ie_begin,ie_end,projections); break;
+			default: Compute_Parent_Projections_N<0>(ie_begin,ie_end,projections); break;
 		}
 	}
 
-	//! Copies a rank-two array of gsl_matrices to the rate_matrices data member.
+	//! Compute_Parent_Projections() for NumNeu states, or any number of states if NumNeu is 0.
 	/*!
-	First allocates empty gsl_matrices to the rate_matrices[] pointer-array,
-	then compares source and destination matrix dimensions, then copies.
-	This is only used internally to set the rate_matrices data member. Except
-	in the case of the special "partial rates" constructor, the user should provide
-	a *coupling* matrix, and the rate matrices will be computed internally.
-	\param rate_matrices_ the input array.
+	With the number of states fixed, the loops over the numneu*numneu components
+	of each projection have a constant trip count, and are unrolled and vectorised.
+	The projections are summed in double precision, and only stored as Real.
 	*/
-	void Set_Rate_Matrices(gsl_matrix* rate_matrices_[2]){
-		for (unsigned int chi=0; chi<2; chi++){
-			rate_matrices[chi] = gsl_matrix_alloc(numneu,numneu);
-			Check_Matrix_Size(rate_matrices[chi],rate_matrices_[chi]);
-			gsl_matrix_memcpy(rate_matrices[chi],rate_matrices_[chi]);
+	template<unsigned int NumNeu, typename Real>
+	void Compute_Parent_Projections_N(size_t ie_begin, size_t ie_end, Real* projections){
+		const unsigned int n = Kernel_NumNeu<NumNeu>();
+		const unsigned int size = n*n;
+		const double* w = component_weights.data();
+		// the lightest state never decays, so it is never a parent
+		for (size_t irho = 0; irho < nrhos; irho++) {
+			for (size_t i = 1; i < n; i++) {
+				Real* projection = projections + (irho*n + i)*ne;
+				for (size_t ie = ie_begin; ie < ie_end; ie++) {
+					const squids::SU_vector& rho = state[ie].rho[irho];
+					const squids::SU_vector& proj = evol_b0_proj[irho][i][ie];
+					double p = 0;
+					for (unsigned int k = 0; k < size; k++) {
+						p += w[k]*rho[k]*proj[k];
+					}
+					projection[ie] = Real(p);
+				}
+			}
 		}
 	}
 
-	//! Set the Lagrangian couplings between mass states.
+	//! Computes the decay regeneration term of daughter nodes [ie_begin,ie_end).
 	/*!
-	First allocate memory gsl_matrix to the couplings pointer.
-	Then, check source and target matrix dimensions match, and copy the matrix.
-	See #couplings.
-	The user specifies whether the couplings are scalar or pseudoscalar 
-	in the constructor.
-	\param couplings_ is a gsl_matrix pointer. 	
+	The same parent densities projected onto m_i enter the regeneration sum of
+	every daughter energy below them. They are computed once per derivative
+	evaluation by Compute_Parent_Projections() and stored in #parent_projections,
+	and the regeneration integral of each daughter node becomes a dot product of
+	that array with the banded regeneration kernel of the model (see
+	DecayModel::Compute_Regeneration_Kernel()). The results are stored in
+	#decay_regeneration_cache, so that InteractionsRho() only has to look them up.
+	All projections must be up to date before this is called.
+	Dispatches to Compute_Decay_Regeneration_N() for the number of states and
+	neutrino types of the system.
+	\param ie_begin is the first daughter energy index.
+	\param ie_end is one past the last daughter energy index.
 	*/
-	void Set_Couplings(gsl_matrix* couplings_){
-		couplings = gsl_matrix_alloc(numneu,numneu);
-		Check_Matrix_Size(couplings,couplings_);
-		gsl_matrix_memcpy(couplings,couplings_);
-	}
-
-	//! Computes DT, the "Gamma" term in the Hamiltonian, using rate_matrices.
-	/*!
-	In the mass basis, DT is a diagonal matrix such that the (i,i) entry
-	is the sum over all rate matrices of their ith rows, weighted by m_i,
-	the corresponding neutrino mass. Essentially, this matrix encodes the
-	total rate of decay of mass state i to all lighter states, including
-	all decay channels ({CPP,CVP}) if the neutrino
-	is Majorana, and only the channel (CVP) if it 
-	is Dirac. The rate is weighted by the mass m_i for convenience, so that, 
-	in GammaRho(), one can simply divide DT by the energy of the parent 
-	neutrino, and each rate will acquire the proper factor of 1/gamma 
-	characterizing lab-frame decay retarded by time-dialation.
-	*/
-	void Compute_DT(){
-		DT = squids::SU_vector(numneu);
-		//Include chirality preserving processes only in majorana case.
-		int chi_min;
-		if(majorana){chi_min=0;}
-		else{chi_min=1;}
-		//Sum over parent mass states.
-		for(size_t i = 0; i < numneu; i++){
-			double rate=0;
-			//Sum over daughter mass states.
-			for(size_t j=0; j<i; j++){
-				//Sum over all decay channels.
-				for (size_t chi=chi_min; chi<2; chi++){
-					rate+=gsl_matrix_get(rate_matrices[chi],i,j);	
+	void Compute_Decay_Regeneration(size_t ie_begin, size_t ie_end){
+		const DecayModel& decay = Model();
+		if (Screening()){
+			Compute_Decay_Regeneration_T(ie_begin,ie_end,decay.GetRegenerationKernelSingle(CPP).data(),
+				decay.GetRegenerationKernelSingle(CVP).data(),parent_projections_single.data());
+		}
+		else{
+			Compute_Decay_Regeneration_T(ie_begin,ie_end,decay.GetRegenerationKernel(CPP).data(),
+				decay.GetRegenerationKernel(CVP).data(),parent_projections.data());
+		}
+	}
+
+	//! Compute_Decay_Regeneration() with the kernels and projections stored as Real.
+	template<typename Real>
+	void Compute_Decay_Regeneration_T(size_t ie_begin, size_t ie_end, const Real* kernel_cpp,
+									  const Real* kernel_cvp, const Real* projections){
+		//Without antineutrinos in the system there is no CVP contribution.
+		if (nrhos > 1){
+			switch (numneu){
+				case 3: Compute_Decay_Regeneration_N<3,true>(ie_begin,ie_end,kernel_cpp,kernel_cvp,projections); break;
+				case 4: Compute_Decay_Regeneration_N<4,true>(ie_begin,ie_end,kernel_cpp,kernel_cvp,projections); break;
+				case 5: Compute_Decay_Regeneration_N<5,true>(ie_begin,ie_end,kernel_cpp,kernel_cvp,projections); break;
+				case 6: Compute_Decay_Regeneration_N<6,true>(ie_begin,ie_end,kernel_cpp,kernel_cvp,projections); break;
+				default: Compute_Decay_Regeneration_N<0,true>(ie_begin,ie_end,kernel_cpp,kernel_cvp,projections); break;
+			}
+		}
+		else{
+			Compute_Decay_Regeneration_N<0,false>(ie_begin,ie_end,kernel_cpp,kernel_cvp,projections);
+		}
+	}
+
+	//! Compute_Decay_Regeneration() for NumNeu states (any number if 0), with or without CVP.
+	/*!
+	Fixing the number of states gives constant trip counts to the loops over
+	daughter states and components, and fixing CVP removes its test from the
+	channel loop. The term is accumulated directly on the components of
+	#decay_regeneration_cache. Whatever Real is, the integrals and the term are
+	accumulated in double precision (see DecayDot()).
+	*/
+	template<unsigned int NumNeu, bool CVP, typename Real>
+	void Compute_Decay_Regeneration_N(size_t ie_begin, size_t ie_end, const Real* kernel_cpp,
+									  const Real* kernel_cvp, const Real* projections){
+		const DecayModel& decay = Model();
+		const std::vector<size_t>& regeneration_kernel_offset = decay.GetRegenerationKernelOffset();
+		const std::vector<DecayChannel>& channels = decay.GetActiveChannels();
+		const unsigned int n = Kernel_NumNeu<NumNeu>();
+		const unsigned int size = n*n;
+		//Regeneration weight of each daughter mass state at the current node.
+		double fixed_weights[NumNeu ? NumNeu : 1];
+		std::vector<double> dynamic_weights(NumNeu ? 0 : n);
+		double* weights = NumNeu ? fixed_weights : dynamic_weights.data();
+		for (size_t irho = 0; irho < nrhos; irho++) {
+			//Majorana CVP sends nu to nubar, so its parent density has the inverted irho index.
+			size_t parent_irho = (irho==0) ? 1 : 0;
+			for (size_t iedaughter = ie_begin; iedaughter < ie_end; iedaughter++) {
+				for (unsigned int j = 0; j < n; j++) {
+					weights[j] = 0;
+				}
+				//Only channels with a nonzero rate and a non-empty integral at this node contribute.
+				for (const DecayChannel& c : channels) {
+					if (iedaughter < c.ie_begin || iedaughter >= c.ie_end) {
+						continue;
+					}
+					size_t channel = (c.parent*n + c.daughter)*ne + iedaughter;
+					size_t offset = regeneration_kernel_offset[channel];
+					size_t nparent = regeneration_kernel_offset[channel+1] - offset;
+					//The kernel band and the projections of the parents are both contiguous in
+					//the parent energy, so each integral is a single vectorised dot product.
+					double weight = 0;
+					if (c.cpp){
+						const Real* p_cpp = projections + (irho*n + c.parent)*ne + iedaughter;
+						weight += DecayDot(kernel_cpp + offset, p_cpp, nparent);
+					}
+					if (CVP && c.cvp){
+						const Real* p_cvp = projections + (parent_irho*n + c.parent)*ne + iedaughter;
+						weight += DecayDot(kernel_cvp + offset, p_cvp, nparent);
+					}
+					weights[c.daughter] += weight;
+				}
+				double* out = decay_regeneration_cache.data() + (irho*ne + iedaughter)*size;
+				for (unsigned int k = 0; k < size; k++) {
+					out[k] = 0;
+				}
+				for (unsigned int j = 0; j < n; j++) {
+					if (weights[j] != 0){
+						const squids::SU_vector& proj = evol_b0_proj[irho][j][iedaughter];
+						for (unsigned int k = 0; k < size; k++) {
+							out[k] += weights[j]*proj[k];
+						}
+					}
 				}
 			}
-			//Weight rate by m_i, and add a projector to the m_i state,
-			//multiplied by the weighted rate, to DT.
-			DT += m_nu[i]*rate*squids::SU_vector::Projector(numneu, i);
 		}
 	}
 
+	//! Evolves DT to the interaction picture for energy nodes [ie_begin,ie_end).
+	/*!
+	Also updates the corresponding entries of #DT_evol_scaled.
+	\param t is the time elapsed since the initial time.
+	\param ie_begin is the first energy index.
+	\param ie_end is one past the last energy index.
+	*/
+	void Evolve_DT(double t, size_t ie_begin, size_t ie_end){
+		const squids::SU_vector& DT = Model().GetDT();
+		for (size_t ei = ie_begin; ei < ie_end; ei++) {
+			DT_evol[ei] = DT.Evolve(H0_mass[ei], t);
+			squids::SU_vector scaled = Buffer_View(DT_evol_scaled, ei);
+			scaled = DT_evol[ei]*(0.5/E_range[ei]);
+		}
+	}
+
+	//! Prepares the decay term of the current model, once per model and evolution.
+	/*!
+	H0 is diagonal in the mass basis, and the DT of DecayModel is a sum of
+	mass projectors (see DecayModel::Compute_DT()), so the two commute and
+	the interaction picture rotation exp(iH0t) DT exp(-iH0t) is the identity:
+	#DT_evol_scaled is then filled here once, and AddToPreDerive() has nothing
+	left to evolve. Only a DT with off-diagonal components in the mass basis
+	is evolved at every derivative evaluation, by Evolve_DT(), with H0 cached
+	per energy node. Called from AddToPreDerive() whenever the model changed;
+	EvolveState() forces a new call, since the masses of H0 may have changed.
+	*/
+	void Prepare_DT(){
+		const squids::SU_vector& DT = Model().GetDT();
+		squids::SU_vector offdiagonal = DT;
+		for (unsigned int i = 0; i < nsun; i++){
+			squids::SU_vector projector = squids::SU_vector::Projector(nsun, i);
+			offdiagonal -= (DT*projector)*projector;
+		}
+		double norm = DT*DT;
+		DT_zero = (norm == 0);
+		DT_static = (offdiagonal*offdiagonal <= 1e-24*norm);
+		DT_evol_scaled.resize(ne*nsun*nsun);
+		if (DT_static){
+			for (size_t ei = 0; ei < ne; ei++){
+				DT_evol[ei] = DT;
+				squids::SU_vector scaled = Buffer_View(DT_evol_scaled, ei);
+				scaled = DT*(0.5/E_range[ei]);
+			}
+			H0_mass.clear();
+		}
+		else{
+			// asumming same mass hamiltonian for neutrinos/antineutrinos
+			H0_mass.resize(ne);
+			for (size_t ei = 0; ei < ne; ei++){
+				H0_mass[ei] = H0(E_range[ei], 0);
+			}
+		}
+		DT_model = model;
+	}
+
 	//! Evolves the interaction picture DT Hamiltonian term.
 	/*!
+	In batched mode, also computes the decay regeneration term for all energies.
+	See Compute_Decay_Regeneration(). If more than one thread was requested with
+	Set_NumThreads(), the energy nodes are split between the threads.
 	\param x the target evolution time.
 	*/
 	void AddToPreDerive(double x) {
-		for (int ei = 0; ei < ne; ei++) {
-			// asumming same mass hamiltonian for neutrinos/antineutrinos
-			squids::SU_vector h0 = H0(E_range[ei], 0);
-			DT_evol[ei] = DT.Evolve(h0, (x - Get_t_initial()));
+		NUSQUIDS_DECAY_TIME(prederive);
+		stats.rhs_evaluations++;
+		bool batched = idecay_regeneration && ibatched_regeneration;
+		if (DT_model != model){
+			Prepare_DT();
+		}
+		//A DT which commutes with H0 was set up once by Prepare_DT().
+		bool evolve_dt = !DT_static;
+		if (batched){
+			decay_regeneration_cache.resize(nrhos*ne*nsun*nsun);
+			if (Screening()){
+				parent_projections_single.resize(nrhos*numneu*ne);
+			}
+			else{
+				parent_projections.resize(nrhos*numneu*ne);
+			}
+			if (component_weights.size() != nsun*nsun){
+				Compute_Component_Weights();
+			}
+		}
+		double t = x - Get_t_initial();
+		//Every active channel is summed over its whole band once per rho.
+		NUSQUIDS_DECAY_COUNT(if (batched){ for (const DecayChannel& c : Model().GetActiveChannels()) Count_Channel(c, nrhos*(c.ie_end - c.ie_begin)); })
+		if (!thread_pool){
+			if (evolve_dt){
+				Evolve_DT(t,0,ne);
+			}
+			if (batched){
+				Compute_Parent_Projections(0,ne);
+				Compute_Decay_Regeneration(0,ne);
+			}
+			return;
+		}
+		//Each thread writes its own slots of DT_evol and of the caches.
+		if (evolve_dt || batched){
+			thread_pool->ParallelFor(ne,[&](size_t begin, size_t end, unsigned int){
+				if (evolve_dt){
+					Evolve_DT(t,begin,end);
+				}
+				if (batched){
+					Compute_Parent_Projections(begin,end);
+				}
+			});
+		}
+		//The regeneration of a daughter node reads the projections of all heavier nodes,
+		//so it can only start once every projection is done.
+		if (batched){
+			thread_pool->ParallelFor(ne,[&](size_t begin, size_t end, unsigned int){
+				Compute_Decay_Regeneration(begin,end);
+			});
 		}
 	}
 
@@ -515,23 +912,98 @@ protected:
     interactions described in the nuSQUIDS documentation under "GammaRho".
     \param ie is the energy index of the desired term.
     \param irho is the neutrino/antineutrino index of the desired term, though the decay term is the same in each case.
-    \return the modified "Gamma" matrix.
+    \return the modified "Gamma" matrix. Without interactions, this is a view of #DT_evol_scaled,
+    so no memory is allocated.
     */
 	squids::SU_vector GammaRho(unsigned int ie, unsigned int irho) const {
-		if (ihard_interactions)
-			return nuSQUIDS::GammaRho(ie, irho) + DT_evol[ie] * (0.5 / E_range[ie]);
+		NUSQUIDS_DECAY_TIME(gamma);
+		if (ihard_interactions){
+			squids::SU_vector gamma = Base_GammaRho(ie, irho);
+			if (!DT_zero){
+				gamma += Buffer_View(DT_evol_scaled, ie);
+			}
+			return gamma;
+		}
 		else
-			return DT_evol[ie] * (0.5 / E_range[ie]);
+			return Buffer_View(DT_evol_scaled, ie);
+	}
+
+	//! Returns a sum of all Hamiltonian interaction terms except DT, the "Gamma" matrix.
+	/*!
+	The contribution from decay regeneration (the "R" terms from eqns. (18) and (19) in [1]) is computed,
+	and then additional incoherent interactions are added internally by nuSQuIDS if iinteractions is true.
+	These additional interaction regeneration terms are described in the nuSQUIDS documentation under "InteractionsRho".
+	If majorana is true, there are regeneration contributions from both CVP and CPP. Otherwise, there is no contribution 
+	because right-handed neutrinos are sterile.
+	Note that the contribution from CVP in the majorana case converts neutrinos to antineutrinos.
+	\param iedaughter is the energy index of the daughter density matrix.
+	\param irho is the neutrino/antineutrino index of the desired matrix.
+	\return the incoherent interaction matrix.
+	*/
+
+	squids::SU_vector InteractionsRho(unsigned int iedaughter, unsigned int irho) const {
+		NUSQUIDS_DECAY_TIME(interactions);
+		//In batched mode the term was already computed for all energies in AddToPreDerive().
+		if (idecay_regeneration && ibatched_regeneration){
+			if (ihard_interactions){
+				squids::SU_vector interactions = Base_InteractionsRho(iedaughter, irho);
+				interactions += Buffer_View(decay_regeneration_cache, irho*ne + iedaughter);
+				return interactions;
+			}
+			else{
+				return Buffer_View(decay_regeneration_cache, irho*ne + iedaughter);
+			}
+		}
+
+		const DecayModel& decay = Model();
+		const std::vector<size_t>& regeneration_kernel_offset = decay.GetRegenerationKernelOffset();
+		squids::SU_vector decay_regeneration(numneu);
+		//Majorana CVP sends nu to nubar, so its parent density has the inverted irho index.
+		unsigned int parent_irho = (irho==0) ? 1 : 0;
+		//Sum over the channels i->j with a nonzero rate and a non-empty integral at this node.
+		for (const DecayChannel& c : decay.GetActiveChannels()) {
+			if (iedaughter < c.ie_begin || iedaughter >= c.ie_end) {
+				continue;
+			}
+			NUSQUIDS_DECAY_COUNT(Count_Channel(c, 1);)
+			//Sum the parent densities projected onto m_i against the precomputed
+			//weights. See DecayModel::Compute_Regeneration_Kernel().
+			size_t channel = (c.parent*numneu + c.daughter)*ne + iedaughter;
+			size_t offset = regeneration_kernel_offset[channel];
+			size_t nparent = regeneration_kernel_offset[channel+1] - offset;
+			const double* w_cpp = decay.GetRegenerationKernel(CPP).data() + offset;
+			const double* w_cvp = decay.GetRegenerationKernel(CVP).data() + offset;
+			double weight = 0;
+			for (size_t n = 0; n < nparent; n++) {
+				size_t ieparent = iedaughter + n;
+				if (c.cpp){
+					weight += w_cpp[n]*(state[ieparent].rho[irho]*evol_b0_proj[irho][c.parent][ieparent]);
+				}
+				//Without antineutrinos in the system there is no CVP contribution.
+				if (c.cvp && nrhos > 1){
+					weight += w_cvp[n]*(state[ieparent].rho[parent_irho]*evol_b0_proj[parent_irho][c.parent][ieparent]);
+				}
+			}
+			decay_regeneration += weight*evol_b0_proj[irho][c.daughter][iedaughter];
+		}
+
+		//Toggling additional regeneration terms (from nuSQuIDS).
+		if (ihard_interactions){
+			return Base_InteractionsRho(iedaughter, irho) + decay_regeneration;
+		}
+		else{
+			return decay_regeneration;
+		}
 	}
 
 
 public:
 	//! Basic nuSQUIDSDecay constructor.
 	/*!
-	Calls nuSQUIDS parent constructor and allocates memory for member
-	matrices and neutrino masses. This constuctor should not be called
+	Calls nuSQUIDS parent constructor and allocates memory for the
+	per-energy decay terms. This constuctor should not be called
 	directly. It is just an encapsulation of basic funcitonality to be
-	called by the two, more complete, overloaded constructors.
+	called by the more complete, overloaded constructors, which set the decay model.
 	\param e_nodes is the array of neutrino propagation energies.
 	\param numneu_ is the number of neutrino states in the system. Defaults to 3.
 	\param NT_ is the neutrino type from (neutrino/antineutrino/both). Defaults to both.	
@@ -550,8 +1022,9 @@ public:
 		for (int ei = 0; ei < ne; ei++) {
 			DT_evol[ei] = squids::SU_vector(nsun);
 		}
-		// allocating space for neutrino masses
-		m_nu.resize(numneu);
+		// record the accepted steps, with the default step type of SQuIDS
+		Set_GSL_step(gsl_odeiv2_step_rkf45);
+		snapshot.Reserve(1024);
 	}
 
 	//! nuSQUIDSDecay "majorana coupling" constructor.
@@ -559,10 +1032,10 @@ public:
 	Calls the basic constructor, and then sets neutrino masses, phi mass,
 	the coupling matrices, as well as switches for incoherent interactions,
 	decay regeneration (See SetIncoherentInteractions(),
-	Set_DecayRegeneration()). The constructor then calls
-	Compute_Rate_Matrices() to calculate decay rates as functions of masses and couplings,
-	and then calls Compute_DT() to calculate the "Gamma" matrix decay term as a function
-	of masses and decay rates.
+	Set_DecayRegeneration()). The constructor then builds a DecayModel, which
+	calculates decay rates as functions of masses and couplings, and the "Gamma" matrix
+	decay term as a function of masses and decay rates. The model is not shared with
+	other objects; use the "model" constructor to share one.
 	This constructor only applies to tha majorana case, where it is preferred because it 
 	allows the user to input Lagrangian parameters only, as opposed to manually computing 
 	partial decay rate matrices and passing them to nuSQuIDS decay. This both simplifies 
@@ -577,10 +1050,10 @@ public:
 	\param numneu_ is the number of neutrino states in the system. Defaults to 3.
 	\param NT_ is the neutrino type from (neutrino/antineutrino/both). Defaults to both.	
 	\param iinteraction_ is a switch for incoherent interactions. See Set_DecayRegeneration() .
-	\param pscalar_ is a switch for scalar/pseudoscalar couplings. See #pscalar.
+	\param pscalar_ is a switch for scalar/pseudoscalar couplings. See DecayModel.
 	\param decay_regen_ is a switch for decay regeneration. See Set_DecayRegeneration()
-	\param m_nu_ is a vector of neutrino masses. See #m_nu .
-	\param couplings_ is a gsl_matrix* pointer. See #couplings .
+	\param m_nu_ is a vector of neutrino masses. See DecayModel.
+	\param couplings_ is a gsl_matrix* pointer. See DecayModel.
 	*/
 	nuSQUIDSDecay(marray<double, 1> e_nodes, unsigned int numneu_,
 					NeutrinoType NT_, bool ihard_interactions_,
@@ -590,13 +1063,8 @@ public:
 					):
 					nuSQUIDSDecay(e_nodes,numneu_,NT_,ihard_interactions_,ncs_){
 		ihard_interactions=ihard_interactions_;
-		pscalar=pscalar_;
-		majorana=true;
 		Set_DecayRegeneration(decay_regen_);
-		m_nu=m_nu_;
-		Set_Couplings(couplings_);
-		Compute_Rate_Matrices();
-		Compute_DT();
+		model=std::make_shared<const DecayModel>(e_nodes,numneu_,pscalar_,m_nu_,couplings_);
 	}
 
 	//! nuSQUIDSDecay "partial rate" constructor.
@@ -604,9 +1072,8 @@ public:
 	Calls the basic constructor, and then sets neutrino masses,
 	the four partial rate matrices, as well as switches for incoherent interactions,
 	decay regeneration, and majorana/dirac neutrinos (See SetIncoherentInteractions(),
-	Set_DecayRegeneration(), and). The constructor then allocates memory
-	to the unused #couplings and calls Compute_DT() to calculate the "Gamma" matrix
-	decay term as a function of masses and decay rates.
+	Set_DecayRegeneration(), and). The constructor then builds a DecayModel, which
+	calculates the "Gamma" matrix decay term as a function of masses and decay rates.
 	This constructor is used in the analysis in [1] because it allows the user to input
 	partial decay rates directly, which is useful for characterizing the effect of
 	neutrino lifetimes on the evolution of the neutrino system. However, one must be careful
@@ -624,11 +1091,11 @@ public:
 	\param numneu_ is the number of neutrino states in the system. Defaults to 3.
 	\param NT_ is the neutrino type from (neutrino/antineutrino/both). Defaults to both.	
 	\param iinteraction_ is a switch for incoherent interactions. See Set_DecayRegeneration() .
-	\param pscalar_ is a switch for scalar/pseudoscalar couplings. See #pscalar.
+	\param pscalar_ is a switch for scalar/pseudoscalar couplings. See DecayModel.
 	\param decay_regen_ is a switch for decay regeneration. See Set_DecayRegeneration()
-	\param majorana_ is a switch for Majorana/Dirac neutrinos. See #majorana .
-	\param m_nu_ is a vector of neutrino masses. See #m_nu .
-	\param rate_matrices_ is a two-element array of gsl_matrix* pointers. See #rate_matrices .
+	\param majorana_ is a switch for Majorana/Dirac neutrinos. See DecayModel.
+	\param m_nu_ is a vector of neutrino masses. See DecayModel.
+	\param rate_matrices_ is a two-element array of gsl_matrix* pointers. See DecayModel.
 	*/
 	nuSQUIDSDecay(marray<double, 1> e_nodes, unsigned int numneu_,
 					NeutrinoType NT_, bool ihard_interactions,
@@ -639,55 +1106,190 @@ public:
 					):
 					nuSQUIDSDecay(e_nodes,numneu_,NT_,ihard_interactions,ncs_){
 		ihard_interactions=ihard_interactions;
-		pscalar=pscalar_;
-		majorana=majorana_;
-		/*
-		If the neutrino is majorana, both CPP and CVP processes contribute to regeneration,
-		and CVP sends neutrinos to antineutrinos. If the neutrino is Dirac, there is no CPP,
-		and the CVP sends left-handed neutrinos to right-handed neutrinos, which are sterile,
-		and therefore do not contribute to regeneration of visible neutrino flux. That is to say,
-		the regeneration terms are automatically zero if the neutrino is Dirac.
-		*/
-		if (majorana){
-			Set_DecayRegeneration(decay_regen_);
-		}
-		else{
-			Set_DecayRegeneration(false);
-		}
-		m_nu=m_nu_;
-		Set_Rate_Matrices(rate_matrices_);
-		couplings = gsl_matrix_alloc(numneu,numneu);
-		Compute_DT();
+		model=std::make_shared<const DecayModel>(e_nodes,numneu_,pscalar_,majorana_,m_nu_,rate_matrices_);
+		Set_Regeneration_For_Model(decay_regen_);
+	}
+
+	//! nuSQUIDSDecay "model" constructor.
+	/*!
+	Calls the basic constructor on the energy nodes and number of states of the
+	model, and uses the model as is. The model is shared, not copied, so this is
+	the constructor to use when many objects have the same decay parameters:
+	passing the same model to the nuSQUIDSAtm<nuSQUIDSDecay> constructor, for
+	instance, shares it between all zenith bins, and between flux components
+	built from the same model. If the model is Dirac, regeneration is switched off
+	(see the "partial rate" constructor).
+	\param model_ is the decay model. See DecayModel.
+	\param NT_ is the neutrino type from (neutrino/antineutrino/both).
+	\param iinteraction_ is a switch for incoherent interactions. See Set_DecayRegeneration() .
+	\param decay_regen_ is a switch for decay regeneration. See Set_DecayRegeneration()
+	*/
+	nuSQUIDSDecay(std::shared_ptr<const DecayModel> model_, NeutrinoType NT_,
+					bool ihard_interactions_, bool decay_regen_,
+					std::shared_ptr<CrossSectionLibrary> ncs_ = nullptr
+					):
+					nuSQUIDSDecay(Non_Null(model_).GetERange(),Non_Null(model_).GetNumNeu(),NT_,ihard_interactions_,ncs_){
+		ihard_interactions=ihard_interactions_;
+		model=model_;
+		Set_Regeneration_For_Model(decay_regen_);
 	}
 
 	//! nuSQUIDSDecay move constructor.
 	/*!
 	This constructor is of technical utility in wrapping a nuSQuIDSDecay object in
-	a nuSQuIDS atmospheric object. See the example scripts.
+	a nuSQuIDS atmospheric object. See the example scripts. The decay model and
+	all the per-energy buffers are taken over from other rather than copied.
+	A moved-from object may only be destroyed.
 	*/
 	nuSQUIDSDecay(nuSQUIDSDecay&& other):
 	nuSQUIDS(std::move(other)),
 	ihard_interactions(other.ihard_interactions),
-	pscalar(other.pscalar),	majorana(other.majorana), 
-	DT(other.DT), DT_evol(other.DT_evol), m_nu(other.m_nu)
-	{
-		couplings = gsl_matrix_alloc(other.numneu,other.numneu);
-		gsl_matrix_memcpy(couplings,other.couplings);
-		for (unsigned int chi=0; chi<2; chi++){
-			rate_matrices[chi] = gsl_matrix_alloc(other.numneu,other.numneu);
-			gsl_matrix_memcpy(rate_matrices[chi],other.rate_matrices[chi]);
+	model(std::move(other.model)),
+	DT_evol(std::move(other.DT_evol)),
+	DT_model(std::move(other.DT_model)),
+	DT_static(other.DT_static),
+	DT_zero(other.DT_zero),
+	H0_mass(std::move(other.H0_mass)),
+	DT_evol_scaled(std::move(other.DT_evol_scaled)),
+	idecay_regeneration(other.idecay_regeneration),
+	ibatched_regeneration(other.ibatched_regeneration),
+	ianalytic_evolution(other.ianalytic_evolution),
+	parent_projections(std::move(other.parent_projections)),
+	parent_projections_single(std::move(other.parent_projections_single)),
+	decay_regeneration_cache(std::move(other.decay_regeneration_cache)),
+	component_weights(std::move(other.component_weights)),
+	thread_pool(std::move(other.thread_pool)),
+	stats(std::move(other.stats)),
+	snapshot(std::move(other.snapshot)),
+	step_type(other.step_type),
+	requested_h(other.requested_h),
+	requested_rel_error(other.requested_rel_error),
+	requested_abs_error(other.requested_abs_error),
+	screening_tolerances(other.screening_tolerances),
+	component_states(std::move(other.component_states)),
+	observer_positions(std::move(other.observer_positions)),
+	observer(std::move(other.observer)),
+	observation_flux(std::move(other.observation_flux))
+	{}
+
+	//! Sets the decay model.
+	/*!
+	The model is shared, not copied. It must have the energy nodes and number
+	of states of this object. If the model is Dirac, regeneration is switched off.
+	The state is not changed: call Set_initial_state() before evolving again.
+	\param model_ is the decay model. See DecayModel.
+	*/
+	void Set_DecayModel(std::shared_ptr<const DecayModel> model_){
+		Check_Model(model_);
+		model=model_;
+		if (!model->IsMajorana()){
+			Set_DecayRegeneration(false);
 		}
 	}
 
-	//! nuSQUIDSDecay destructor.
+	//! Returns the decay model.
+	std::shared_ptr<const DecayModel> GetDecayModel() const { return model; }
+
+	//! Sets new neutrino masses, keeping the couplings or rate matrices.
+	/*!
+	Switches this object to a new model derived from the current one (see
+	DecayModel::With_Masses()), without reconstructing the object or reloading its
+	cross sections. Other objects sharing the current model are not affected.
+	If the model was built from couplings, the rate matrices are recomputed from
+	them; if it was built from rate matrices, they are kept as they are.
+	The state is not changed: call Set_initial_state() before evolving again.
+	Note: only m_1 may be set to zero!
+	\param m_nu_ is a vector of neutrino masses. See DecayModel.
+	*/
+	void Set_Masses(const std::vector<double>& m_nu_){
+		model=Model().With_Masses(m_nu_);
+	}
+
+	//! Sets new Lagrangian couplings between mass states, and recomputes the rates.
+	/*!
+	Switches this object to a new model derived from the current one, see
+	DecayModel::With_Couplings() and Set_Masses().
+	\param couplings_ is a gsl_matrix* pointer, numneu x numneu. See DecayModel.
+	*/
+	void Set_Couplings(gsl_matrix* couplings_){
+		model=Model().With_Couplings(couplings_);
+	}
+
+	//! Sets new partial decay rate matrices.
+	/*!
+	Switches this object to a new model derived from the current one, see
+	DecayModel::With_RateMatrices() and Set_Masses(). See the "partial rate"
+	constructor for the caveats of setting the rates directly.
+	\param rate_matrices_ is a two-element array of gsl_matrix* pointers, numneu x numneu. See DecayModel.
+	*/
+	void Set_RateMatrices(gsl_matrix* rate_matrices_[2]){
+		model=Model().With_RateMatrices(rate_matrices_);
+	}
+
+	//! Sets the quadrature rule of the decay regeneration integral.
+	/*!
+	Switches this object to a new model with the given rule, see
+	DecayModel::With_Quadrature() and Set_Masses(). The default,
+	DecayModel::Quadrature::Left, is the original left-rectangular sum, which
+	is first order in the grid spacing; the other rules reach the same
+	accuracy with far fewer energy nodes (see benchmarks/quadrature_benchmark.cpp).
+	\param quadrature_ is the quadrature rule. See DecayModel::Quadrature.
+	*/
+	void Set_RegenerationQuadrature(DecayModel::Quadrature quadrature_){
+		model=Model().With_Quadrature(quadrature_);
+	}
+
+	//! Toggles the mixed precision screening mode, for coarse passes over parameter space.
 	/*!
-	Freeing memory allocated to gsl_matrices.
+	In screening mode, the batched decay regeneration (see
+	Set_BatchedRegeneration()) reads the regeneration kernel and the parent
+	projections in single precision, halving the memory traffic of its dot
+	products, while the integrals, the regeneration term and the state stay in
+	double precision. The results then carry relative errors of about 1e-7, so
+	switching the mode on also relaxes the integrator tolerances to tolerance:
+	tighter ones would only make the integrator take more steps. Switching it
+	off restores the tolerances set with Set_rel_error() and Set_abs_error(),
+	which must then have been set; setting them while screening applies them
+	at once and makes them the ones restored.
+	The object switches to a model derived from the current one with
+	DecayModel::With_Precision(); a model passed to Set_DecayModel() keeps its
+	own precision, so objects sharing a screening model all screen.
+	DT is constant in the interaction picture (see Prepare_DT()) and is not
+	affected, and neither is the unbatched regeneration.
+	\param opt is the boolean value to toggle the screening mode.
+	\param tolerance is the relative and absolute error of the integrator in screening mode.
 	*/
-	~nuSQUIDSDecay(){
-		gsl_matrix_free(couplings);
-		for (size_t chi=0; chi<2; chi++){
-			gsl_matrix_free(rate_matrices[chi]);
+	void Set_ScreeningMode(bool opt, double tolerance = 1e-6){
+		if (!opt && screening_tolerances && (requested_rel_error <= 0 || requested_abs_error <= 0)){
+			throw std::runtime_error("nuSQUIDSDecay: the tolerances to restore after screening were never set; "
+									 "set them with Set_rel_error() and Set_abs_error().");
+		}
+		DecayModel::Precision precision = opt ? DecayModel::Precision::Single : DecayModel::Precision::Double;
+		if (Model().GetPrecision() != precision){
+			model=Model().With_Precision(precision);
 		}
+		if (opt){
+			nuSQUIDS::Set_rel_error(tolerance);
+			nuSQUIDS::Set_abs_error(tolerance);
+			screening_tolerances = true;
+		}
+		else if (screening_tolerances){
+			nuSQUIDS::Set_rel_error(requested_rel_error);
+			nuSQUIDS::Set_abs_error(requested_abs_error);
+			screening_tolerances = false;
+		}
+	}
+
+	//! Sets the relative error of the numerical integration, see SQuIDS::Set_rel_error().
+	void Set_rel_error(double error){
+		requested_rel_error = error;
+		nuSQUIDS::Set_rel_error(error);
+	}
+
+	//! Sets the absolute error of the numerical integration, see SQuIDS::Set_abs_error().
+	void Set_abs_error(double error){
+		requested_abs_error = error;
+		nuSQUIDS::Set_abs_error(error);
 	}
 
 	//! Toggles decay regeneration.
@@ -711,7 +1313,259 @@ public:
 		False					 | False						 | Gamma only (decay only without regen).
 	\param opt is the boolean value to toggle regeneration.
 	*/
-	void Set_DecayRegeneration(bool opt) { Set_OtherRhoTerms(opt); }
+	void Set_DecayRegeneration(bool opt) {
+		idecay_regeneration=opt;
+		Set_OtherRhoTerms(opt);
+	}
+
+	//! Toggles the batched evaluation of the decay regeneration term.
+	/*!
+	If set to true, the regeneration term of every energy node is computed in a
+	single pass at each derivative evaluation, sharing the projected parent densities
+	between all daughter energies, and InteractionsRho() returns the cached result.
+	If set to false, InteractionsRho() evaluates the regeneration sum of each
+	requested node on its own. Both give the same result.
+	\param opt is the boolean value to toggle batched regeneration.
+	*/
+	void Set_BatchedRegeneration(bool opt) { ibatched_regeneration=opt; }
+
+	//! Sets the number of threads used in the per-energy work of each derivative evaluation.
+	/*!
+	The interaction picture evolution of DT and the batched decay regeneration
+	(see Set_BatchedRegeneration()) are split over the energy nodes in contiguous,
+	fixed chunks, one per thread. The calling thread is one of them. The threads
+	are kept alive until the number is changed or the object is destroyed.
+	Default: 1, no extra threads.
+	\param nthreads is the total number of threads. Values of 0 and 1 disable threading.
+	*/
+	void Set_NumThreads(unsigned int nthreads) {
+		if (nthreads <= 1){
+			thread_pool.reset();
+		}
+		else if (!thread_pool || thread_pool->Get_NumThreads() != nthreads){
+			thread_pool.reset(new DecayThreadPool(nthreads));
+		}
+	}
+
+	//! Returns the number of threads set with Set_NumThreads().
+	unsigned int Get_NumThreads() const { return thread_pool ? thread_pool->Get_NumThreads() : 1; }
+
+	//! Returns the instrumentation counters accumulated since construction or the last Reset_Stats().
+	/*!
+	The counters are only updated if the code is compiled with
+	NUSQUIDS_DECAY_INSTRUMENTATION defined (see DecayStats::enabled); otherwise
+	they stay at zero and the hooks cost nothing. The exception is
+	DecayStats::rhs_evaluations, which is always counted.
+	*/
+	const DecayStats& Get_Stats() const { return stats; }
+
+	//! Resets the instrumentation counters.
+	void Reset_Stats() { stats = DecayStats(); }
+
+	//! Returns the accepted steps of the last numerical evolution of EvolveState().
+	/*!
+	Empty if the last evolution was analytic (see Set_AnalyticEvolution()), or
+	if the state was not evolved yet. The snapshot can be saved with
+	DecayEvolutionSnapshot::Write() and passed to Warm_Start() of an object
+	evolving a similar problem.
+	*/
+	const DecayEvolutionSnapshot& Get_Snapshot() const { return snapshot; }
+
+	//! Sets the step type of the numerical integration, see SQuIDS::Set_GSL_step().
+	/*!
+	The integrator is given a step type which forwards every step to opt, and
+	records the accepted ones for Get_Snapshot().
+	*/
+	void Set_GSL_step(const gsl_odeiv2_step_type* opt){
+		if (!opt){
+			throw std::runtime_error("nuSQUIDSDecay: the step type is null.");
+		}
+		step_type = opt;
+		nuSQUIDS::Set_GSL_step(Recording_Step_Type(opt));
+	}
+
+	//! Sets the initial step of the numerical integration, see SQuIDS::Set_h().
+	void Set_h(double h_){
+		requested_h = h_;
+		nuSQUIDS::Set_h(h_);
+	}
+
+	//! Starts the next evolution from the first step accepted in a snapshot.
+	/*!
+	Replaces the initial step set with Set_h(), if the snapshot has any step.
+	The tolerances still control every step, so this only saves the steps the
+	integrator would take to find the right size.
+	\param other is the snapshot of an evolution of a similar problem, see Get_Snapshot().
+	*/
+	void Warm_Start(const DecayEvolutionSnapshot& other){
+		if (other.Initial_Step() > 0){
+			Set_h(other.Initial_Step());
+		}
+	}
+
+	//! Toggles the analytic evolution of constant density problems without regeneration.
+	/*!
+	See EvolveState(). Switching it off forces the numerical integration in every case.
+	\param opt is the boolean value to toggle the analytic evolution.
+	*/
+	void Set_AnalyticEvolution(bool opt) { ianalytic_evolution=opt; }
+
+	//! Evolves the state to the end of the track.
+	/*!
+	If the body has a constant density, the state is in the interaction basis
+	(the nuSQuIDS default), and neither the nuSQuIDS interactions nor decay
+	regeneration are on (see Set_DecayRegeneration()), the evolution
+	equation of each energy node is linear with a constant generator, and it is
+	solved exactly with one small matrix exponential per energy node and rho,
+	instead of integrating it numerically. Otherwise, and if switched off with
+	Set_AnalyticEvolution(), the state is integrated by nuSQUIDS::EvolveState().
+	The energy nodes are split between the threads set with Set_NumThreads().
+	The accepted steps of the numerical integration are kept, see Get_Snapshot().
+	If an observer was set with Set_Observer(), it is called at each of its
+	positions during the evolution.
+	*/
+	void EvolveState(){
+		snapshot.Clear();
+		DT_model.reset();
+		if (observer){
+			Evolve_Observed();
+		}
+		else{
+			Evolve_To_End();
+		}
+	}
+
+	//! Observes the flavor fluxes at given positions of the track during EvolveState().
+	/*!
+	A single evolution to the end of the track then gives the fluxes of every
+	baseline in positions, instead of one evolution per baseline: EvolveState()
+	stops at each position, evaluates the fluxes of all energy nodes into a
+	buffer allocated once, and calls the observer with them (see DecayObservation),
+	before going on. No step is integrated twice, and the integration goes on
+	from each position with the step it had reached; the stops only shorten the
+	steps which would cross them. The final state therefore agrees with that of
+	an evolution without observer within the integrator tolerances, but not
+	bit for bit, since the steps differ. The analytic evolution (see
+	EvolveState()) is exact over every segment.
+	Limitations of the numerical path: the segments between positions are
+	integrated by SQuIDS::Evolve() rather than nuSQUIDS::EvolveState(), so
+	EvolveState() throws if the positivity constraint of nuSQuIDS
+	(Set_PositivityConstraint()) is on. EvolveComponents() does not call the
+	observer.
+	To keep the observations, pass the Observer() of a DecayObservationRing,
+	or write them to a DecayObservationStore.
+	\param positions are the observed positions, in increasing order, in the
+	natural units of the track and between its initial and final positions. A
+	position at the start of the track observes the initial state.
+	\param observer_ is called at each position, from the thread calling EvolveState().
+	*/
+	void Set_Observer(std::vector<double> positions, DecayObserver observer_){
+		if (positions.empty() || !observer_){
+			throw std::runtime_error("nuSQUIDSDecay: an observer needs a callback and at least one position.");
+		}
+		if (!std::is_sorted(positions.begin(), positions.end())){
+			throw std::runtime_error("nuSQUIDSDecay: the observed positions must be in increasing order.");
+		}
+		observer_positions = std::move(positions);
+		observer = std::move(observer_);
+	}
+
+	//! Removes the observer set with Set_Observer().
+	void Clear_Observer(){
+		observer_positions.clear();
+		observer = DecayObserver();
+	}
+
+	//! Evolves several flux components, e.g. kaon and pion fluxes, through the same track with this object.
+	/*!
+	Every term of the evolution equation, including the interactions and the
+	decay regeneration, is linear in the state, so the final state of a sum of
+	fluxes is the sum of their final states. The components are evolved from the
+	same initial time and position of the track, and their final states are kept,
+	so that any weighted sum of them can be set with Superpose() without evolving
+	again. All components share the model, the cross sections, the prepared decay
+	term and the buffers of the object. When the analytic evolution applies (see
+	EvolveState()), they are evolved together: the propagator of each energy node
+	and rho is computed once and applied to every component. Otherwise, e.g. in
+	the Earth or with interactions, each component is still integrated in
+	full, in turn, with its own steps, so that superpositions agree with a
+	single evolution of the summed flux within the integrator tolerances: the
+	integration then costs as much as one object per component, and only the
+	setup is shared. The first component starts from the step set with Set_h()
+	(or Warm_Start()), and the others from the first step it accepted, so that
+	they skip the search for the step size and do not depend on the order of
+	the components after the first. Get_Snapshot() then holds the steps of the
+	first component. On return, the state is the sum of the components, as if Superpose() had been
+	called with unit weights.
+	\param initial_fluxes are the initial fluxes of the components, as given to Set_initial_state().
+	\param basis is the basis of the fluxes, as given to Set_initial_state().
+	*/
+	template<unsigned int Dim>
+	void EvolveComponents(const std::vector<marray<double,Dim>>& initial_fluxes, Basis basis){
+		if (initial_fluxes.empty()){
+			throw std::runtime_error("nuSQUIDSDecay: no flux components were given.");
+		}
+		Check_Track();
+		component_states.clear();
+		if (Analytic_Evolution_Applies()){
+			snapshot.Clear();
+			DT_model.reset();
+			for (const marray<double,Dim>& initial_flux : initial_fluxes){
+				Set_initial_state(initial_flux, basis);
+				component_states.push_back(Copy_State());
+			}
+			Evolve_Components_Analytically();
+		}
+		else{
+			double t_start = Get_t();
+			double x_start = track->GetX();
+			DecayEvolutionSnapshot first;
+			for (const marray<double,Dim>& initial_flux : initial_fluxes){
+				t = t_start;
+				track->SetX(x_start);
+				//The integrator left the last step of the previous component in place of the initial one.
+				double h_start = (first.Initial_Step() > 0) ? first.Initial_Step() : requested_h;
+				if (h_start > 0){
+					nuSQUIDS::Set_h(h_start);
+				}
+				Set_initial_state(initial_flux, basis);
+				snapshot.Clear();
+				DT_model.reset();
+				Evolve_To_End();
+				if (component_states.empty()){
+					first = snapshot;
+				}
+				component_states.push_back(Copy_State());
+			}
+			snapshot = first;
+		}
+		Superpose(std::vector<double>(component_states.size(), 1.0));
+	}
+
+	//! Returns the number of flux components of the last EvolveComponents(), or 0.
+	unsigned int Get_NumComponents() const { return component_states.size(); }
+
+	//! Sets the state to a weighted sum of the final states of the flux components of EvolveComponents().
+	/*!
+	Can be called any number of times, e.g. with a unit vector to read the final
+	flux of one component with EvalFlavor(), or with the weights of systematic
+	variations of the components.
+	\param weights holds one weight per component.
+	*/
+	void Superpose(const std::vector<double>& weights){
+		if (component_states.empty() || weights.size() != component_states.size()){
+			throw std::runtime_error("nuSQUIDSDecay: the weights do not match the flux components.");
+		}
+		for (size_t ie = 0; ie < ne; ie++){
+			for (unsigned int irho = 0; irho < nrhos; irho++){
+				squids::SU_vector& rho = state[ie].rho[irho];
+				rho = weights[0]*component_states[0][ie*nrhos + irho];
+				for (size_t k = 1; k < component_states.size(); k++){
+					rho += weights[k]*component_states[k][ie*nrhos + irho];
+				}
+			}
+		}
+	}
 }; // close nusquids class definition
 } // close nusquids namespace
 #endif // nusquids_decay_h
@@ -0,0 +1,154 @@
+#ifndef nusquids_decay_atm_H
+#define nusquids_decay_atm_H
+
+/*
+Parallel evolution of the zenith bins of nuSQUIDSAtm objects, e.g. the
+nuSQUIDSAtm<nuSQUIDSDecay> objects of the atmospheric examples, and of
+several flux components with one such object.
+*/
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include "nusquids_decay_threads.h"
+
+namespace nusquids {
+
+//! Evolves the zenith bins of several atmospheric objects concurrently.
+/*!
+The zenith bins of a nuSQUIDSAtm are independent systems, each with its own
+track, so they can be evolved on different threads. The bins of all the
+objects (e.g. the kaon and the pion flux components) are pooled and handed
+out one at a time to nthreads threads (see DecayThreadPool::ParallelForDynamic()),
+so objects with few bins do not leave threads idle. The result is the same as
+calling EvolveState() on every object in turn.
+
+All bins of a nuSQUIDSAtm share its body. If reading the body is not safe from
+several threads (EarthAtm, for instance, caches its last spline lookup),
+make_body can be given to build one body per thread: each bin is then switched
+to the body of the thread evolving it just before it is evolved. The bodies
+must all describe the same medium.
+
+The initial state of every object must have been set. If a bin throws, the
+first exception is rethrown once all threads have stopped, and the state of
+the other bins is unspecified.
+\param atms are the objects to evolve.
+\param nthreads is the total number of threads, including the calling thread.
+\param make_body returns a new body for each thread, if set.
+*/
+template<typename BaseSQUIDS>
+void EvolveStateParallel(const std::vector<nuSQUIDSAtm<BaseSQUIDS>*>& atms, unsigned int nthreads,
+						 std::function<std::shared_ptr<Body>()> make_body = nullptr){
+	//(object, zenith bin) of every system to evolve.
+	std::vector<std::pair<nuSQUIDSAtm<BaseSQUIDS>*,unsigned int>> bins;
+	for (nuSQUIDSAtm<BaseSQUIDS>* atm : atms){
+		for (unsigned int ci = 0; ci < atm->GetNumCos(); ci++){
+			bins.emplace_back(atm,ci);
+		}
+	}
+	if (nthreads == 0){
+		nthreads = 1;
+	}
+	std::vector<std::shared_ptr<Body>> bodies(nthreads);
+	if (make_body){
+		for (unsigned int thread = 0; thread < nthreads; thread++){
+			bodies[thread] = make_body();
+		}
+	}
+	DecayThreadPool pool(nthreads);
+	pool.ParallelForDynamic(bins.size(),[&](size_t i, unsigned int thread){
+		BaseSQUIDS& nus = bins[i].first->GetnuSQuIDS(bins[i].second);
+		if (bodies[thread]){
+			nus.Set_Body(bodies[thread]);
+		}
+		nus.EvolveState();
+	});
+}
+
+//! Evolves the zenith bins of an atmospheric object concurrently.
+/*!
+See EvolveStateParallel(const std::vector<nuSQUIDSAtm<BaseSQUIDS>*>&, unsigned int, std::function<std::shared_ptr<Body>()>).
+*/
+template<typename BaseSQUIDS>
+void EvolveStateParallel(nuSQUIDSAtm<BaseSQUIDS>& atm, unsigned int nthreads,
+						 std::function<std::shared_ptr<Body>()> make_body = nullptr){
+	EvolveStateParallel(std::vector<nuSQUIDSAtm<BaseSQUIDS>*>{&atm},nthreads,make_body);
+}
+
+//! Evolves several flux components of an atmospheric object, with its zenith bins evolved concurrently.
+/*!
+Instead of one nuSQUIDSAtm per flux component (kaon, pion, prompt...), which
+repeats the setup of every bin for each component, each bin evolves all the
+components with nuSQUIDSDecay::EvolveComponents(). The components can then be
+combined with any weights with SuperposeComponents(). In the Earth, each bin
+still integrates every component in full (see EvolveComponents()), so the
+evolution itself costs as much as one object per component. When the
+components do not need to be superposed, one object per component evolved with
+EvolveStateParallel() is as fast, and spreads more bins over the threads.
+On return, the state of every bin is the sum of the components.
+The bins are spread over the threads as in EvolveStateParallel().
+\param atm is the object.
+\param initial_fluxes are the initial fluxes of the components, each as given to nuSQUIDSAtm::Set_initial_state().
+\param basis is their basis.
+\param nthreads is the total number of threads, including the calling thread.
+\param make_body returns a new body for each thread, if set. See EvolveStateParallel().
+*/
+template<typename BaseSQUIDS>
+void EvolveComponentsParallel(nuSQUIDSAtm<BaseSQUIDS>& atm, const std::vector<marray<double,4>>& initial_fluxes,
+							  Basis basis, unsigned int nthreads,
+							  std::function<std::shared_ptr<Body>()> make_body = nullptr){
+	if (initial_fluxes.empty()){
+		throw std::runtime_error("EvolveComponentsParallel: no flux components were given.");
+	}
+	//Marks the initial state of the object as set, for its evaluation functions.
+	atm.Set_initial_state(initial_fluxes[0],basis);
+	if (nthreads == 0){
+		nthreads = 1;
+	}
+	std::vector<std::shared_ptr<Body>> bodies(nthreads);
+	if (make_body){
+		for (unsigned int thread = 0; thread < nthreads; thread++){
+			bodies[thread] = make_body();
+		}
+	}
+	DecayThreadPool pool(nthreads);
+	pool.ParallelForDynamic(atm.GetNumCos(),[&](size_t ci, unsigned int thread){
+		BaseSQUIDS& nus = atm.GetnuSQuIDS(ci);
+		if (bodies[thread]){
+			nus.Set_Body(bodies[thread]);
+		}
+		//The flux of each component in this bin, indexed [energy][rho][flavor].
+		std::vector<marray<double,3>> bin_fluxes;
+		for (const marray<double,4>& flux : initial_fluxes){
+			marray<double,3> bin_flux {flux.extent(1),flux.extent(2),flux.extent(3)};
+			for (size_t ie = 0; ie < flux.extent(1); ie++){
+				for (size_t irho = 0; irho < flux.extent(2); irho++){
+					for (size_t flv = 0; flv < flux.extent(3); flv++){
+						bin_flux[ie][irho][flv] = flux[ci][ie][irho][flv];
+					}
+				}
+			}
+			bin_fluxes.push_back(std::move(bin_flux));
+		}
+		nus.EvolveComponents(bin_fluxes,basis);
+	});
+}
+
+//! Sets the state of every zenith bin to a weighted sum of the components of EvolveComponentsParallel().
+/*!
+See nuSQUIDSDecay::Superpose().
+\param atm is the object.
+\param weights holds one weight per component.
+*/
+template<typename BaseSQUIDS>
+void SuperposeComponents(nuSQUIDSAtm<BaseSQUIDS>& atm, const std::vector<double>& weights){
+	for (unsigned int ci = 0; ci < atm.GetNumCos(); ci++){
+		atm.GetnuSQuIDS(ci).Superpose(weights);
+	}
+}
+
+} // close nusquids namespace
+#endif // nusquids_decay_atm_H
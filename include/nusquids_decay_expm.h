@@ -0,0 +1,151 @@
+#ifndef nusquids_decay_expm_H
+#define nusquids_decay_expm_H
+
+/*
+Small dense complex matrices, and their exponential, used by the analytic
+evolution of nuSQUIDSDecay. See nuSQUIDSDecay::EvolveState().
+*/
+
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <algorithm>
+#include <gsl/gsl_complex.h>
+#include <gsl/gsl_complex_math.h>
+#include <gsl/gsl_matrix.h>
+#include <SQuIDS/SQuIDS.h>
+
+namespace nusquids {
+
+//! A dense, row-major, square complex matrix of the size of a neutrino system.
+class DecayComplexMatrix {
+private:
+	unsigned int n;
+	std::vector<std::complex<double>> a;
+
+public:
+	//! Zero matrix of dimension n.
+	explicit DecayComplexMatrix(unsigned int n_ = 0): n(n_), a(n_*n_) {}
+
+	//! The matrix of the components of an SU_vector.
+	explicit DecayComplexMatrix(const squids::SU_vector& v): DecayComplexMatrix(v.Dim()) {
+		auto m = v.GetGSLMatrix();
+		for (unsigned int i = 0; i < n; i++){
+			for (unsigned int j = 0; j < n; j++){
+				gsl_complex z = gsl_matrix_complex_get(m.get(),i,j);
+				a[i*n+j] = std::complex<double>(GSL_REAL(z),GSL_IMAG(z));
+			}
+		}
+	}
+
+	//! Identity matrix of dimension n.
+	static DecayComplexMatrix Identity(unsigned int n){
+		DecayComplexMatrix m(n);
+		for (unsigned int i = 0; i < n; i++){
+			m(i,i) = 1;
+		}
+		return m;
+	}
+
+	unsigned int Dim() const { return n; }
+	std::complex<double>& operator()(unsigned int i, unsigned int j) { return a[i*n+j]; }
+	const std::complex<double>& operator()(unsigned int i, unsigned int j) const { return a[i*n+j]; }
+
+	DecayComplexMatrix operator*(const DecayComplexMatrix& b) const {
+		DecayComplexMatrix c(n);
+		for (unsigned int i = 0; i < n; i++){
+			for (unsigned int k = 0; k < n; k++){
+				std::complex<double> aik = a[i*n+k];
+				for (unsigned int j = 0; j < n; j++){
+					c.a[i*n+j] += aik*b.a[k*n+j];
+				}
+			}
+		}
+		return c;
+	}
+
+	DecayComplexMatrix& operator+=(const DecayComplexMatrix& b){
+		for (size_t i = 0; i < a.size(); i++){
+			a[i] += b.a[i];
+		}
+		return *this;
+	}
+
+	DecayComplexMatrix& operator*=(std::complex<double> z){
+		for (std::complex<double>& x : a){
+			x *= z;
+		}
+		return *this;
+	}
+
+	//! Returns the conjugate transpose.
+	DecayComplexMatrix Adjoint() const {
+		DecayComplexMatrix c(n);
+		for (unsigned int i = 0; i < n; i++){
+			for (unsigned int j = 0; j < n; j++){
+				c.a[j*n+i] = std::conj(a[i*n+j]);
+			}
+		}
+		return c;
+	}
+
+	//! Returns the maximum absolute column sum.
+	double Norm1() const {
+		double norm = 0;
+		for (unsigned int j = 0; j < n; j++){
+			double sum = 0;
+			for (unsigned int i = 0; i < n; i++){
+				sum += std::abs(a[i*n+j]);
+			}
+			norm = std::max(norm,sum);
+		}
+		return norm;
+	}
+
+	//! Returns the exponential of the matrix.
+	/*!
+	Scaling and squaring: the matrix is divided by 2^s so that its norm is below
+	1/2, exponentiated with a Taylor series summed to machine precision, and the
+	result is squared s times. Meant for the small matrices of neutrino systems.
+	*/
+	DecayComplexMatrix Exp() const {
+		double norm = Norm1();
+		int s = 0;
+		if (norm > 0.5){
+			s = (int)std::ceil(std::log2(norm/0.5));
+		}
+		DecayComplexMatrix scaled = *this;
+		scaled *= std::ldexp(1.0,-s);
+		DecayComplexMatrix result = Identity(n);
+		DecayComplexMatrix term = Identity(n);
+		for (unsigned int k = 1; k < 40; k++){
+			term = term*scaled;
+			term *= 1.0/k;
+			result += term;
+			if (term.Norm1() <= 1e-17*result.Norm1()){
+				break;
+			}
+		}
+		for (int i = 0; i < s; i++){
+			result = result*result;
+		}
+		return result;
+	}
+
+	//! Returns the SU_vector of the hermitian part of the matrix.
+	squids::SU_vector Hermitian_Part() const {
+		gsl_matrix_complex* m = gsl_matrix_complex_alloc(n,n);
+		for (unsigned int i = 0; i < n; i++){
+			for (unsigned int j = 0; j < n; j++){
+				std::complex<double> z = 0.5*(a[i*n+j] + std::conj(a[j*n+i]));
+				gsl_matrix_complex_set(m,i,j,gsl_complex_rect(z.real(),z.imag()));
+			}
+		}
+		squids::SU_vector v(m);
+		gsl_matrix_complex_free(m);
+		return v;
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_expm_H
@@ -0,0 +1,354 @@
+#ifndef nusquids_decay_flux_H
+#define nusquids_decay_flux_H
+
+/*
+Header implementing FluxTable, a read-only, memory-mapped view of a text
+flux table, and FluxResampler, which interpolates such a table onto the
+energy (and zenith) nodes of a simulation. Used by the examples to read
+their initial fluxes.
+*/
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include <nuSQuIDS/tools.h>
+
+namespace nusquids {
+
+//! A table of doubles read from a whitespace separated text file, such as the files in fluxes/.
+/*!
+The first Open() of a text file parses it once (with quickread()) and writes
+its values next to it, in a binary sidecar file <path>.bin. Later calls, from
+this or any other process, map the sidecar into memory instead of parsing the
+text again. The sidecar records the size and modification time (to the
+nanosecond) of the text file it was built from, and is rebuilt whenever they
+change, or if it is truncated, corrupt or of an older version.
+
+The mapping is read only and shared: every process reading the same table
+shares the same pages of the page cache, and a single FluxTable can be read
+by any number of threads (e.g. the workers of a DecayScan) at once.
+
+The sidecar holds a 64 byte header (see Header) followed by the values in row-major
+order, so the values are 64 byte aligned in memory.
+*/
+class FluxTable {
+private:
+	//! Layout of the first bytes of a sidecar file.
+	struct Header {
+		char magic[8];
+		uint64_t version;
+		uint64_t rows;
+		uint64_t cols;
+		//! Size and modification time of the text file the sidecar was built from.
+		uint64_t source_size;
+		int64_t source_mtime_sec;
+		int64_t source_mtime_nsec;
+		char padding[8];
+	};
+	static_assert(sizeof(Header) == 64, "FluxTable::Header must keep the values 64 byte aligned.");
+
+	static const char* Magic() { return "NSDFLUX"; }
+	static const uint64_t version = 2;
+
+	void* mapping = MAP_FAILED;
+	size_t mapping_size = 0;
+	const double* values = nullptr;
+	size_t nrows = 0;
+	size_t ncols = 0;
+
+	FluxTable(){}
+
+	//! Returns the nanoseconds of the modification time of a file.
+	static int64_t Mtime_Nsec(const struct stat& st){
+#ifdef __APPLE__
+		return st.st_mtimespec.tv_nsec;
+#else
+		return st.st_mtim.tv_nsec;
+#endif
+	}
+
+	//! Parses a text table and writes its sidecar.
+	/*!
+	The sidecar is written to a temporary file which is then renamed, so that
+	processes converting the same table concurrently never see a partial file.
+	\param source is the status of the text file, taken before it is read.
+	*/
+	static void Write_Sidecar(const std::string& path, const std::string& sidecar, const struct stat& source){
+		marray<double,2> table = quickread(path);
+		Header header;
+		std::memset(&header,0,sizeof(header));
+		std::strncpy(header.magic,Magic(),sizeof(header.magic));
+		header.version = version;
+		header.rows = table.extent(0);
+		header.cols = table.extent(1);
+		header.source_size = source.st_size;
+		header.source_mtime_sec = source.st_mtime;
+		header.source_mtime_nsec = Mtime_Nsec(source);
+
+		std::string tmp = sidecar + ".tmp." + std::to_string(getpid());
+		FILE* out = std::fopen(tmp.c_str(),"wb");
+		if (!out){
+			throw std::runtime_error("FluxTable: cannot write " + tmp);
+		}
+		size_t nvalues = header.rows*header.cols;
+		bool ok = std::fwrite(&header,sizeof(header),1,out) == 1;
+		ok = ok && std::fwrite(table.get_data(),sizeof(double),nvalues,out) == nvalues;
+		ok = (std::fclose(out) == 0) && ok;
+		if (!ok || std::rename(tmp.c_str(),sidecar.c_str()) != 0){
+			std::remove(tmp.c_str());
+			throw std::runtime_error("FluxTable: cannot write " + sidecar);
+		}
+	}
+
+	void Unmap(){
+		if (mapping != MAP_FAILED){
+			munmap(mapping,mapping_size);
+		}
+		mapping = MAP_FAILED;
+		mapping_size = 0;
+	}
+
+	//! Maps a sidecar into memory.
+	/*!
+	Returns false, mapping nothing, if the sidecar is missing, is not a valid
+	table of this version, or was not built from the text file as it is now.
+	\param source is the status of the text file, or null if there is none:
+	the sidecar is then all there is, and is used as long as it is valid.
+	*/
+	bool Try_Map(const std::string& sidecar, const struct stat* source){
+		int fd = open(sidecar.c_str(),O_RDONLY);
+		if (fd < 0){
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd,&st) != 0 || st.st_size < (off_t)sizeof(Header)){
+			close(fd);
+			return false;
+		}
+		mapping_size = st.st_size;
+		mapping = mmap(nullptr,mapping_size,PROT_READ,MAP_SHARED,fd,0);
+		close(fd);
+		if (mapping == MAP_FAILED){
+			throw std::runtime_error("FluxTable: cannot map " + sidecar);
+		}
+		const Header* header = static_cast<const Header*>(mapping);
+		bool valid = std::strncmp(header->magic,Magic(),sizeof(header->magic)) == 0 && header->version == version
+				&& mapping_size == sizeof(Header) + header->rows*header->cols*sizeof(double);
+		if (valid && source){
+			valid = header->source_size == (uint64_t)source->st_size && header->source_mtime_sec == (int64_t)source->st_mtime
+				&& header->source_mtime_nsec == Mtime_Nsec(*source);
+		}
+		if (!valid){
+			Unmap();
+			return false;
+		}
+		nrows = header->rows;
+		ncols = header->cols;
+		values = reinterpret_cast<const double*>(static_cast<const char*>(mapping) + sizeof(Header));
+		return true;
+	}
+
+public:
+	FluxTable(const FluxTable&)=delete;
+	FluxTable& operator=(const FluxTable&)=delete;
+
+	~FluxTable(){ Unmap(); }
+
+	//! Opens a text flux table, through its binary sidecar.
+	/*!
+	\param path is the path of the text file. Its sidecar is path + ".bin".
+	\return a table which can be shared by all the readers of the process.
+	*/
+	static std::shared_ptr<const FluxTable> Open(const std::string& path){
+		std::string sidecar = path + ".bin";
+		struct stat source;
+		bool has_source = (stat(path.c_str(),&source) == 0);
+		std::shared_ptr<FluxTable> table(new FluxTable());
+		if (table->Try_Map(sidecar,has_source ? &source : nullptr)){
+			return table;
+		}
+		if (!has_source){
+			throw std::runtime_error("FluxTable: cannot open " + path);
+		}
+		//Missing, stale, truncated or corrupt: rebuild it from the text file.
+		Write_Sidecar(path,sidecar,source);
+		if (!table->Try_Map(sidecar,&source)){
+			throw std::runtime_error("FluxTable: " + sidecar + " is not a valid flux table.");
+		}
+		return table;
+	}
+
+	//! Returns the number of rows of the table.
+	size_t Rows() const { return nrows; }
+
+	//! Returns the number of columns of the table.
+	size_t Cols() const { return ncols; }
+
+	//! Returns the value at a row and column.
+	double operator()(size_t row, size_t col) const { return values[row*ncols + col]; }
+
+	//! Returns the values of the table, row-major.
+	const double* Data() const { return values; }
+};
+
+//! Interpolates the columns of a FluxTable onto the nodes of a simulation.
+/*!
+The table is a grid in energy, or in cos(zenith) and energy, given as one row
+per grid point: the energy is in one of the columns, and for two dimensional
+tables the cos(zenith) is in another one, with all the energies of a zenith
+bin in consecutive rows (the layout of the atmospheric fluxes in fluxes/).
+The table grid does not need to match the simulation grid: the resampler
+interpolates linearly in log(E) (and linearly in cos(zenith)), so any grid
+inside the range of the table can be used.
+
+The neighbours and weights of every simulation node are found once, when
+the resampler is built. Evaluating a node is then two (or four) multiply-adds,
+and the same resampler serves every column of the table and every object
+evaluated on the same grid.
+*/
+class FluxResampler {
+private:
+	//! Interpolation of one node: (1-weight)*value[low] + weight*value[low+1].
+	struct Node {
+		size_t low;
+		double weight;
+	};
+	std::vector<Node> energy_plan;
+	std::vector<Node> cos_plan;
+	//! Number of energies per zenith bin in the table.
+	size_t nsource_e = 0;
+
+	//! Returns the interpolation nodes of targets on an increasing source grid.
+	static std::vector<Node> Plan(const std::vector<double>& source, const std::vector<double>& target, const std::string& axis){
+		if (source.size() < 2){
+			throw std::runtime_error("FluxResampler: the " + axis + " grid of the table needs at least two points.");
+		}
+		for (size_t i = 1; i < source.size(); i++){
+			if (!(source[i] > source[i-1])){
+				throw std::runtime_error("FluxResampler: the " + axis + " grid of the table must be increasing.");
+			}
+		}
+		const double tolerance = 1e-9*(source.back()-source.front());
+		std::vector<Node> plan(target.size());
+		size_t low = 0;
+		for (size_t it = 0; it < target.size(); it++){
+			double x = target[it];
+			if (x < source.front()-tolerance || x > source.back()+tolerance){
+				throw std::runtime_error("FluxResampler: a node is outside the " + axis + " range of the table.");
+			}
+			//Targets are usually increasing, so resume the search from the last interval.
+			if (x < source[low]){
+				low = 0;
+			}
+			while (low+2 < source.size() && x > source[low+1]){
+				low++;
+			}
+			double weight = (x-source[low])/(source[low+1]-source[low]);
+			plan[it].low = low;
+			plan[it].weight = std::min(std::max(weight,0.0),1.0);
+		}
+		return plan;
+	}
+
+	static std::vector<double> Log(const std::vector<double>& x){
+		std::vector<double> log_x(x.size());
+		for (size_t i = 0; i < x.size(); i++){
+			if (!(x[i] > 0)){
+				throw std::runtime_error("FluxResampler: energies must be positive.");
+			}
+			log_x[i] = std::log(x[i]);
+		}
+		return log_x;
+	}
+
+	static std::vector<double> Scaled(const marray<double,1>& x, double scale){
+		std::vector<double> scaled(x.size());
+		for (size_t i = 0; i < x.size(); i++){
+			scaled[i] = x[i]*scale;
+		}
+		return scaled;
+	}
+
+public:
+	//! Builds the resampler of a table with one energy per row.
+	/*!
+	\param table is the flux table.
+	\param e_col is the column holding the energies.
+	\param e_unit is the unit of the energies in the table, in the units of \p e_nodes (e.g. units.GeV).
+	\param e_nodes are the energy nodes of the simulation, as returned by GetERange().
+	*/
+	FluxResampler(const FluxTable& table, size_t e_col, double e_unit, const marray<double,1>& e_nodes):
+	nsource_e(table.Rows()){
+		std::vector<double> source_e(table.Rows());
+		for (size_t row = 0; row < table.Rows(); row++){
+			source_e[row] = table(row,e_col);
+		}
+		energy_plan = Plan(Log(source_e),Log(Scaled(e_nodes,1.0/e_unit)),"energy");
+		cos_plan.assign(1,Node{0,0.0});
+	}
+
+	//! Builds the resampler of a table with one (cos(zenith), energy) point per row.
+	/*!
+	\param table is the flux table. Its cos(zenith) bins hold the same energies, in consecutive rows.
+	\param cos_col is the column holding the cos(zenith).
+	\param e_col is the column holding the energies.
+	\param e_unit is the unit of the energies in the table, in the units of \p e_nodes (e.g. units.GeV).
+	\param cos_nodes are the cos(zenith) nodes of the simulation, as returned by GetCosthRange().
+	\param e_nodes are the energy nodes of the simulation, as returned by GetERange().
+	*/
+	FluxResampler(const FluxTable& table, size_t cos_col, size_t e_col, double e_unit,
+					const marray<double,1>& cos_nodes, const marray<double,1>& e_nodes){
+		if (table.Rows() == 0){
+			throw std::runtime_error("FluxResampler: the table is empty.");
+		}
+		while (nsource_e < table.Rows() && table(nsource_e,cos_col) == table(0,cos_col)){
+			nsource_e++;
+		}
+		if (table.Rows() % nsource_e != 0){
+			throw std::runtime_error("FluxResampler: the zenith bins of the table do not hold the same number of energies.");
+		}
+		std::vector<double> source_e(nsource_e), source_cos(table.Rows()/nsource_e);
+		for (size_t ie = 0; ie < nsource_e; ie++){
+			source_e[ie] = table(ie,e_col);
+		}
+		for (size_t ic = 0; ic < source_cos.size(); ic++){
+			source_cos[ic] = table(ic*nsource_e,cos_col);
+		}
+		energy_plan = Plan(Log(source_e),Log(Scaled(e_nodes,1.0/e_unit)),"energy");
+		cos_plan = Plan(source_cos,Scaled(cos_nodes,1.0),"cos(zenith)");
+	}
+
+	//! Returns the interpolated value of a column at energy node ie (and zenith node icos).
+	double operator()(const FluxTable& table, size_t col, size_t ie, size_t icos = 0) const {
+		const Node& e = energy_plan[ie];
+		const Node& c = cos_plan[icos];
+		size_t row = c.low*nsource_e + e.low;
+		double value = (1-e.weight)*table(row,col) + e.weight*table(row+1,col);
+		if (c.weight > 0){
+			row += nsource_e;
+			double next = (1-e.weight)*table(row,col) + e.weight*table(row+1,col);
+			value = (1-c.weight)*value + c.weight*next;
+		}
+		return value;
+	}
+
+	//! Returns the number of energy nodes of the simulation.
+	size_t GetNumE() const { return energy_plan.size(); }
+
+	//! Returns the number of cos(zenith) nodes of the simulation, 1 for one dimensional tables.
+	size_t GetNumCos() const { return cos_plan.size(); }
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_flux_H
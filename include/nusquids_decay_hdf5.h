@@ -0,0 +1,437 @@
+#ifndef nusquids_decay_hdf5_H
+#define nusquids_decay_hdf5_H
+
+/*
+Header implementing DecayScanStore, which writes the results of a DecayScan
+into a single HDF5 file, and DecayObservationStore, which writes the fluxes
+observed along the track of one evolution. See nusquids_decay_scan.h for the
+scan itself, and nuSQUIDSDecay::Set_Observer() for the observations.
+*/
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include <stdexcept>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+#ifdef NUSQUIDS_DECAY_MPI
+#include <mpi.h>
+#endif
+#include "nusquids_decay_scan.h"
+
+namespace nusquids {
+
+//! Writes the final fluxes of every point of a decay scan into one HDF5 file.
+/*!
+The file holds:
+ - "flux": final fluxes, a chunked, compressed dataset of shape
+   (nu4mass, theta24, coupling, energy, flavor, rho), with rho = 0 for
+   neutrinos and 1 for antineutrinos. Points which were not evaluated, or
+   which failed, are NaN. Each chunk holds one point, so points are written
+   independently and in any order.
+ - "status": one entry per point, shape (nu4mass, theta24, coupling):
+   0 if not written, 1 if evaluated, -1 if the evaluation failed, 2 if
+   interpolated from evaluated points (see DecayScan::Run_Adaptive()).
+ - "nu4mass", "theta24", "coupling", "energy": the axes of the grid. The
+   energies are in eV (the natural units of nuSQuIDS).
+ - "initial_flux": the initial fluxes, shape (energy, flavor, rho), if given.
+
+The two innermost axes of "flux" are laid out as the columns of the text
+output of the examples, so that flux.reshape(m,t,c,E,2*numneu)[...,:4]
+gives the (nu_e, anti nu_e, nu_mu, anti nu_mu) array read by
+InteractivePlot.ipynb.
+Writes are not thread safe: use the store from DecayScan::Set_ResultCallback(),
+whose calls are serialized.
+If compiled with NUSQUIDS_DECAY_MPI, a store can also be opened by all the
+ranks of a communicator on one file, with parallel HDF5; see the MPI
+constructor.
+*/
+class DecayScanStore {
+private:
+	hid_t file=-1;
+	hid_t flux_dataset=-1;
+	hid_t status_dataset=-1;
+	hsize_t ne;
+	hsize_t numneu;
+	//! True if the file is opened by all the ranks of a communicator.
+	bool parallel = false;
+
+	//! Throws if an HDF5 call failed.
+	static void Check(herr_t status, const std::string& what){
+		if (status < 0){
+			throw std::runtime_error("DecayScanStore: " + what + " failed.");
+		}
+	}
+
+	//! Throws if an HDF5 call failed, and returns its identifier otherwise.
+	static hid_t Check_Id(hid_t id, const std::string& what){
+		if (id < 0){
+			throw std::runtime_error("DecayScanStore: " + what + " failed.");
+		}
+		return id;
+	}
+
+	void Write_Axis(const std::string& name, const std::vector<double>& axis){
+		hsize_t size = axis.size();
+		Check(H5LTmake_dataset_double(file,name.c_str(),1,&size,axis.data()),"writing axis " + name);
+	}
+
+	//! Writes the initial flux, indexed [energy][rho][flavor], as (energy, flavor, rho).
+	void Write_Initial_Flux(const marray<double,3>& initial_flux){
+		std::vector<double> flux(ne*numneu*2);
+		for (unsigned int ie = 0; ie < ne; ie++){
+			for (unsigned int flv = 0; flv < numneu; flv++){
+				for (unsigned int irho = 0; irho < 2; irho++){
+					flux[(ie*numneu + flv)*2 + irho] = initial_flux[ie][irho][flv];
+				}
+			}
+		}
+		hsize_t dims[3] = {ne,numneu,2};
+		Check(H5LTmake_dataset_double(file,"initial_flux",3,dims,flux.data()),"writing the initial flux");
+	}
+
+	//! Creates the flux and status datasets.
+	/*!
+	\param compress is false to store the fluxes uncompressed, as parallel HDF5
+	only writes compressed chunks collectively.
+	*/
+	void Create_Datasets(const DecayScanAxes& axes, bool compress = true){
+		hsize_t dims[6] = {axes.nu4mass.size(),axes.theta24.size(),axes.coupling.size(),ne,numneu,2};
+		hsize_t chunk[6] = {1,1,1,ne,numneu,2};
+
+		hid_t space = Check_Id(H5Screate_simple(6,dims,NULL),"creating the flux dataspace");
+		hid_t plist = Check_Id(H5Pcreate(H5P_DATASET_CREATE),"creating the flux properties");
+		double fill = std::numeric_limits<double>::quiet_NaN();
+		herr_t status = H5Pset_chunk(plist,6,chunk);
+		if (compress && status >= 0){ status = H5Pset_shuffle(plist); }
+		if (compress && status >= 0){ status = H5Pset_deflate(plist,4); }
+		if (status >= 0){ status = H5Pset_fill_value(plist,H5T_NATIVE_DOUBLE,&fill); }
+		if (status >= 0){
+			flux_dataset = H5Dcreate2(file,"flux",H5T_NATIVE_DOUBLE,space,H5P_DEFAULT,plist,H5P_DEFAULT);
+		}
+		H5Pclose(plist);
+		H5Sclose(space);
+		Check(status,"setting the flux properties");
+		Check_Id(flux_dataset,"creating the flux dataset");
+		Check(H5LTset_attribute_string(file,"flux","axes","nu4mass,theta24,coupling,energy,flavor,rho"),
+				"writing the flux axes attribute");
+
+		space = Check_Id(H5Screate_simple(3,dims,NULL),"creating the status dataspace");
+		plist = Check_Id(H5Pcreate(H5P_DATASET_CREATE),"creating the status properties");
+		signed char not_written = 0;
+		status = H5Pset_fill_value(plist,H5T_NATIVE_SCHAR,&not_written);
+		if (status >= 0){
+			status_dataset = H5Dcreate2(file,"status",H5T_NATIVE_SCHAR,space,H5P_DEFAULT,plist,H5P_DEFAULT);
+		}
+		H5Pclose(plist);
+		H5Sclose(space);
+		Check(status,"setting the status properties");
+		Check_Id(status_dataset,"creating the status dataset");
+	}
+
+	//! Writes count elements of data at offset of a dataset of rank rank.
+	static void Write_Block(hid_t dataset, hid_t type, int rank, const hsize_t* offset,
+							const hsize_t* count, const void* data){
+		hid_t filespace = Check_Id(H5Dget_space(dataset),"getting a dataspace");
+		hid_t memspace = H5Screate_simple(rank,count,NULL);
+		herr_t status = (memspace < 0) ? -1 : H5Sselect_hyperslab(filespace,H5S_SELECT_SET,offset,NULL,count,NULL);
+		if (status >= 0){
+			status = H5Dwrite(dataset,type,memspace,filespace,H5P_DEFAULT,data);
+		}
+		if (memspace >= 0){ H5Sclose(memspace); }
+		H5Sclose(filespace);
+		Check(status,"writing a point");
+	}
+
+	//! Opens the datasets of an existing file, and checks that they match the scan.
+	void Open_Datasets(const DecayScanAxes& axes){
+		flux_dataset = Check_Id(H5Dopen2(file,"flux",H5P_DEFAULT),"opening the flux dataset");
+		status_dataset = Check_Id(H5Dopen2(file,"status",H5P_DEFAULT),"opening the status dataset");
+		hsize_t expected[6] = {axes.nu4mass.size(),axes.theta24.size(),axes.coupling.size(),ne,numneu,2};
+		hsize_t dims[6];
+		hid_t space = Check_Id(H5Dget_space(flux_dataset),"getting the flux dataspace");
+		int rank = H5Sget_simple_extent_ndims(space);
+		if (rank == 6){
+			H5Sget_simple_extent_dims(space,dims,NULL);
+		}
+		H5Sclose(space);
+		if (rank != 6 || !std::equal(dims,dims+6,expected)){
+			throw std::runtime_error("DecayScanStore: the file does not match the grid of the scan.");
+		}
+	}
+
+	void Close(){
+		if (flux_dataset >= 0){ H5Dclose(flux_dataset); }
+		if (status_dataset >= 0){ H5Dclose(status_dataset); }
+		if (file >= 0){ H5Fclose(file); }
+		flux_dataset = status_dataset = file = -1;
+	}
+
+public:
+	//! Creates the file of a scan, or reopens it to resume the scan.
+	/*!
+	If resume is false, or the file does not exist, a new file is created,
+	overwriting any existing one. Otherwise the existing file is opened for
+	writing, after checking that its grid matches axes and settings, and the
+	points already written are kept: see Completed().
+	\param fname is the path of the file.
+	\param axes are the parameter axes of the scan.
+	\param settings are the settings of the scan, for the energy nodes and number of states.
+	\param initial_flux is the initial state in the flavor basis, indexed [energy][rho][flavor]
+	(see DecayScanSettings::initial_flux). It is written if not null, when the file is created.
+	\param resume is true to reopen an existing file.
+	*/
+	DecayScanStore(const std::string& fname, const DecayScanAxes& axes, const DecayScanSettings& settings,
+					const marray<double,3>* initial_flux = nullptr, bool resume = false):
+	ne(settings.e_nodes.size()), numneu(settings.numneu){
+		if (resume && std::ifstream(fname).good()){
+			file = Check_Id(H5Fopen(fname.c_str(),H5F_ACC_RDWR,H5P_DEFAULT),"opening " + fname);
+			try{
+				Open_Datasets(axes);
+			}
+			catch(...){
+				Close();
+				throw;
+			}
+			return;
+		}
+		file = Check_Id(H5Fcreate(fname.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,H5P_DEFAULT),"creating " + fname);
+		try{
+			Write_Axis("nu4mass",axes.nu4mass);
+			Write_Axis("theta24",axes.theta24);
+			Write_Axis("coupling",axes.coupling);
+			Write_Axis("energy",std::vector<double>(settings.e_nodes.begin(),settings.e_nodes.end()));
+			if (initial_flux){
+				Write_Initial_Flux(*initial_flux);
+			}
+			Create_Datasets(axes);
+		}
+		catch(...){
+			Close();
+			throw;
+		}
+	}
+
+#ifdef NUSQUIDS_DECAY_MPI
+	//! Creates the file of a scan split between the ranks of a communicator. Collective.
+	/*!
+	Every rank of comm must construct the store with the same arguments. The
+	file is opened with the MPI-IO driver of parallel HDF5, and each rank then
+	writes its own points independently, with Write(). The fluxes are not
+	compressed, since parallel HDF5 only writes compressed chunks collectively.
+	Destroying the store is collective as well.
+	\param comm is the communicator of the ranks sharing the file.
+	*/
+	DecayScanStore(const std::string& fname, const DecayScanAxes& axes, const DecayScanSettings& settings,
+					const marray<double,3>* initial_flux, MPI_Comm comm):
+	ne(settings.e_nodes.size()), numneu(settings.numneu), parallel(true){
+		hid_t fapl = Check_Id(H5Pcreate(H5P_FILE_ACCESS),"creating the file access properties");
+		herr_t status = H5Pset_fapl_mpio(fapl,comm,MPI_INFO_NULL);
+		if (status >= 0){
+			file = H5Fcreate(fname.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,fapl);
+		}
+		H5Pclose(fapl);
+		Check(status,"setting the MPI-IO driver");
+		Check_Id(file,"creating " + fname);
+		try{
+			//Every rank writes the same axes: the metadata calls are collective.
+			Write_Axis("nu4mass",axes.nu4mass);
+			Write_Axis("theta24",axes.theta24);
+			Write_Axis("coupling",axes.coupling);
+			Write_Axis("energy",std::vector<double>(settings.e_nodes.begin(),settings.e_nodes.end()));
+			if (initial_flux){
+				Write_Initial_Flux(*initial_flux);
+			}
+			Create_Datasets(axes,false);
+		}
+		catch(...){
+			Close();
+			throw;
+		}
+	}
+#endif
+
+	DecayScanStore(const DecayScanStore&)=delete;
+	DecayScanStore& operator=(const DecayScanStore&)=delete;
+
+	//! Flushes and closes the file.
+	~DecayScanStore(){ Close(); }
+
+	//! Writes the result of one point.
+	/*!
+	Failed points are marked in "status", and their fluxes are left NaN.
+	\param result is the result of the point, see DecayScanResult.
+	*/
+	void Write(const DecayScanResult& result){
+		const DecayScanPoint& p = result.point;
+		hsize_t offset[6] = {p.imass,p.itheta,p.icoupling,0,0,0};
+		if (result.success){
+			if (result.flux.size() != ne*numneu*2){
+				throw std::runtime_error("DecayScanStore: the result does not match the energy nodes of the file.");
+			}
+			hsize_t count[6] = {1,1,1,ne,numneu,2};
+			Write_Block(flux_dataset,H5T_NATIVE_DOUBLE,6,offset,count,result.flux.data());
+		}
+		signed char status = result.success ? (result.interpolated ? 2 : 1) : -1;
+		hsize_t count[3] = {1,1,1};
+		Write_Block(status_dataset,H5T_NATIVE_SCHAR,3,offset,count,&status);
+	}
+
+	//! Returns, by DecayScanPoint::index, whether each point was successfully written.
+	/*!
+	Points which failed, or were never written, are false, so passing the
+	result to DecayScan::Run() evaluates them again.
+	*/
+	std::vector<bool> Completed() const {
+		hid_t space = Check_Id(H5Dget_space(status_dataset),"getting the status dataspace");
+		hssize_t npoints = H5Sget_simple_extent_npoints(space);
+		H5Sclose(space);
+		std::vector<signed char> status(npoints > 0 ? npoints : 0);
+		Check(H5Dread(status_dataset,H5T_NATIVE_SCHAR,H5S_ALL,H5S_ALL,H5P_DEFAULT,status.data()),"reading the status");
+		std::vector<bool> completed(status.size());
+		for (size_t i = 0; i < status.size(); i++){
+			completed[i] = (status[i] == 1);
+		}
+		return completed;
+	}
+
+	//! Flushes the file to disk, so that the points written so far survive an interruption.
+	/*!
+	Does nothing on a store shared by MPI ranks, where flushing is collective
+	and the ranks write different numbers of points: the file is complete once
+	every rank destroyed the store.
+	*/
+	void Flush(){
+		if (!parallel){
+			Check(H5Fflush(file,H5F_SCOPE_LOCAL),"flushing the file");
+		}
+	}
+};
+
+//! Writes the fluxes observed at several positions of a track, in one evolution, into an HDF5 file.
+/*!
+The file holds:
+ - "flux": the fluxes, a chunked, compressed dataset of shape
+   (position, energy, flavor, rho), laid out as DecayObservation::flux at
+   each position. Positions which were not observed are NaN.
+ - "position": the observed positions, in the natural units of the track.
+ - "energy": the energy nodes, in eV.
+
+Pass Observer() to nuSQUIDSDecay::Set_Observer(), with the same positions.
+Each position is written when it is observed, so the file is filled as the
+evolution goes on.
+*/
+class DecayObservationStore {
+private:
+	hid_t file=-1;
+	hid_t flux_dataset=-1;
+	hsize_t npositions;
+	hsize_t ne;
+	hsize_t numneu;
+	hsize_t nrhos;
+
+	//! Throws if an HDF5 call failed.
+	static void Check(herr_t status, const std::string& what){
+		if (status < 0){
+			throw std::runtime_error("DecayObservationStore: " + what + " failed.");
+		}
+	}
+
+	//! Throws if an HDF5 call failed, and returns its identifier otherwise.
+	static hid_t Check_Id(hid_t id, const std::string& what){
+		if (id < 0){
+			throw std::runtime_error("DecayObservationStore: " + what + " failed.");
+		}
+		return id;
+	}
+
+	void Create_Dataset(){
+		hsize_t dims[4] = {npositions,ne,numneu,nrhos};
+		hsize_t chunk[4] = {1,ne,numneu,nrhos};
+
+		hid_t space = Check_Id(H5Screate_simple(4,dims,NULL),"creating the flux dataspace");
+		hid_t plist = Check_Id(H5Pcreate(H5P_DATASET_CREATE),"creating the flux properties");
+		double fill = std::numeric_limits<double>::quiet_NaN();
+		herr_t status = H5Pset_chunk(plist,4,chunk);
+		if (status >= 0){ status = H5Pset_shuffle(plist); }
+		if (status >= 0){ status = H5Pset_deflate(plist,4); }
+		if (status >= 0){ status = H5Pset_fill_value(plist,H5T_NATIVE_DOUBLE,&fill); }
+		if (status >= 0){
+			flux_dataset = H5Dcreate2(file,"flux",H5T_NATIVE_DOUBLE,space,H5P_DEFAULT,plist,H5P_DEFAULT);
+		}
+		H5Pclose(plist);
+		H5Sclose(space);
+		Check(status,"setting the flux properties");
+		Check_Id(flux_dataset,"creating the flux dataset");
+		Check(H5LTset_attribute_string(file,"flux","axes","position,energy,flavor,rho"),
+				"writing the flux axes attribute");
+	}
+
+	void Close(){
+		if (flux_dataset >= 0){ H5Dclose(flux_dataset); }
+		if (file >= 0){ H5Fclose(file); }
+		flux_dataset = file = -1;
+	}
+
+public:
+	//! Creates the file, overwriting any existing one.
+	/*!
+	\param fname is the path of the file.
+	\param positions are the positions given to nuSQUIDSDecay::Set_Observer().
+	\param e_nodes are the energy nodes of the observed object.
+	\param numneu_ is the number of neutrino states of the observed object.
+	\param nrhos_ is 2 if the object evolves both neutrinos and antineutrinos, 1 otherwise.
+	*/
+	DecayObservationStore(const std::string& fname, const std::vector<double>& positions,
+						  const marray<double,1>& e_nodes, unsigned int numneu_, unsigned int nrhos_):
+	npositions(positions.size()), ne(e_nodes.size()), numneu(numneu_), nrhos(nrhos_){
+		file = Check_Id(H5Fcreate(fname.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,H5P_DEFAULT),"creating " + fname);
+		try{
+			Check(H5LTmake_dataset_double(file,"position",1,&npositions,positions.data()),"writing the positions");
+			std::vector<double> energies(e_nodes.begin(),e_nodes.end());
+			Check(H5LTmake_dataset_double(file,"energy",1,&ne,energies.data()),"writing the energies");
+			Create_Dataset();
+		}
+		catch(...){
+			Close();
+			throw;
+		}
+	}
+
+	DecayObservationStore(const DecayObservationStore&)=delete;
+	DecayObservationStore& operator=(const DecayObservationStore&)=delete;
+
+	//! Flushes and closes the file.
+	~DecayObservationStore(){ Close(); }
+
+	//! Writes the fluxes of one observed position.
+	void Write(const DecayObservation& observation){
+		if (observation.index >= npositions || observation.flux.size() != ne*numneu*nrhos){
+			throw std::runtime_error("DecayObservationStore: the observation does not match the positions or energy nodes of the file.");
+		}
+		hsize_t offset[4] = {observation.index,0,0,0};
+		hsize_t count[4] = {1,ne,numneu,nrhos};
+		hid_t filespace = Check_Id(H5Dget_space(flux_dataset),"getting the flux dataspace");
+		hid_t memspace = H5Screate_simple(4,count,NULL);
+		herr_t status = (memspace < 0) ? -1 : H5Sselect_hyperslab(filespace,H5S_SELECT_SET,offset,NULL,count,NULL);
+		if (status >= 0){
+			status = H5Dwrite(flux_dataset,H5T_NATIVE_DOUBLE,memspace,filespace,H5P_DEFAULT,observation.flux.data());
+		}
+		if (memspace >= 0){ H5Sclose(memspace); }
+		H5Sclose(filespace);
+		Check(status,"writing a position");
+	}
+
+	//! Returns an observer which writes every observation to this file.
+	/*!
+	The store must outlive the evolutions using the observer.
+	*/
+	DecayObserver Observer(){
+		return [this](const DecayObservation& observation){ Write(observation); };
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_hdf5_H
@@ -0,0 +1,818 @@
+#ifndef nusquids_decay_model_H
+#define nusquids_decay_model_H
+
+/*
+Header implementing the DecayModel class, which holds the decay physics used by
+nuSQUIDSDecay: masses, couplings, decay rates, the "Gamma" matrix, and the
+precomputed regeneration kernel. See nusquids_decay.h and arXiv:1711.05921
+(referred to here as [1]) for details about the decay model.
+*/
+
+//Get mathematical constants.
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <gsl/gsl_matrix.h>
+#include <nuSQuIDS/nuSQuIDS.h>
+
+namespace nusquids {
+
+//! Strictly lower triangular n x n matrix, stored compactly.
+/*!
+Holds the entries (i,j) with j<i, row by row, so that entry (i,j) is at
+i*(i-1)/2 + j. Couplings and decay rates are from a heavier parent i to a
+lighter daughter j, so all other entries are zero by construction. Unlike a
+gsl_matrix, it is a value type: it copies, moves and frees itself.
+*/
+class DecayTriangularMatrix {
+private:
+	unsigned int n = 0;
+	std::vector<double> entries;
+
+public:
+	DecayTriangularMatrix() = default;
+
+	//! Zero matrix of size n_.
+	explicit DecayTriangularMatrix(unsigned int n_): n(n_), entries(n_*(n_ > 0 ? n_-1 : 0)/2, 0) {}
+
+	//! Imports the strictly lower triangle of m, which must be n_ x n_. The rest of m is ignored.
+	DecayTriangularMatrix(const gsl_matrix* m, unsigned int n_): DecayTriangularMatrix(n_) {
+		if (m == nullptr || m->size1 != n_ || m->size2 != n_){
+			throw std::runtime_error("DecayTriangularMatrix: the matrix must be numneu x numneu.");
+		}
+		for (unsigned int i = 0; i < n; i++){
+			for (unsigned int j = 0; j < i; j++){
+				(*this)(i,j) = gsl_matrix_get(m,i,j);
+			}
+		}
+	}
+
+	//! Returns entry (i,j), j<i.
+	double operator()(unsigned int i, unsigned int j) const { return entries[i*(i-1)/2 + j]; }
+	double& operator()(unsigned int i, unsigned int j) { return entries[i*(i-1)/2 + j]; }
+
+	//! Returns the number of rows and columns.
+	unsigned int Size() const { return n; }
+
+	//! Returns a new n x n gsl_matrix with the entries. The caller owns it.
+	gsl_matrix* To_GSL() const {
+		gsl_matrix* m = gsl_matrix_alloc(n,n);
+		gsl_matrix_set_zero(m);
+		for (unsigned int i = 0; i < n; i++){
+			for (unsigned int j = 0; j < i; j++){
+				gsl_matrix_set(m,i,j,(*this)(i,j));
+			}
+		}
+		return m;
+	}
+};
+
+//! A decay channel i->j which contributes to regeneration. See DecayModel::GetActiveChannels().
+struct DecayChannel {
+	//! Index of the parent mass state.
+	unsigned int parent;
+	//! Index of the daughter mass state.
+	unsigned int daughter;
+	//! True if the chirality preserving rate is nonzero.
+	bool cpp;
+	//! True if the chirality violating rate is nonzero.
+	bool cvp;
+	//! First daughter energy index with a non-empty regeneration integral.
+	unsigned int ie_begin;
+	//! One past the last daughter energy index with a non-empty regeneration integral.
+	unsigned int ie_end;
+};
+
+//! Read-only description of a neutrino decay scenario on an energy grid.
+/*!
+Everything that nuSQUIDSDecay needs about the decay, and that depends neither
+on the state nor on the position along the track, lives here: the neutrino
+masses, the couplings, the rest frame decay rates, the "Gamma" matrix DT in
+the mass basis, and the weights of the regeneration integral on the energy grid.
+A model is fully computed when it is constructed and never changes afterwards,
+so a single model, held through a std::shared_ptr<const DecayModel>, can be shared
+by any number of nuSQUIDSDecay objects on the same energy grid, evolving on any
+number of threads: all the zenith bins of a nuSQUIDSAtm<nuSQUIDSDecay>, or
+several flux components with the same parameters. Models with other parameters
+are derived with With_Masses(), With_Couplings() and With_RateMatrices().
+*/
+class DecayModel {
+public:
+	//Chirality Preserving Process or Chirality Violating Process
+	enum{CPP,CVP};
+
+	//! Quadrature rules of the regeneration integral, see Compute_Regeneration_Kernel().
+	enum class Quadrature {
+		//! Left-rectangular sum over the bins up to the node nearest to the endpoint. First order.
+		Left,
+		//! Trapezoid rule in the parent energy, up to the exact endpoint. Second order.
+		Trapezoid,
+		//! Simpson rule in the parent energy on pairs of bins, trapezoid on the rest. Third order.
+		Simpson,
+		//! Trapezoid rule in the logarithm of the parent energy, for logarithmic grids.
+		LogTrapezoid
+	};
+
+	//! Storage precision of the regeneration kernel, see GetRegenerationKernelSingle().
+	enum class Precision {
+		//! The kernel is only kept in double precision.
+		Double,
+		//! A single precision copy is kept as well, for the screening mode of nuSQUIDSDecay.
+		Single
+	};
+
+private:
+	//! Number of neutrino states.
+	unsigned int numneu;
+	//! Energy nodes, in the units given to nuSQuIDS.
+	marray<double,1> E_range;
+	//! Number of energy nodes.
+	unsigned int ne;
+
+	//! Toggles scalar or pseudoscalar couplings.
+	/*!
+	For the time being, we are considering either purely scalar or
+	purely pseudoscalar couplings. This switch takes the value false in the
+	scalar case, and true in the pseudoscalar case.
+	*/
+	bool pscalar;
+
+	//! Toggles Majorana or Dirac neutrinos
+	/*!
+	If neutrinos are Dirac, the chirality violating process
+	induces decay into right-handed neutrinos, which do not
+	contribute to regeneration.
+	If neutrinos are Majorana, the chirality violating process
+	induces decay into left-handed antineutrinos, which do contribute
+	to regeneration.
+	*/
+	bool majorana;
+
+	//! True if #rate_matrices are computed from #couplings, false if they were given directly.
+	bool rates_from_couplings;
+
+	//! Quadrature rule of the regeneration integral.
+	Quadrature quadrature;
+
+	//! Storage precision of the regeneration kernel.
+	Precision precision;
+
+	//! Vector of neutrino masses.
+	/*!
+	The lightest mass may be zero, but all other neutrino masses
+	must be non-zero.
+	*/
+	std::vector<double> m_nu;
+
+	//Parent<->Row, Daughter<->Column (lower triangular)
+	//One for each of {CPP,CVP}
+
+	//! The coupling matrices, g_ij.
+	/*!
+	The row index corresponds to the parent mass state, and the column to
+	the daughter. The matrix will then be strictly lower triangular.
+	Zero if the model was built from rate matrices.
+	*/
+	DecayTriangularMatrix couplings;
+
+	//! The decay rate matrices, Gamma_ij.
+	/*!
+	There are two rate matrices, one for each element of
+	{CPP,CVP}. The row index of each
+	corresponds to the parent mass state, and the column to
+	the daughter. The matrix is then strictly lower-triangular.
+	These decay rates are computed in the *rest frame* of the
+	parent. Eqns. (2) and (3) in [1] are lab-frame, and differ
+	by a factor of 1/gamma.
+	*/
+	DecayTriangularMatrix rate_matrices[2];
+
+	//! The "Gamma" matrix appearing in the full Hamiltonian, in the mass basis.
+	/*!
+	Encodes the loss of probability current from a given energy bin,
+	due to decay.
+	*/
+	squids::SU_vector DT;
+
+	//! Upper parent energy index of the regeneration integral, per channel and daughter energy.
+	/*!
+	Entry (i*numneu + j)*ne + iedaughter holds nearest_element(E_range[iedaughter]*x_ij^2),
+	the node closest to the kinematic endpoint of the i->j regeneration integral.
+	Only entries with j<i are meaningful.
+	*/
+	std::vector<unsigned int> parent_energy_bounds;
+
+	//! Precomputed weights of the regeneration integral, one array for each of {CPP,CVP}.
+	/*!
+	See Compute_Regeneration_Kernel() for the layout.
+	*/
+	std::vector<double> regeneration_kernel[2];
+
+	//! Single precision copy of #regeneration_kernel, empty unless #precision is Single.
+	std::vector<float> regeneration_kernel_single[2];
+
+	//! Start of the weights of each (i, j, iedaughter) entry in #regeneration_kernel.
+	std::vector<size_t> regeneration_kernel_offset;
+
+	//! The channels which contribute to regeneration. See Compute_Active_Channels().
+	std::vector<DecayChannel> active_channels;
+
+	//! Kinematic funtion m_j*f(x_i/x_j), related to equation (4a) in [1].
+	/*!
+	In this and the other auxiliary kinematic function definitions, the modification
+	is to make the m_j->0 limit numerically well defined. Luckily, the cmath pow()
+	function implicitly takes the limit: pow(0,0)=1, so we're happy.
+	\param m_i is the parent neutrino mass.
+	\param m_j is the daughter neutrino mass.
+	*/
+	static double f(double m_i, double m_j) {
+		double result = m_i/2.0 + 2.0*m_j + (2.0*m_j/m_i)*(m_j*log(m_i) - log(pow(m_j,m_j))) - (2.0*m_j*m_j*m_j/(m_i*m_i)) - (m_j*m_j*m_j*m_j/(2.0*m_i*m_i*m_i));
+		return result;
+	}
+	//! Kinematic funtion m_j*g(x_i/x_j), related to equation (4b) in [1].
+	/*!
+	\param m_i is the parent neutrino mass.
+	\param m_j is the daughter neutrino mass.
+	*/
+	static double g(double m_i, double m_j) {
+		double result = m_i/2.0 - 2.0*m_j + (2.0*m_j/m_i)*(m_j*log(m_i) - log(pow(m_j,m_j))) + (2.0*m_j*m_j*m_j/(m_i*m_i)) - (m_j*m_j*m_j*m_j/(2.0*m_i*m_i*m_i));
+		return result;
+	}
+	//! Kinematic funtion m_j*k(x_i/x_j), related to equation (4c) in [1].
+	/*!
+	\param m_i is the parent neutrino mass.
+	\param m_j is the daughter neutrino mass.
+	*/
+	static double k(double m_i, double m_j) {
+		double result = m_i/2.0 - (2.0*m_j/m_i)*(m_j*log(m_i) - log(pow(m_j,m_j))) - (m_j*m_j*m_j*m_j/(2.0*m_i*m_i*m_i));
+		return result;
+	}
+
+	//! Checks that a vector of neutrino masses has one mass per state.
+	void Check_Masses(const std::vector<double>& m_nu_) const {
+		if (m_nu_.size() != numneu){
+			throw std::runtime_error("DecayModel: the number of masses does not match the number of neutrino states.");
+		}
+	}
+
+	//! Computes the four decay rate matrices using the coupling matrix couplings.
+	/*!
+	This function implements equations (2) and (3) of [1] to generate the two partial
+	rate matrices corresponding to each decay channel in {CPP,CVP}.
+	Decay rates are in the rest frame of the parent neutrino.
+	*/
+	void Compute_Rate_Matrices(){
+		//Compute *rest frame* decay rate matrices.
+		if (!pscalar){
+			//CPP,SCALAR
+			for (unsigned int i=0; i<numneu; i++){
+				for (unsigned int j=0; j<i; j++){
+					double g_ij = couplings(i,j);
+					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*f(m_nu[i],m_nu[j]);
+					rate_matrices[CPP](i,j) = rate;
+				}
+			}
+			//CVP,SCALAR
+			for (unsigned int i=0; i<numneu; i++){
+				for (unsigned int j=0; j<i; j++){
+					double g_ij = couplings(i,j);
+					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*k(m_nu[i],m_nu[j]);
+					rate_matrices[CVP](i,j) = rate;
+				}
+			}
+		}
+		if (pscalar){
+			//CPP,PSEUDOSCALAR
+			for (unsigned int i=0; i<numneu; i++){
+				for (unsigned int j=0; j<i; j++){
+					double g_ij = couplings(i,j);
+					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*g(m_nu[i],m_nu[j]);
+					rate_matrices[CPP](i,j) = rate;
+				}
+			}
+			//CVP,PSEUDOSCALAR
+			for (unsigned int i=0; i<numneu; i++){
+				for (unsigned int j=0; j<i; j++){
+					double g_ij = couplings(i,j);
+					double rate = (1.0/(16.0*M_PI))*g_ij*g_ij*k(m_nu[i],m_nu[j]);
+					rate_matrices[CVP](i,j) = rate;
+				}
+			}
+		}
+	}
+
+	//! Computes DT, the "Gamma" term in the Hamiltonian, using rate_matrices.
+	/*!
+	In the mass basis, DT is a diagonal matrix such that the (i,i) entry
+	is the sum over all rate matrices of their ith rows, weighted by m_i,
+	the corresponding neutrino mass. Essentially, this matrix encodes the
+	total rate of decay of mass state i to all lighter states, including
+	all decay channels ({CPP,CVP}) if the neutrino
+	is Majorana, and only the channel (CVP) if it
+	is Dirac. The rate is weighted by the mass m_i for convenience, so that,
+	in nuSQUIDSDecay::GammaRho(), one can simply divide DT by the energy of the parent
+	neutrino, and each rate will acquire the proper factor of 1/gamma
+	characterizing lab-frame decay retarded by time-dialation.
+	*/
+	void Compute_DT(){
+		DT = squids::SU_vector(numneu);
+		//Include chirality preserving processes only in majorana case.
+		int chi_min;
+		if(majorana){chi_min=0;}
+		else{chi_min=1;}
+		//Sum over parent mass states.
+		for(size_t i = 0; i < numneu; i++){
+			double rate=0;
+			//Sum over daughter mass states.
+			for(size_t j=0; j<i; j++){
+				//Sum over all decay channels.
+				for (size_t chi=chi_min; chi<2; chi++){
+					rate+=rate_matrices[chi](i,j);
+				}
+			}
+			//Weight rate by m_i, and add a projector to the m_i state,
+			//multiplied by the weighted rate, to DT.
+			DT += m_nu[i]*rate*squids::SU_vector::Projector(numneu, i);
+		}
+	}
+
+	//! Given a double, finds the nearest double in the E_range array.
+	/*!
+	Given a double argument, searches E_range for the element of smallest
+	absolute value difference from the argument.
+	\param value is the argument whose closest match in E_range we're looking for.
+	\return the index of the closest element in E_range to value.
+	*/
+	unsigned int nearest_element(double value) const {
+		//If value is larger than last element, return
+		//last element.
+		if (value>E_range[E_range.size()-1]){
+			return E_range.size()-1;
+		}
+		//Otherwise, search in range.
+		std::vector<double> diffs(E_range.size());
+		for (size_t i = 0; i < E_range.size(); i++) {
+			diffs[i] = fabs(value - E_range[i]);
+		}
+		return std::distance(diffs.begin(),std::min_element(diffs.begin(), diffs.end()));
+	}
+
+	//! Fills #parent_energy_bounds from the masses and energy grid.
+	void Compute_Parent_Energy_Bounds(){
+		parent_energy_bounds.assign(numneu*numneu*ne,0);
+		for (unsigned int i=0; i<numneu; i++){
+			for (unsigned int j=0; j<i; j++){
+				double xij = m_nu[i]/m_nu[j];
+				for (unsigned int ie=0; ie<ne; ie++){
+					parent_energy_bounds[(i*numneu + j)*ne + ie] = nearest_element(E_range[ie]*(xij*xij));
+				}
+			}
+		}
+	}
+
+	//! Integrand of the i->j regeneration integral at a parent energy, times width.
+	/*!
+	Computes the weights of the CPP and CVP terms of (18) and (19) in [1] for
+	a parent energy eparent and a daughter energy edaughter, multiplied by the
+	quadrature coefficient width.
+	*/
+	void Regeneration_Integrand(unsigned int i, unsigned int j, double eparent, double edaughter,
+								double width, double& w_cpp, double& w_cvp) const {
+		double rate_cpp = rate_matrices[CPP](i,j);
+		double rate_cvp = rate_matrices[CVP](i,j);
+		//parent-to-daughter mass ratio
+		double xij = m_nu[i]/m_nu[j];
+		//If m_nu[j] is too close to zero, xij diverges, and we switch to an alternative
+		//form for the differential decay rates, in terms of yij=1/xij.
+		//This is just an algebraic manipulation to keep everything stable.
+		double yij = m_nu[j]/m_nu[i];
+		bool massless_daughter = !(fabs(m_nu[j]-0.0)>1e-6);
+		//boost factor to lab frame
+		double gamma = eparent/m_nu[i];
+		if (!massless_daughter){
+			double prefactor = width*(xij*xij/(xij*xij-1))/(eparent*eparent*edaughter);
+			if (!pscalar){
+				w_cpp = prefactor*(rate_cpp/gamma)*pow(eparent+xij*edaughter,2)/pow(xij+1,2);
+				w_cvp = prefactor*(eparent-edaughter)*(rate_cvp/gamma)*(edaughter*pow(xij,2)-eparent)/pow(xij+1,2);
+			}
+			else{
+				w_cpp = prefactor*(rate_cpp/gamma)*pow(eparent-xij*edaughter,2)/pow(xij-1,2);
+				w_cvp = prefactor*(eparent-edaughter)*(rate_cvp/gamma)*(edaughter*pow(xij,2)-eparent)/pow(xij-1,2);
+			}
+		}
+		else{
+			double prefactor = width*(1/(1-yij*yij))/(eparent*eparent*edaughter);
+			if (!pscalar){
+				w_cpp = prefactor*(rate_cpp/gamma)*pow(eparent*yij+edaughter,2)/pow(yij+1,2);
+				w_cvp = prefactor*(eparent-edaughter)*(rate_cvp/gamma)*(edaughter-pow(yij,2)*eparent)/pow(yij+1,2);
+			}
+			else{
+				w_cpp = prefactor*(rate_cpp/gamma)*pow(eparent*yij-edaughter,2)/pow(1-yij,2);
+				w_cvp = prefactor*(eparent-edaughter)*(rate_cvp/gamma)*(edaughter-pow(yij,2)*eparent)/pow(1-yij,2);
+			}
+		}
+	}
+
+	//! A point at which the regeneration integrand is evaluated.
+	/*!
+	The integrand is weighted by coefficient. The parent density at energy is
+	interpolated as (1-t)*P[node] + t*P[node+1], with t=0 on grid nodes.
+	*/
+	struct Quadrature_Point {
+		double energy;
+		double coefficient;
+		unsigned int node;
+		double t;
+	};
+
+	//! Returns the evaluation points of the i->j regeneration integral at daughter node iedaughter.
+	/*!
+	The integral runs over parent energies [edaughter,edaughter*x_ij^2], cut at
+	the last energy node. Except for Quadrature::Left, which keeps the
+	original sum up to the node nearest to the endpoint, the partial bin
+	between the last node below the endpoint and the endpoint is integrated
+	with the trapezoid rule, interpolating the parent density at the endpoint.
+	*/
+	std::vector<Quadrature_Point> Quadrature_Points(unsigned int i, unsigned int j, unsigned int iedaughter) const {
+		std::vector<Quadrature_Point> points;
+		double edaughter = E_range[iedaughter];
+		if (quadrature == Quadrature::Left){
+			unsigned int bound = parent_energy_bounds[(i*numneu + j)*ne + iedaughter];
+			for (unsigned int k = iedaughter; k+1 < bound; k++){
+				points.push_back({E_range[k],E_range[k+1]-E_range[k],k,0});
+			}
+			return points;
+		}
+		bool massless_daughter = !(fabs(m_nu[j]-0.0)>1e-6);
+		double xij = m_nu[i]/m_nu[j];
+		double emax = massless_daughter ? E_range[ne-1] : std::min(edaughter*xij*xij,E_range[ne-1]);
+		//last node not above the endpoint
+		unsigned int kmax = iedaughter;
+		while (kmax+1 < ne && E_range[kmax+1] <= emax){
+			kmax++;
+		}
+		bool log = (quadrature == Quadrature::LogTrapezoid);
+		//Trapezoid on the bin [E_k,E_{k+1}], or on its part [E_k,eupper].
+		auto trapezoid = [&](unsigned int k, double eupper){
+			bool full = (eupper == E_range[k+1]);
+			double h, t, c_lower, c_upper;
+			if (log){
+				h = std::log(eupper/E_range[k]);
+				t = h/std::log(E_range[k+1]/E_range[k]);
+				c_lower = 0.5*h*E_range[k];
+				c_upper = 0.5*h*eupper;
+			}
+			else{
+				h = eupper-E_range[k];
+				t = h/(E_range[k+1]-E_range[k]);
+				c_lower = c_upper = 0.5*h;
+			}
+			points.push_back({E_range[k],c_lower,k,0});
+			if (full){
+				points.push_back({eupper,c_upper,k+1,0});
+			}
+			else{
+				points.push_back({eupper,c_upper,k,t});
+			}
+		};
+		unsigned int k = iedaughter;
+		if (quadrature == Quadrature::Simpson){
+			//Simpson rule on non-uniform pairs of bins.
+			for (; k+2 <= kmax; k += 2){
+				double h0 = E_range[k+1]-E_range[k];
+				double h1 = E_range[k+2]-E_range[k+1];
+				double c = (h0+h1)/6.0;
+				points.push_back({E_range[k],c*(2.0-h1/h0),k,0});
+				points.push_back({E_range[k+1],c*(h0+h1)*(h0+h1)/(h0*h1),k+1,0});
+				points.push_back({E_range[k+2],c*(2.0-h0/h1),k+2,0});
+			}
+		}
+		for (; k < kmax; k++){
+			trapezoid(k,E_range[k+1]);
+		}
+		//partial bin up to the endpoint
+		if (kmax+1 < ne && emax > E_range[kmax]){
+			trapezoid(kmax,emax);
+		}
+		return points;
+	}
+
+	//! Returns the number of parent nodes, starting at iedaughter, used by a set of quadrature points.
+	static size_t Band_Size(const std::vector<Quadrature_Point>& points, unsigned int iedaughter){
+		size_t size = 0;
+		for (const Quadrature_Point& point : points){
+			size_t last = point.node + ((point.t != 0) ? 1 : 0);
+			size = std::max(size,last + 1 - iedaughter);
+		}
+		return size;
+	}
+
+	//! Computes the scalar weights of the decay regeneration integral.
+	/*!
+	Decay kinematics dictate an integral of the regeneration contribution over
+	parent momenta in the range [edaughter,edaughter*x_ij^2]. See (18) and (19)
+	in [1]. Here, the integral is approximated by the quadrature rule of
+	#quadrature, see Quadrature and Quadrature_Points(). The original
+	approximation, Quadrature::Left, is a left-rectangular sum over energy
+	bins in this range. Every factor of a term in that sum, except the
+	projection of the parent density onto m_i and the daughter projector, only
+	depends on the masses, the rate matrices, #pscalar and the energy grid, so
+	they are tabulated here once and nuSQUIDSDecay::InteractionsRho() reduces to multiply-adds.
+	For channel (i,j) and daughter energy iedaughter, the weights of parent
+	energies iedaughter, iedaughter+1, ... are stored contiguously in
+	#regeneration_kernel starting at #regeneration_kernel_offset. Also rebuilds
+	#parent_energy_bounds, and #regeneration_kernel_single if #precision is Single.
+	*/
+	void Compute_Regeneration_Kernel(){
+		Compute_Parent_Energy_Bounds();
+		if (quadrature == Quadrature::LogTrapezoid && ne > 0 && E_range[0] <= 0){
+			throw std::runtime_error("DecayModel: the logarithmic quadrature needs positive energies.");
+		}
+		regeneration_kernel_offset.assign(numneu*numneu*ne+1,0);
+		size_t size=0;
+		for (unsigned int i=0; i<numneu; i++){
+			for (unsigned int j=0; j<numneu; j++){
+				for (unsigned int ie=0; ie<ne; ie++){
+					size_t channel = (i*numneu + j)*ne + ie;
+					regeneration_kernel_offset[channel] = size;
+					if (j<i){
+						size += Band_Size(Quadrature_Points(i,j,ie),ie);
+					}
+				}
+			}
+		}
+		regeneration_kernel_offset[numneu*numneu*ne] = size;
+		for (unsigned int chi=0; chi<2; chi++){
+			regeneration_kernel[chi].assign(size,0);
+		}
+
+		for (unsigned int i=0; i<numneu; i++){
+			for (unsigned int j=0; j<i; j++){
+				for (unsigned int iedaughter=0; iedaughter<ne; iedaughter++){
+					// Get the daughter neutrino energy.
+					double edaughter = E_range[iedaughter];
+					size_t offset = regeneration_kernel_offset[(i*numneu + j)*ne + iedaughter];
+					for (const Quadrature_Point& point : Quadrature_Points(i,j,iedaughter)){
+						double w_cpp, w_cvp;
+						Regeneration_Integrand(i,j,point.energy,edaughter,point.coefficient,w_cpp,w_cvp);
+						size_t n = point.node - iedaughter;
+						regeneration_kernel[CPP][offset+n] += (1-point.t)*w_cpp;
+						regeneration_kernel[CVP][offset+n] += (1-point.t)*w_cvp;
+						if (point.t != 0){
+							regeneration_kernel[CPP][offset+n+1] += point.t*w_cpp;
+							regeneration_kernel[CVP][offset+n+1] += point.t*w_cvp;
+						}
+					}
+				}
+			}
+		}
+		Round_Regeneration_Kernel();
+	}
+
+	//! Fills #regeneration_kernel_single from #regeneration_kernel if #precision is Single, and clears it otherwise.
+	void Round_Regeneration_Kernel(){
+		for (unsigned int chi=0; chi<2; chi++){
+			if (precision == Precision::Single){
+				regeneration_kernel_single[chi].assign(regeneration_kernel[chi].begin(),regeneration_kernel[chi].end());
+			}
+			else{
+				std::vector<float>().swap(regeneration_kernel_single[chi]);
+			}
+		}
+	}
+
+	//! Fills #active_channels from the rate matrices and the regeneration kernel.
+	/*!
+	A channel i->j is active if either of its rates is nonzero and its
+	regeneration integral is not empty for at least one daughter energy. Its
+	band is the range of daughter energies with a non-empty integral, so the
+	regeneration loops skip both the channels which are switched off and the
+	daughter energies whose kinematic endpoint falls within one node of them.
+	*/
+	void Compute_Active_Channels(){
+		active_channels.clear();
+		for (unsigned int i=0; i<numneu; i++){
+			for (unsigned int j=0; j<i; j++){
+				DecayChannel channel;
+				channel.parent = i;
+				channel.daughter = j;
+				channel.cpp = rate_matrices[CPP](i,j) != 0;
+				channel.cvp = rate_matrices[CVP](i,j) != 0;
+				channel.ie_begin = ne;
+				channel.ie_end = 0;
+				for (unsigned int ie=0; ie<ne; ie++){
+					size_t entry = (i*numneu + j)*ne + ie;
+					if (regeneration_kernel_offset[entry+1] > regeneration_kernel_offset[entry]){
+						channel.ie_begin = std::min(channel.ie_begin,ie);
+						channel.ie_end = ie+1;
+					}
+				}
+				if ((channel.cpp || channel.cvp) && channel.ie_begin < channel.ie_end){
+					active_channels.push_back(channel);
+				}
+			}
+		}
+	}
+
+	//! Recomputes everything derived from the masses and the couplings or rates.
+	void Compute(){
+		if (rates_from_couplings){
+			Compute_Rate_Matrices();
+		}
+		Compute_DT();
+		Compute_Regeneration_Kernel();
+		Compute_Active_Channels();
+	}
+
+public:
+	//! "Majorana coupling" model.
+	/*!
+	Computes the rate matrices from the Lagrangian couplings, see Compute_Rate_Matrices().
+	The neutrinos are Majorana. Note: only m_1 may be set to zero!
+	\param e_nodes is the array of neutrino propagation energies, as given to nuSQUIDSDecay.
+	\param numneu_ is the number of neutrino states in the system.
+	\param pscalar_ is a switch for scalar/pseudoscalar couplings. See #pscalar.
+	\param m_nu_ is a vector of neutrino masses. See #m_nu .
+	\param couplings_ is a gsl_matrix* pointer, numneu x numneu. See #couplings .
+	\param quadrature_ is the quadrature rule of the regeneration integral. See Quadrature.
+	\param precision_ is the storage precision of the regeneration kernel. See Precision.
+	*/
+	DecayModel(marray<double,1> e_nodes, unsigned int numneu_, bool pscalar_,
+				std::vector<double> m_nu_, const gsl_matrix* couplings_,
+				Quadrature quadrature_ = Quadrature::Left, Precision precision_ = Precision::Double):
+	numneu(numneu_), E_range(e_nodes), ne(e_nodes.size()), pscalar(pscalar_),
+	majorana(true), rates_from_couplings(true), quadrature(quadrature_),
+	precision(precision_), couplings(couplings_,numneu_), rate_matrices{DecayTriangularMatrix(numneu_),DecayTriangularMatrix(numneu_)}{
+		Check_Masses(m_nu_);
+		m_nu = m_nu_;
+		Compute();
+	}
+
+	//! "Partial rate" model.
+	/*!
+	Uses the given rest frame rate matrices directly. See the "partial rate"
+	constructor of nuSQUIDSDecay for the caveats. Note: only m_1 may be set to zero!
+	\param e_nodes is the array of neutrino propagation energies, as given to nuSQUIDSDecay.
+	\param numneu_ is the number of neutrino states in the system.
+	\param pscalar_ is a switch for scalar/pseudoscalar couplings. See #pscalar.
+	\param majorana_ is a switch for Majorana/Dirac neutrinos. See #majorana .
+	\param m_nu_ is a vector of neutrino masses. See #m_nu .
+	\param rate_matrices_ is a two-element array of gsl_matrix* pointers, numneu x numneu. See #rate_matrices .
+	\param quadrature_ is the quadrature rule of the regeneration integral. See Quadrature.
+	\param precision_ is the storage precision of the regeneration kernel. See Precision.
+	*/
+	DecayModel(marray<double,1> e_nodes, unsigned int numneu_, bool pscalar_, bool majorana_,
+				std::vector<double> m_nu_, gsl_matrix* const rate_matrices_[2],
+				Quadrature quadrature_ = Quadrature::Left, Precision precision_ = Precision::Double):
+	numneu(numneu_), E_range(e_nodes), ne(e_nodes.size()), pscalar(pscalar_),
+	majorana(majorana_), rates_from_couplings(false), quadrature(quadrature_),
+	precision(precision_), couplings(numneu_), rate_matrices{DecayTriangularMatrix(rate_matrices_[CPP],numneu_),DecayTriangularMatrix(rate_matrices_[CVP],numneu_)}{
+		Check_Masses(m_nu_);
+		m_nu = m_nu_;
+		Compute();
+	}
+
+	//! Deep copy, used to derive models with other parameters.
+	DecayModel(const DecayModel& other)=default;
+
+	DecayModel& operator=(const DecayModel&)=delete;
+
+public:
+	//! Returns a model with other masses and the same couplings or rate matrices.
+	/*!
+	If the model was built from couplings, the rates are recomputed from them;
+	if it was built from rate matrices, they are kept as they are.
+	\param m_nu_ is a vector of neutrino masses. See #m_nu .
+	*/
+	std::shared_ptr<const DecayModel> With_Masses(const std::vector<double>& m_nu_) const {
+		Check_Masses(m_nu_);
+		std::shared_ptr<DecayModel> model = std::make_shared<DecayModel>(*this);
+		model->m_nu = m_nu_;
+		model->Compute();
+		return model;
+	}
+
+	//! Returns a model with other Lagrangian couplings and the same masses.
+	/*!
+	The rates of the new model are computed from the couplings, see Compute_Rate_Matrices().
+	\param couplings_ is a gsl_matrix* pointer, numneu x numneu. See #couplings .
+	*/
+	std::shared_ptr<const DecayModel> With_Couplings(const gsl_matrix* couplings_) const {
+		DecayTriangularMatrix imported(couplings_,numneu);
+		std::shared_ptr<DecayModel> model = std::make_shared<DecayModel>(*this);
+		model->couplings = std::move(imported);
+		model->rates_from_couplings = true;
+		model->Compute();
+		return model;
+	}
+
+	//! Returns a model with other partial decay rate matrices and the same masses.
+	/*!
+	\param rate_matrices_ is a two-element array of gsl_matrix* pointers, numneu x numneu. See #rate_matrices .
+	*/
+	std::shared_ptr<const DecayModel> With_RateMatrices(gsl_matrix* const rate_matrices_[2]) const {
+		DecayTriangularMatrix imported[2] = {DecayTriangularMatrix(rate_matrices_[CPP],numneu),
+											 DecayTriangularMatrix(rate_matrices_[CVP],numneu)};
+		std::shared_ptr<DecayModel> model = std::make_shared<DecayModel>(*this);
+		for (unsigned int chi=0; chi<2; chi++){
+			model->rate_matrices[chi] = std::move(imported[chi]);
+		}
+		model->couplings = DecayTriangularMatrix(numneu);
+		model->rates_from_couplings = false;
+		model->Compute();
+		return model;
+	}
+
+	//! Returns a model with another quadrature rule for the regeneration integral.
+	/*!
+	Only the regeneration kernel depends on the rule, but the whole model is
+	recomputed for simplicity. See Quadrature.
+	\param quadrature_ is the quadrature rule.
+	*/
+	std::shared_ptr<const DecayModel> With_Quadrature(Quadrature quadrature_) const {
+		std::shared_ptr<DecayModel> model = std::make_shared<DecayModel>(*this);
+		model->quadrature = quadrature_;
+		model->Compute();
+		return model;
+	}
+
+	//! Returns the quadrature rule of the regeneration integral.
+	Quadrature GetQuadrature() const { return quadrature; }
+
+	//! Returns a model with another storage precision of the regeneration kernel.
+	/*!
+	The kernel itself is always computed in double precision; see Precision.
+	\param precision_ is the precision.
+	*/
+	std::shared_ptr<const DecayModel> With_Precision(Precision precision_) const {
+		std::shared_ptr<DecayModel> model = std::make_shared<DecayModel>(*this);
+		model->precision = precision_;
+		model->Round_Regeneration_Kernel();
+		return model;
+	}
+
+	//! Returns the storage precision of the regeneration kernel.
+	Precision GetPrecision() const { return precision; }
+
+	//! Returns the number of neutrino states.
+	unsigned int GetNumNeu() const { return numneu; }
+
+	//! Returns the energy nodes of the model.
+	const marray<double,1>& GetERange() const { return E_range; }
+
+	//! Returns true for pseudoscalar couplings, false for scalar ones.
+	bool IsPseudoscalar() const { return pscalar; }
+
+	//! Returns true for Majorana neutrinos, false for Dirac ones.
+	bool IsMajorana() const { return majorana; }
+
+	//! Returns the neutrino masses.
+	const std::vector<double>& GetMasses() const { return m_nu; }
+
+	//! Returns the coupling matrix (zero for models built from rate matrices).
+	/*!
+	See DecayTriangularMatrix::To_GSL() for a gsl_matrix copy.
+	*/
+	const DecayTriangularMatrix& GetCouplings() const { return couplings; }
+
+	//! Returns the rest frame rate matrix of a channel, CPP or CVP.
+	const DecayTriangularMatrix& GetRateMatrix(unsigned int chi) const { return rate_matrices[chi]; }
+
+	//! Returns the "Gamma" matrix, in the mass basis. See Compute_DT().
+	const squids::SU_vector& GetDT() const { return DT; }
+
+	//! Returns the regeneration weights of a channel, CPP or CVP. See Compute_Regeneration_Kernel().
+	const std::vector<double>& GetRegenerationKernel(unsigned int chi) const { return regeneration_kernel[chi]; }
+
+	//! Returns the regeneration weights of a channel rounded to single precision, empty unless GetPrecision() is Single.
+	const std::vector<float>& GetRegenerationKernelSingle(unsigned int chi) const { return regeneration_kernel_single[chi]; }
+
+	//! Returns the start of the weights of each (i, j, iedaughter) entry of the regeneration kernel.
+	const std::vector<size_t>& GetRegenerationKernelOffset() const { return regeneration_kernel_offset; }
+
+	//! Returns the upper parent energy index of each (i, j, iedaughter) regeneration integral.
+	const std::vector<unsigned int>& GetParentEnergyBounds() const { return parent_energy_bounds; }
+
+	//! Returns the channels which contribute to regeneration, ordered by parent then daughter.
+	const std::vector<DecayChannel>& GetActiveChannels() const { return active_channels; }
+
+	//! Returns true if a grid of energies matches the energy nodes of the model.
+	bool Matches(const marray<double,1>& e_nodes) const {
+		if (e_nodes.size() != ne){
+			return false;
+		}
+		for (unsigned int ie=0; ie<ne; ie++){
+			if (fabs(e_nodes[ie]-E_range[ie]) > 1e-12*fabs(E_range[ie])){
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_model_H
@@ -0,0 +1,155 @@
+#ifndef nusquids_decay_mpi_H
+#define nusquids_decay_mpi_H
+
+/*
+Header implementing DecayMPIScan, which splits the points of a DecayScan
+between the ranks of an MPI communicator. It is only compiled if
+NUSQUIDS_DECAY_MPI is defined (make MPI=1), and needs an MPI-3 library.
+*/
+
+#ifdef NUSQUIDS_DECAY_MPI
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <mpi.h>
+#include "nusquids_decay_scan.h"
+
+namespace nusquids {
+
+//! Distributes the points of a scan over the ranks of a communicator.
+/*!
+Every rank holds a DecayScan over the same grid, and evaluates it with its
+own threads. The points are handed out in chunks, in the Morton order of the
+grid, from a counter on rank 0: a rank that needs work fetches and advances
+the counter with one MPI_Fetch_and_op(), so faster ranks take more chunks and
+no rank waits for another until the grid is exhausted. Neighbouring points
+stay in the same chunk, which keeps the warm start of DecayScan effective.
+
+Each rank only fills the slots of the points it evaluated in Get_Results()
+of its scan. To collect the fluxes in one file, give every rank a
+DecayScanStore on the same file, opened with the MPI constructor, as the
+result callback of its scan.
+
+MPI must be initialized with at least MPI_THREAD_SERIALIZED, since the
+writer thread of the scan calls the callbacks, and so parallel HDF5, while
+the main thread is in none of them.
+*/
+class DecayMPIScan {
+private:
+	DecayScan& scan;
+	MPI_Comm comm;
+	int rank = 0;
+	int size = 1;
+	size_t chunk_size;
+	//! Points evaluated by this rank in the last Run().
+	size_t evaluated = 0;
+
+	static void Check(int status, const std::string& what){
+		if (status != MPI_SUCCESS){
+			throw std::runtime_error("DecayMPIScan: " + what + " failed.");
+		}
+	}
+
+public:
+	//! Constructs a distributed scan. Collective.
+	/*!
+	\param scan_ is the scan of this rank. Every rank must use the same axes and settings.
+	\param comm_ is the communicator of the ranks sharing the scan.
+	\param chunk_size_ is the number of points taken at once. If 0, four per thread of the scan.
+	*/
+	DecayMPIScan(DecayScan& scan_, MPI_Comm comm_, size_t chunk_size_ = 0):
+	scan(scan_), comm(comm_),
+	chunk_size(chunk_size_ == 0 ? 4*size_t(scan_.Get_NumThreads()) : chunk_size_){
+		int provided = MPI_THREAD_SINGLE;
+		Check(MPI_Query_thread(&provided),"querying the thread support");
+		if (provided < MPI_THREAD_SERIALIZED){
+			throw std::runtime_error("DecayMPIScan: MPI must be initialized with MPI_THREAD_SERIALIZED.");
+		}
+		Check(MPI_Comm_rank(comm,&rank),"getting the rank");
+		Check(MPI_Comm_size(comm,&size),"getting the communicator size");
+	}
+
+	DecayMPIScan(const DecayMPIScan&)=delete;
+	DecayMPIScan& operator=(const DecayMPIScan&)=delete;
+
+	//! Evaluates the grid, sharing the points between the ranks. Collective.
+	/*!
+	Returns once every point of the grid was evaluated by some rank.
+	\param done marks the points which must not be evaluated again, see DecayScan::Run().
+	It must be the same on every rank.
+	*/
+	void Run(const std::vector<bool>& done = std::vector<bool>()){
+		const DecayScanAxes& axes = scan.Get_Axes();
+		size_t npoints = axes.Size();
+		if (!done.empty() && done.size() != npoints){
+			throw std::runtime_error("DecayMPIScan: the done mask does not match the grid.");
+		}
+		//The same order on every rank, so that the counter alone identifies a chunk.
+		std::vector<size_t> order;
+		for (size_t index = 0; index < npoints; index++){
+			if (done.empty() || !done[index]){
+				order.push_back(index);
+			}
+		}
+		std::sort(order.begin(),order.end(),[&](size_t a, size_t b){
+			return DecayScanAxes::Morton_Key(axes.Point(a)) < DecayScanAxes::Morton_Key(axes.Point(b));
+		});
+
+		uint64_t* counter = nullptr;
+		MPI_Win window;
+		MPI_Aint window_size = (rank == 0) ? sizeof(uint64_t) : 0;
+		Check(MPI_Win_allocate(window_size,sizeof(uint64_t),MPI_INFO_NULL,comm,&counter,&window),
+				"allocating the counter window");
+		if (rank == 0){
+			*counter = 0;
+		}
+		Check(MPI_Barrier(comm),"initializing the counter");
+		Check(MPI_Win_lock_all(0,window),"locking the counter window");
+
+		evaluated = 0;
+		int status = MPI_SUCCESS;
+		std::exception_ptr error;
+		try{
+			const uint64_t increment = chunk_size;
+			for (;;){
+				uint64_t first = 0;
+				status = MPI_Fetch_and_op(&increment,&first,MPI_UINT64_T,0,0,MPI_SUM,window);
+				if (status == MPI_SUCCESS){ status = MPI_Win_flush(0,window); }
+				if (status != MPI_SUCCESS || first >= order.size()){
+					break;
+				}
+				size_t last = std::min<size_t>(first + chunk_size,order.size());
+				scan.Run_Points(std::vector<size_t>(order.begin() + first,order.begin() + last));
+				evaluated += last - first;
+			}
+		}
+		catch(...){
+			error = std::current_exception();
+		}
+		//A failing rank still frees the window, which is collective, so that the others can finish.
+		MPI_Win_unlock_all(window);
+		MPI_Win_free(&window);
+		if (error){
+			std::rethrow_exception(error);
+		}
+		Check(status,"taking a chunk of points");
+	}
+
+	//! Returns the rank of this process in the communicator.
+	int Get_Rank() const { return rank; }
+
+	//! Returns the number of ranks sharing the scan.
+	int Get_Size() const { return size; }
+
+	//! Returns the number of points evaluated by this rank in the last Run().
+	size_t Get_Evaluated() const { return evaluated; }
+};
+
+} // close nusquids namespace
+
+#endif // NUSQUIDS_DECAY_MPI
+#endif // nusquids_decay_mpi_H
@@ -0,0 +1,122 @@
+#ifndef nusquids_decay_observer_H
+#define nusquids_decay_observer_H
+
+/*
+Header implementing DecayObservation, the flavor fluxes handed to the
+observer of nuSQUIDSDecay at given positions of the track, and
+DecayObservationRing, a preallocated buffer keeping the last of them.
+See nuSQUIDSDecay::Set_Observer().
+*/
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+namespace nusquids {
+
+//! Flavor fluxes at one of the positions of the track given to nuSQUIDSDecay::Set_Observer().
+/*!
+The fluxes are only valid during the call of the observer: they are held in a
+buffer of the nuSQUIDSDecay object, which is overwritten at the next position.
+*/
+struct DecayObservation {
+	//! Index of the position in the list given to Set_Observer().
+	size_t index;
+	//! Position along the track, in natural units.
+	double x;
+	//! Flavor fluxes of every energy node, indexed (ie*numneu + flavor)*nrhos + irho.
+	const std::vector<double>& flux;
+};
+
+//! Observer of nuSQUIDSDecay, called once per observed position.
+typedef std::function<void(const DecayObservation&)> DecayObserver;
+
+//! Keeps the last observations of an evolution, in storage allocated once.
+/*!
+Holds up to capacity observations of width fluxes each (ne*numneu*nrhos for
+the observed object). Once full, each new observation replaces the oldest, so
+that a long list of positions can be observed with a bounded memory, and read
+while the evolution goes on, e.g. from the observer itself.
+*/
+class DecayObservationRing {
+private:
+	size_t capacity;
+	size_t width;
+	//! Slot of the next observation.
+	size_t next = 0;
+	//! Number of observations held.
+	size_t count = 0;
+	std::vector<size_t> indices;
+	std::vector<double> positions;
+	//! Fluxes of slot s at s*width.
+	std::vector<double> fluxes;
+
+	//! Returns the slot of the i-th oldest observation.
+	size_t Slot(size_t i) const {
+		if (i >= count){
+			throw std::runtime_error("DecayObservationRing: no observation at this position of the buffer.");
+		}
+		return (next + capacity - count + i) % capacity;
+	}
+
+public:
+	//! Allocates the buffer.
+	/*!
+	\param capacity_ is the number of observations kept.
+	\param width_ is the number of fluxes of an observation, ne*numneu*nrhos.
+	*/
+	DecayObservationRing(size_t capacity_, size_t width_):
+	capacity(capacity_), width(width_), indices(capacity_), positions(capacity_), fluxes(capacity_*width_){
+		if (capacity == 0){
+			throw std::runtime_error("DecayObservationRing: the capacity must be positive.");
+		}
+	}
+
+	//! Copies an observation into the buffer, over the oldest one if it is full.
+	void Push(const DecayObservation& observation){
+		if (observation.flux.size() != width){
+			throw std::runtime_error("DecayObservationRing: the observation does not match the width of the buffer.");
+		}
+		indices[next] = observation.index;
+		positions[next] = observation.x;
+		std::copy(observation.flux.begin(), observation.flux.end(), fluxes.begin() + next*width);
+		next = (next + 1) % capacity;
+		count = std::min(count + 1, capacity);
+	}
+
+	//! Returns an observer which pushes every observation into this buffer.
+	/*!
+	The buffer must outlive the evolutions using the observer.
+	*/
+	DecayObserver Observer(){
+		return [this](const DecayObservation& observation){ Push(observation); };
+	}
+
+	//! Drops all observations, keeping the storage.
+	void Clear(){
+		next = 0;
+		count = 0;
+	}
+
+	//! Returns the number of observations held.
+	size_t Size() const { return count; }
+
+	//! Returns the number of observations the buffer can hold.
+	size_t Capacity() const { return capacity; }
+
+	//! Returns the number of fluxes of an observation.
+	size_t Width() const { return width; }
+
+	//! Returns the index, in the list of Set_Observer(), of the i-th oldest observation held.
+	size_t Index(size_t i) const { return indices[Slot(i)]; }
+
+	//! Returns the position of the i-th oldest observation held.
+	double Position(size_t i) const { return positions[Slot(i)]; }
+
+	//! Returns the Width() fluxes of the i-th oldest observation held, laid out as DecayObservation::flux.
+	const double* Flux(size_t i) const { return fluxes.data() + Slot(i)*width; }
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_observer_H
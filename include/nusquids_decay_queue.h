@@ -0,0 +1,109 @@
+#ifndef nusquids_decay_queue_H
+#define nusquids_decay_queue_H
+
+/*
+Header implementing DecayBoundedQueue, the lock-free queue through which the
+workers of a DecayScan hand finished points to its writer thread.
+*/
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+
+namespace nusquids {
+
+//! Bounded, lock-free, multi-producer multi-consumer queue.
+/*!
+The array-based queue of D. Vyukov: each slot carries a sequence number
+which tells producers and consumers whether it is free or full, so that a
+push or a pop is one compare-and-swap on the shared position plus one store.
+Neither TryPush() nor TryPop() ever blocks; they fail if the queue is full
+or empty respectively.
+T must be default constructible and movable.
+*/
+template<typename T>
+class DecayBoundedQueue {
+private:
+	struct Slot {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+	//Keeps the producer and consumer positions on different cache lines.
+	static const size_t cache_line = 64;
+
+	std::vector<Slot> slots;
+	size_t mask;
+	char pad0[cache_line];
+	std::atomic<size_t> enqueue_position;
+	char pad1[cache_line];
+	std::atomic<size_t> dequeue_position;
+	char pad2[cache_line];
+
+public:
+	//! Constructs an empty queue.
+	/*!
+	\param capacity is the maximum number of elements. It must be a power of two, and at least 2.
+	*/
+	explicit DecayBoundedQueue(size_t capacity):
+	slots(capacity), mask(capacity-1), enqueue_position(0), dequeue_position(0){
+		if (capacity < 2 || (capacity & (capacity-1)) != 0){
+			throw std::runtime_error("DecayBoundedQueue: the capacity must be a power of two.");
+		}
+		for (size_t i = 0; i < capacity; i++){
+			slots[i].sequence.store(i,std::memory_order_relaxed);
+		}
+	}
+
+	DecayBoundedQueue(const DecayBoundedQueue&)=delete;
+	DecayBoundedQueue& operator=(const DecayBoundedQueue&)=delete;
+
+	//! Appends a value, or returns false if the queue is full.
+	bool TryPush(T value){
+		size_t position = enqueue_position.load(std::memory_order_relaxed);
+		for (;;){
+			Slot& slot = slots[position & mask];
+			size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)position;
+			if (diff == 0){
+				if (enqueue_position.compare_exchange_weak(position,position+1,std::memory_order_relaxed)){
+					slot.value = std::move(value);
+					slot.sequence.store(position+1,std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0){
+				return false;
+			}
+			else{
+				position = enqueue_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	//! Removes the oldest value into value, or returns false if the queue is empty.
+	bool TryPop(T& value){
+		size_t position = dequeue_position.load(std::memory_order_relaxed);
+		for (;;){
+			Slot& slot = slots[position & mask];
+			size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(position+1);
+			if (diff == 0){
+				if (dequeue_position.compare_exchange_weak(position,position+1,std::memory_order_relaxed)){
+					value = std::move(slot.value);
+					slot.sequence.store(position+mask+1,std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0){
+				return false;
+			}
+			else{
+				position = dequeue_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_queue_H
@@ -0,0 +1,847 @@
+#ifndef nusquids_decay_scan_H
+#define nusquids_decay_scan_H
+
+/*
+Header implementing the DecayScan class, which evaluates nuSQUIDSDecay over
+a grid of (nu4mass, theta24, coupling) points in a single process.
+See nusquids_decay.h for the decay model.
+*/
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <limits>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <nuSQuIDS/nuSQuIDS.h>
+#include "nusquids_decay.h"
+#include "nusquids_decay_threads.h"
+#include "nusquids_decay_queue.h"
+
+namespace nusquids {
+
+//! One point of a decay scan grid.
+struct DecayScanPoint {
+	//! Flat index of the point, row-major in (mass, theta24, coupling).
+	size_t index;
+	//! Indices of the point along each axis.
+	size_t imass, itheta, icoupling;
+	//! Mass of the heaviest state [eV].
+	double nu4mass;
+	//! Value of the theta24 axis, passed as is to DecayScanSettings::configure.
+	double theta24;
+	//! Coupling of the decaying channel, see DecayScanSettings::parent.
+	double coupling;
+};
+
+//! Parameter axes of a decay scan. The grid is their outer product.
+struct DecayScanAxes {
+	std::vector<double> nu4mass;
+	std::vector<double> theta24;
+	std::vector<double> coupling;
+
+	//! Returns the number of grid points.
+	size_t Size() const { return nu4mass.size()*theta24.size()*coupling.size(); }
+
+	//! Returns the grid point of a flat index.
+	DecayScanPoint Point(size_t index) const {
+		DecayScanPoint point;
+		point.index = index;
+		point.icoupling = index % coupling.size();
+		point.itheta = (index / coupling.size()) % theta24.size();
+		point.imass = index / (coupling.size()*theta24.size());
+		point.nu4mass = nu4mass[point.imass];
+		point.theta24 = theta24[point.itheta];
+		point.coupling = coupling[point.icoupling];
+		return point;
+	}
+
+	//! Returns the flat index of the point at indices (imass, itheta, icoupling).
+	size_t Index(size_t imass, size_t itheta, size_t icoupling) const {
+		return (imass*theta24.size() + itheta)*coupling.size() + icoupling;
+	}
+
+	//! Returns the position of a point along the Morton (Z-order) curve of the grid.
+	/*!
+	Interleaves the bits of the three indices. Points close along the curve
+	are close in the grid, so evaluating points in this order keeps the
+	recently finished points next to the ones being evaluated.
+	*/
+	static uint64_t Morton_Key(const DecayScanPoint& point){
+		uint64_t key = 0;
+		for (unsigned int bit = 0; bit < 21; bit++){
+			key |= ((uint64_t)((point.icoupling >> bit) & 1)) << (3*bit);
+			key |= ((uint64_t)((point.itheta >> bit) & 1)) << (3*bit + 1);
+			key |= ((uint64_t)((point.imass >> bit) & 1)) << (3*bit + 2);
+		}
+		return key;
+	}
+};
+
+//! Inputs shared by every point of a decay scan.
+/*!
+All of these are set up once and only read while the scan runs.
+*/
+struct DecayScanSettings {
+	//! Energy nodes of the propagation.
+	marray<double,1> e_nodes;
+	//! Number of neutrino states. The scanned mass is the one of the heaviest state.
+	unsigned int numneu = 4;
+	//! Switch for incoherent interactions. See nuSQUIDSDecay::Set_DecayRegeneration().
+	bool iinteraction = true;
+	//! Switch for decay regeneration. See nuSQUIDSDecay::Set_DecayRegeneration().
+	bool decay_regen = true;
+	//! Switch for scalar/pseudoscalar couplings.
+	bool pscalar = false;
+	//! Quadrature rule of the regeneration integral. See DecayModel::Quadrature.
+	DecayModel::Quadrature quadrature = DecayModel::Quadrature::Left;
+	//! Precision of the regeneration kernel. Single evaluates the points in screening mode.
+	/*!
+	See nuSQUIDSDecay::Set_ScreeningMode(). Its relaxed tolerances replace the
+	ones set by configure.
+	*/
+	DecayModel::Precision precision = DecayModel::Precision::Double;
+	//! Masses of the numneu-1 lighter states [eV]. Only m_1 may be zero.
+	std::vector<double> light_masses;
+	//! Parent and daughter of the only non-zero coupling, g_{parent,daughter}.
+	unsigned int parent = 3;
+	unsigned int daughter = 2;
+	//! Cross sections, shared by all points. If null, each object loads the nuSQuIDS defaults.
+	std::shared_ptr<CrossSectionLibrary> ncs;
+	//! Body the neutrinos propagate through, shared by all threads. Ignored if make_body is set.
+	/*!
+	It must be safe to read from several threads at once, as ConstantDensity
+	is. Bodies which cache lookups, as EarthAtm does, need make_body instead.
+	*/
+	std::shared_ptr<Body> body;
+	//! Returns a new body for each thread of the scan, if set.
+	/*!
+	Called once per worker thread, the first time it evaluates a point. The
+	bodies must all describe the same medium.
+	*/
+	std::function<std::shared_ptr<Body>()> make_body;
+	//! Returns a new track for each point.
+	/*!
+	nuSQuIDS moves the position of a track while evolving, so tracks
+	cannot be shared between concurrently evolving objects.
+	*/
+	std::function<std::shared_ptr<Track>()> make_track;
+	//! Initial flux in the flavor basis, indexed [energy][rho][flavor].
+	std::shared_ptr<const marray<double,3>> initial_flux;
+	//! Sets everything else that depends on the point: mixing angles, square mass differences, integrator.
+	/*!
+	Called after the masses, couplings, body and track are set and before the
+	initial state is, on the object evaluating the point.
+	*/
+	std::function<void(nuSQUIDSDecay&, const DecayScanPoint&)> configure;
+};
+
+//! Final flavor fluxes of one decay scan point.
+struct DecayScanResult {
+	DecayScanPoint point;
+	//! False if evaluating the point threw. The fluxes are then NaN.
+	bool success = false;
+	//! Message of the exception thrown by a failed point.
+	std::string error;
+	//! Final fluxes, indexed (ie*numneu + flavor)*2 + irho.
+	std::vector<double> flux;
+	//! Instrumentation of the evaluation, see nuSQUIDSDecay::Get_Stats().
+	DecayStats stats;
+	//! First step accepted by the integrator, or 0 if none. See DecayEvolutionSnapshot::Initial_Step().
+	double initial_step = 0;
+	//! True if the fluxes were interpolated from evaluated neighbours, see DecayScan::Run_Adaptive().
+	bool interpolated = false;
+};
+
+//! Settings of the adaptive refinement of a decay scan. See DecayScan::Run_Adaptive().
+struct DecayScanRefinement {
+	//! Spacing, in grid points, of the coarse grid evaluated first along every axis. A power of two.
+	unsigned int coarse_step = 8;
+	//! Relative error of the interpolated fluxes above which a cell is refined.
+	double rel_tolerance = 1e-2;
+	//! Absolute error of the interpolated fluxes added to rel_tolerance, for fluxes close to zero.
+	double abs_tolerance = 0;
+};
+
+//! Progress of a running decay scan. See DecayScan::Set_ProgressCallback().
+struct DecayScanProgress {
+	//! Points of the grid.
+	size_t total = 0;
+	//! Points skipped because they were already done, see DecayScan::Run().
+	size_t skipped = 0;
+	//! Points evaluated so far by this run, including failed ones.
+	size_t done = 0;
+	//! Points of this run which failed.
+	size_t failed = 0;
+	//! Points interpolated instead of evaluated, see DecayScan::Run_Adaptive().
+	size_t interpolated = 0;
+	//! Wall time [s] since the run started.
+	double seconds = 0;
+	//! Points evaluated per second.
+	double points_per_second = 0;
+	//! Right-hand side evaluations per second, see DecayStats::rhs_evaluations.
+	double rhs_per_second = 0;
+};
+
+//! Evaluates nuSQUIDSDecay on every point of a (nu4mass, theta24, coupling) grid.
+/*!
+The inputs which do not depend on the parameters (DecayScanSettings) are
+prepared once and shared by all points. Points are handed out dynamically
+over a thread pool (see DecayThreadPool::ParallelForDynamic()), since their
+cost grows with the coupling. Each thread keeps its own nuSQUIDSDecay object,
+which is re-parameterised for every point it evaluates.
+
+Finished points are not handled by the workers: each worker pushes the index
+of its point into a bounded lock-free queue (DecayBoundedQueue), and a single
+writer thread drains it, calling the result and progress callbacks. Slow
+output, e.g. to a DecayScanStore, thus only stalls the workers if the queue
+fills up.
+*/
+class DecayScan {
+private:
+	DecayScanAxes axes;
+	DecayScanSettings settings;
+	unsigned int nthreads = 1;
+	//! Results, indexed by DecayScanPoint::index.
+	std::vector<DecayScanResult> results;
+	//! Called with each finished point, if set.
+	std::function<void(const DecayScanResult&)> on_result;
+	//! Called with the progress of the scan, if set.
+	std::function<void(const DecayScanProgress&)> on_progress;
+	//! Minimum time [s] between two calls of on_progress.
+	double progress_interval = 10;
+	//! Capacity of the queue of finished points.
+	size_t queue_capacity = 1024;
+	//! Instrumentation of all the points of the last Run().
+	DecayStats stats;
+	//! Toggles the warm start of each point from a finished neighbour. See Set_WarmStart().
+	bool warm_start = true;
+
+	//! Per-thread state.
+	struct Worker {
+		std::unique_ptr<nuSQUIDSDecay> nus;
+		//! Body of the worker: DecayScanSettings::body, or its own from DecayScanSettings::make_body.
+		std::shared_ptr<Body> body;
+		//! DecayScanResult::initial_step of the last point of the worker.
+		double last_step = 0;
+	};
+	//! Workers of the running scan, kept between the batches of Run_Adaptive().
+	std::vector<Worker> workers;
+	//! DecayScanResult::initial_step of the points of the running scan, 0 until they finish.
+	std::unique_ptr<std::atomic<double>[]> initial_steps;
+
+	//! Returns the initial step of a finished grid neighbour of a point, or 0 if none has finished.
+	/*!
+	initial_steps holds DecayScanResult::initial_step of every point, 0 until it finishes.
+	*/
+	double Neighbour_Step(const DecayScanPoint& p, const std::atomic<double>* initial_steps) const {
+		const long offsets[2] = {-1,1};
+		const size_t sizes[3] = {axes.nu4mass.size(),axes.theta24.size(),axes.coupling.size()};
+		//Coupling first: it changes the decay rates, and so the steps, the least.
+		for (int axis = 2; axis >= 0; axis--){
+			for (long offset : offsets){
+				long i[3] = {(long)p.imass,(long)p.itheta,(long)p.icoupling};
+				i[axis] += offset;
+				if (i[axis] < 0 || i[axis] >= (long)sizes[axis]){
+					continue;
+				}
+				double step = initial_steps[axes.Index(i[0],i[1],i[2])].load(std::memory_order_relaxed);
+				if (step > 0){
+					return step;
+				}
+			}
+		}
+		return 0;
+	}
+
+	//! Returns the coupling matrix of a point. The caller owns it.
+	gsl_matrix* Couplings(const DecayScanPoint& point) const {
+		gsl_matrix* couplings = gsl_matrix_alloc(settings.numneu,settings.numneu);
+		gsl_matrix_set_zero(couplings);
+		gsl_matrix_set(couplings,settings.parent,settings.daughter,point.coupling);
+		return couplings;
+	}
+
+	//! Returns the masses of a point.
+	std::vector<double> Masses(const DecayScanPoint& point) const {
+		std::vector<double> m_nu = settings.light_masses;
+		m_nu.push_back(point.nu4mass);
+		return m_nu;
+	}
+
+	//! Returns the decay model of a point.
+	std::shared_ptr<const DecayModel> Model(const DecayScanPoint& point) const {
+		std::unique_ptr<gsl_matrix,void(*)(gsl_matrix*)> couplings(Couplings(point),gsl_matrix_free);
+		return std::make_shared<const DecayModel>(settings.e_nodes,settings.numneu,settings.pscalar,
+							Masses(point),couplings.get(),settings.quadrature,settings.precision);
+	}
+
+	//! Sets up the object of a worker for a point.
+	/*!
+	The object, and the body of the worker, are built on the first point of a
+	worker only. Later points only switch it to the decay model of the point
+	(nuSQUIDSDecay::Set_DecayModel()), which avoids reallocating the nuSQuIDS
+	internals and reloading the cross sections.
+	*/
+	void Prepare_Worker(Worker& worker, const DecayScanPoint& point) const {
+		std::shared_ptr<const DecayModel> model = Model(point);
+		if (!worker.body){
+			worker.body = settings.make_body ? settings.make_body() : settings.body;
+			if (!worker.body){
+				throw std::runtime_error("DecayScan: make_body returned no body.");
+			}
+		}
+		if (!worker.nus){
+			worker.nus.reset(new nuSQUIDSDecay(model,both,settings.iinteraction,settings.decay_regen,settings.ncs));
+			worker.nus->Set_ProgressBar(false);
+			return;
+		}
+		worker.nus->Set_DecayModel(model);
+	}
+
+	//! Evaluates a point with the object of a worker.
+	/*!
+	\param initial_step replaces the initial step set by DecayScanSettings::configure, if positive.
+	*/
+	DecayScanResult Evaluate_Point(Worker& worker, const DecayScanPoint& point, double initial_step = 0) const {
+		DecayScanResult result;
+		result.point = point;
+		unsigned int ne = settings.e_nodes.size();
+		result.flux.assign(ne*settings.numneu*2,std::numeric_limits<double>::quiet_NaN());
+		try{
+			Prepare_Worker(worker,point);
+			nuSQUIDSDecay& nus = *worker.nus;
+			nus.Set_Body(worker.body);
+			nus.Set_Track(settings.make_track());
+			if (settings.configure){
+				settings.configure(nus,point);
+			}
+			if (settings.precision == DecayModel::Precision::Single){
+				nus.Set_ScreeningMode(true);
+			}
+			if (initial_step > 0){
+				nus.Set_h(initial_step);
+			}
+			nus.Set_initial_state(*settings.initial_flux,flavor);
+			nus.Reset_Stats();
+			nus.EvolveState();
+			result.stats = nus.Get_Stats();
+			result.initial_step = nus.Get_Snapshot().Initial_Step();
+			for (unsigned int ie = 0; ie < ne; ie++){
+				for (unsigned int flv = 0; flv < settings.numneu; flv++){
+					for (unsigned int irho = 0; irho < 2; irho++){
+						result.flux[(ie*settings.numneu + flv)*2 + irho] = nus.EvalFlavorAtNode(flv,ie,irho);
+					}
+				}
+			}
+			result.success = true;
+		}
+		catch(std::exception& e){
+			result.error = e.what();
+		}
+		return result;
+	}
+
+	//! Evaluates a batch of points, streaming the results through the writer thread.
+	/*!
+	\param pending are the indices of the points, in any order.
+	\param progress is updated with the finished points.
+	\param start is when the run started, for the rates of progress.
+	\param final_batch is true for the last batch of the run, which reports the progress when it ends.
+	*/
+	void Evaluate_Points(std::vector<size_t> pending, DecayScanProgress& progress,
+						 std::chrono::steady_clock::time_point start, bool final_batch){
+		if (warm_start){
+			std::sort(pending.begin(),pending.end(),[&](size_t a, size_t b){
+				return DecayScanAxes::Morton_Key(axes.Point(a)) < DecayScanAxes::Morton_Key(axes.Point(b));
+			});
+		}
+		DecayBoundedQueue<size_t> finished(queue_capacity);
+		std::atomic<bool> workers_done(false);
+		std::atomic<bool> writer_failed(false);
+		std::exception_ptr writer_error;
+
+		//Drains the queue: the only thread which reads finished results and calls back.
+		std::thread writer([&](){
+			auto last_report = start;
+			for (;;){
+				//Checked before popping, so that nothing pushed before the workers
+				//finished is left in the queue.
+				bool last = workers_done.load(std::memory_order_acquire);
+				size_t index;
+				bool popped = false;
+				while (finished.TryPop(index)){
+					popped = true;
+					const DecayScanResult& result = results[index];
+					stats += result.stats;
+					progress.done++;
+					if (!result.success){
+						progress.failed++;
+					}
+					if (on_result && !writer_failed){
+						try{
+							on_result(result);
+						}
+						catch(...){
+							writer_error = std::current_exception();
+							writer_failed = true;
+						}
+					}
+				}
+				auto now = std::chrono::steady_clock::now();
+				std::chrono::duration<double> elapsed = now - start;
+				std::chrono::duration<double> since_report = now - last_report;
+				progress.seconds = elapsed.count();
+				if (progress.seconds > 0){
+					progress.points_per_second = progress.done/progress.seconds;
+					progress.rhs_per_second = stats.rhs_evaluations/progress.seconds;
+				}
+				if (on_progress && !writer_failed && ((last && final_batch) || since_report.count() >= progress_interval)){
+					try{
+						on_progress(progress);
+					}
+					catch(...){
+						writer_error = std::current_exception();
+						writer_failed = true;
+					}
+					last_report = now;
+				}
+				if (last){
+					return;
+				}
+				if (!popped){
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			}
+		});
+
+		workers.resize(nthreads);
+		try{
+			DecayThreadPool pool(nthreads);
+			pool.ParallelForDynamic(pending.size(),[&](size_t i, unsigned int thread){
+				size_t index = pending[i];
+				Worker& worker = workers[thread];
+				DecayScanPoint point = axes.Point(index);
+				double initial_step = 0;
+				if (warm_start){
+					initial_step = Neighbour_Step(point,initial_steps.get());
+					if (initial_step == 0){
+						initial_step = worker.last_step;
+					}
+				}
+				//Each point writes its own slot, which the writer reads once the index is popped.
+				results[index] = Evaluate_Point(worker,point,initial_step);
+				if (results[index].initial_step > 0){
+					worker.last_step = results[index].initial_step;
+					initial_steps[index].store(results[index].initial_step,std::memory_order_relaxed);
+				}
+				while (!finished.TryPush(index)){
+					std::this_thread::yield();
+				}
+			});
+		}
+		catch(...){
+			workers_done.store(true,std::memory_order_release);
+			writer.join();
+			throw;
+		}
+		workers_done.store(true,std::memory_order_release);
+		writer.join();
+		if (writer_error){
+			std::rethrow_exception(writer_error);
+		}
+	}
+
+	//! A box of grid points [lo, hi] (inclusive) along each axis, see Run_Adaptive().
+	struct Refinement_Cell {
+		size_t lo[3] = {0,0,0};
+		size_t hi[3] = {0,0,0};
+
+		//! True if the cell holds no points but its corners.
+		bool Leaf() const { return hi[0]-lo[0] <= 1 && hi[1]-lo[1] <= 1 && hi[2]-lo[2] <= 1; }
+
+		//! Indices of corner c, whose bit a selects the upper end of axis a.
+		void Corner(unsigned int c, size_t i[3]) const {
+			for (unsigned int axis = 0; axis < 3; axis++){
+				i[axis] = ((c >> axis) & 1) ? hi[axis] : lo[axis];
+			}
+		}
+
+		//! Indices of the center point, rounded down.
+		void Center(size_t i[3]) const {
+			for (unsigned int axis = 0; axis < 3; axis++){
+				i[axis] = (lo[axis] + hi[axis])/2;
+			}
+		}
+
+		//! Appends the halves of the cell along every axis more than one point wide.
+		void Split(std::vector<Refinement_Cell>& out) const {
+			size_t center[3];
+			Center(center);
+			for (unsigned int c = 0; c < 8; c++){
+				Refinement_Cell half;
+				bool exists = true;
+				for (unsigned int axis = 0; axis < 3; axis++){
+					bool upper = (c >> axis) & 1;
+					if (hi[axis]-lo[axis] <= 1){
+						exists = exists && !upper;
+						half.lo[axis] = lo[axis];
+						half.hi[axis] = hi[axis];
+					}
+					else{
+						half.lo[axis] = upper ? center[axis] : lo[axis];
+						half.hi[axis] = upper ? hi[axis] : center[axis];
+					}
+				}
+				if (exists){
+					out.push_back(half);
+				}
+			}
+		}
+	};
+
+	//! Interpolates the fluxes at grid point i from the corners of a cell.
+	void Interpolate_Cell(const Refinement_Cell& cell, const size_t i[3], std::vector<double>& flux) const {
+		double w[3];
+		for (unsigned int axis = 0; axis < 3; axis++){
+			w[axis] = (cell.hi[axis] == cell.lo[axis]) ? 0 :
+				double(i[axis] - cell.lo[axis])/double(cell.hi[axis] - cell.lo[axis]);
+		}
+		flux.assign(settings.e_nodes.size()*settings.numneu*2,0);
+		for (unsigned int c = 0; c < 8; c++){
+			double weight = 1;
+			for (unsigned int axis = 0; axis < 3; axis++){
+				weight *= ((c >> axis) & 1) ? w[axis] : 1 - w[axis];
+			}
+			if (weight == 0){
+				continue;
+			}
+			size_t corner[3];
+			cell.Corner(c,corner);
+			const std::vector<double>& corner_flux = results[axes.Index(corner[0],corner[1],corner[2])].flux;
+			for (size_t k = 0; k < flux.size(); k++){
+				flux[k] += weight*corner_flux[k];
+			}
+		}
+	}
+
+	//! True if the corners and the center of a cell were evaluated, and the center agrees with their interpolation.
+	bool Cell_Is_Smooth(const Refinement_Cell& cell, const DecayScanRefinement& refinement) const {
+		for (unsigned int c = 0; c < 8; c++){
+			size_t i[3];
+			cell.Corner(c,i);
+			if (!results[axes.Index(i[0],i[1],i[2])].success){
+				return false;
+			}
+		}
+		size_t center[3];
+		cell.Center(center);
+		const DecayScanResult& result = results[axes.Index(center[0],center[1],center[2])];
+		if (!result.success){
+			return false;
+		}
+		std::vector<double> predicted;
+		Interpolate_Cell(cell,center,predicted);
+		for (size_t k = 0; k < predicted.size(); k++){
+			double actual = result.flux[k];
+			if (!(std::fabs(predicted[k] - actual) <= refinement.rel_tolerance*std::fabs(actual) + refinement.abs_tolerance)){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//! Checks the settings before the scan starts.
+	void Check_Settings() const {
+		if (settings.light_masses.size()+1 != settings.numneu){
+			throw std::runtime_error("DecayScan: light_masses must hold numneu-1 masses.");
+		}
+		if (settings.parent >= settings.numneu || settings.daughter >= settings.parent){
+			throw std::runtime_error("DecayScan: the coupling must be from a heavier to a lighter state.");
+		}
+		if ((!settings.body && !settings.make_body) || !settings.make_track || !settings.initial_flux){
+			throw std::runtime_error("DecayScan: body or make_body, make_track and initial_flux must be set.");
+		}
+		if (settings.initial_flux->extent(0) != settings.e_nodes.size()){
+			throw std::runtime_error("DecayScan: initial_flux does not match the energy nodes.");
+		}
+	}
+
+public:
+	//! Constructs a scan.
+	/*!
+	\param axes_ are the parameter axes. The grid is their outer product.
+	\param settings_ are the inputs shared by all points.
+	*/
+	DecayScan(DecayScanAxes axes_, DecayScanSettings settings_):
+	axes(std::move(axes_)), settings(std::move(settings_)){
+		Check_Settings();
+	}
+
+	//! Sets the number of threads evaluating points. Default: 1.
+	void Set_NumThreads(unsigned int nthreads_) { nthreads = (nthreads_ == 0) ? 1 : nthreads_; }
+
+	//! Returns the number of threads evaluating points.
+	unsigned int Get_NumThreads() const { return nthreads; }
+
+	//! Sets a function to call with every finished point.
+	/*!
+	Calls are made from the writer thread of Run(), one at a time, in the order
+	the points finish. If it throws, no more calls are made, and Run() rethrows
+	the exception once all workers have stopped.
+	*/
+	void Set_ResultCallback(std::function<void(const DecayScanResult&)> on_result_) { on_result = on_result_; }
+
+	//! Sets a function to call with the progress of the scan.
+	/*!
+	Called from the writer thread of Run(), at most once every interval seconds,
+	and once more when the scan ends.
+	\param on_progress_ is the function.
+	\param interval is the minimum time between two calls [s].
+	*/
+	void Set_ProgressCallback(std::function<void(const DecayScanProgress&)> on_progress_, double interval = 10){
+		on_progress = on_progress_;
+		progress_interval = interval;
+	}
+
+	//! Toggles the warm start of the points. Default: true.
+	/*!
+	The points are evaluated along the Morton curve of the grid (see
+	DecayScanAxes::Morton_Key()), and each one starts the integration from the
+	first step accepted by a finished grid neighbour, or else by the last point
+	of the same thread, instead of the step set by DecayScanSettings::configure.
+	Nearby points settle on nearly the same steps, so this skips most of the
+	steps the integrator takes to find the right size. The results still meet
+	the tolerances, but depend on the order in which points finish.
+	*/
+	void Set_WarmStart(bool opt) { warm_start = opt; }
+
+	//! Sets the capacity of the queue of finished points. It must be a power of two. Default: 1024.
+	void Set_QueueCapacity(size_t capacity) { queue_capacity = capacity; }
+
+	//! Evaluates every point of the grid which is not done yet.
+	/*!
+	\param done marks, by DecayScanPoint::index, the points which must not be
+	evaluated again, e.g. DecayScanStore::Completed() of the file of an
+	interrupted scan. If empty, every point is evaluated. Skipped points keep
+	an unsuccessful result, and are not passed to the result callback.
+	*/
+	void Run(const std::vector<bool>& done = std::vector<bool>()){
+		size_t npoints = axes.Size();
+		if (!done.empty() && done.size() != npoints){
+			throw std::runtime_error("DecayScan: the done mask does not match the grid.");
+		}
+		results.assign(npoints,DecayScanResult());
+		stats = DecayStats();
+		std::vector<size_t> pending;
+		for (size_t index = 0; index < npoints; index++){
+			if (done.empty() || !done[index]){
+				pending.push_back(index);
+			}
+			else{
+				results[index].point = axes.Point(index);
+				results[index].error = "skipped";
+			}
+		}
+
+		DecayScanProgress progress;
+		progress.total = npoints;
+		progress.skipped = npoints - pending.size();
+		initial_steps.reset(new std::atomic<double>[npoints]());
+		Evaluate_Points(pending,progress,std::chrono::steady_clock::now(),true);
+		workers.clear();
+	}
+
+	//! Evaluates some points of the grid, keeping the results of the earlier calls.
+	/*!
+	Used to split a scan between processes, see DecayMPIScan. Only the slots of
+	these points in Get_Results() are written, the workers keep their objects
+	between calls, and the instrumentation accumulates over calls. The progress
+	callback sees the points of this call only.
+	\param indices are indices of grid points, see DecayScanPoint::index.
+	*/
+	void Run_Points(const std::vector<size_t>& indices){
+		size_t npoints = axes.Size();
+		for (size_t index : indices){
+			if (index >= npoints){
+				throw std::runtime_error("DecayScan: the point is not on the grid.");
+			}
+		}
+		if (results.size() != npoints){
+			results.assign(npoints,DecayScanResult());
+			stats = DecayStats();
+			initial_steps.reset(new std::atomic<double>[npoints]());
+		}
+		DecayScanProgress progress;
+		progress.total = indices.size();
+		Evaluate_Points(indices,progress,std::chrono::steady_clock::now(),true);
+	}
+
+	//! Evaluates the grid adaptively: densely only where the fluxes change.
+	/*!
+	Starts from the coarse grid of every refinement.coarse_step-th point along
+	each axis (and the last one), whose cells are boxes of grid points. Each
+	pass evaluates the corners and the center of the cells, and compares the
+	fluxes at the center with their multilinear interpolation from the corners:
+	 - if they agree within the tolerances at every energy, flavor and rho, the
+	   cell is smooth, and all its points are interpolated from its corners;
+	 - otherwise, or if a corner or the center failed, the cell is split in
+	   half along every axis, and its halves are checked in the next pass.
+	Cells one point wide along every axis hold no other points. Every point of
+	the grid thus ends up in Get_Results(), either evaluated or interpolated
+	(DecayScanResult::interpolated), and regions where the fluxes are smooth,
+	such as zero coupling or zero mixing, cost only their coarse corners.
+	Each pass is one batch of Run(): the result callback is called from the
+	writer thread as the points are evaluated, and then, from the calling
+	thread, with every interpolated point once all passes are done.
+	\param refinement sets the coarse grid and the tolerances, see DecayScanRefinement.
+	*/
+	void Run_Adaptive(const DecayScanRefinement& refinement = DecayScanRefinement()){
+		const size_t coarse = refinement.coarse_step;
+		if (coarse == 0 || (coarse & (coarse-1)) != 0){
+			throw std::runtime_error("DecayScan: the coarse step must be a power of two.");
+		}
+		size_t npoints = axes.Size();
+		results.assign(npoints,DecayScanResult());
+		for (size_t index = 0; index < npoints; index++){
+			results[index].point = axes.Point(index);
+		}
+		stats = DecayStats();
+		initial_steps.reset(new std::atomic<double>[npoints]());
+		DecayScanProgress progress;
+		progress.total = npoints;
+		auto start = std::chrono::steady_clock::now();
+
+		const size_t sizes[3] = {axes.nu4mass.size(),axes.theta24.size(),axes.coupling.size()};
+		std::vector<Refinement_Cell> cells(1);
+		for (unsigned int axis = 0; axis < 3; axis++){
+			std::vector<size_t> nodes;
+			for (size_t i = 0; i < sizes[axis]; i += coarse){
+				nodes.push_back(i);
+			}
+			if (nodes.back() != sizes[axis]-1){
+				nodes.push_back(sizes[axis]-1);
+			}
+			if (nodes.size() == 1){
+				nodes.push_back(nodes[0]);
+			}
+			std::vector<Refinement_Cell> split;
+			for (const Refinement_Cell& cell : cells){
+				for (size_t n = 0; n+1 < nodes.size(); n++){
+					Refinement_Cell c = cell;
+					c.lo[axis] = nodes[n];
+					c.hi[axis] = nodes[n+1];
+					split.push_back(c);
+				}
+			}
+			cells.swap(split);
+		}
+
+		std::vector<bool> evaluated(npoints,false);
+		std::vector<Refinement_Cell> smooth;
+		while (!cells.empty()){
+			std::vector<size_t> batch;
+			auto request = [&](const size_t i[3]){
+				size_t index = axes.Index(i[0],i[1],i[2]);
+				if (!evaluated[index]){
+					evaluated[index] = true;
+					batch.push_back(index);
+				}
+			};
+			for (const Refinement_Cell& cell : cells){
+				for (unsigned int corner = 0; corner < 8; corner++){
+					size_t i[3];
+					cell.Corner(corner,i);
+					request(i);
+				}
+				if (!cell.Leaf()){
+					size_t i[3];
+					cell.Center(i);
+					request(i);
+				}
+			}
+			Evaluate_Points(batch,progress,start,false);
+
+			std::vector<Refinement_Cell> next;
+			for (const Refinement_Cell& cell : cells){
+				if (cell.Leaf()){
+					continue;
+				}
+				if (Cell_Is_Smooth(cell,refinement)){
+					smooth.push_back(cell);
+				}
+				else{
+					cell.Split(next);
+				}
+			}
+			cells.swap(next);
+		}
+		workers.clear();
+
+		std::vector<size_t> interpolated;
+		std::vector<double> flux;
+		for (const Refinement_Cell& cell : smooth){
+			size_t i[3];
+			for (i[0] = cell.lo[0]; i[0] <= cell.hi[0]; i[0]++){
+				for (i[1] = cell.lo[1]; i[1] <= cell.hi[1]; i[1]++){
+					for (i[2] = cell.lo[2]; i[2] <= cell.hi[2]; i[2]++){
+						size_t index = axes.Index(i[0],i[1],i[2]);
+						if (evaluated[index]){
+							continue;
+						}
+						evaluated[index] = true;
+						Interpolate_Cell(cell,i,flux);
+						DecayScanResult& result = results[index];
+						result.flux = flux;
+						result.success = true;
+						result.interpolated = true;
+						interpolated.push_back(index);
+					}
+				}
+			}
+		}
+		progress.interpolated = interpolated.size();
+		if (on_result){
+			for (size_t index : interpolated){
+				on_result(results[index]);
+			}
+		}
+		if (on_progress){
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			progress.seconds = elapsed.count();
+			on_progress(progress);
+		}
+	}
+
+	//! Evaluates a single point, on the calling thread.
+	DecayScanResult Evaluate(const DecayScanPoint& point) const {
+		Worker worker;
+		return Evaluate_Point(worker,point);
+	}
+
+	//! Returns the parameter axes.
+	const DecayScanAxes& Get_Axes() const { return axes; }
+
+	//! Returns the shared settings.
+	const DecayScanSettings& Get_Settings() const { return settings; }
+
+	//! Returns the results of the last Run(), indexed by DecayScanPoint::index.
+	const std::vector<DecayScanResult>& Get_Results() const { return results; }
+
+	//! Returns the sum of the instrumentation of every point of the last Run().
+	/*!
+	All zero unless compiled with NUSQUIDS_DECAY_INSTRUMENTATION, see DecayStats.
+	Times are summed over threads, so they can exceed the wall time of the scan.
+	*/
+	const DecayStats& Get_Stats() const { return stats; }
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_scan_H
@@ -0,0 +1,139 @@
+#ifndef nusquids_decay_simd_H
+#define nusquids_decay_simd_H
+
+/*
+Vectorised dot products used by the batched decay regeneration of
+nuSQUIDSDecay, on double or, in screening mode, single precision operands.
+The instruction set is chosen at compile time: AVX-512 if __AVX512F__ is
+defined, AVX2 if __AVX2__ is, and portable scalar code otherwise (e.g.
+compile with -march=native, or "make NATIVE=1").
+*/
+
+#include <cstddef>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace nusquids {
+
+#if defined(__AVX2__) && !defined(__AVX512F__)
+//! Returns the sum of the four lanes of v.
+inline double DecayHorizontalSum(__m256d v){
+	__m128d low = _mm256_castpd256_pd128(v);
+	__m128d high = _mm256_extractf128_pd(v,1);
+	low = _mm_add_pd(low,high);
+	return _mm_cvtsd_f64(_mm_add_sd(low,_mm_unpackhi_pd(low,low)));
+}
+
+//! Returns a*b + c, fused if the target has FMA.
+inline __m256d DecayMultiplyAdd(__m256d a, __m256d b, __m256d c){
+#ifdef __FMA__
+	return _mm256_fmadd_pd(a,b,c);
+#else
+	return _mm256_add_pd(_mm256_mul_pd(a,b),c);
+#endif
+}
+#endif
+
+//! Returns the dot product of a[0..n) and b[0..n).
+/*!
+The summation order depends on the instruction set, so results differ
+between builds in the last bits.
+*/
+inline double DecayDot(const double* a, const double* b, size_t n){
+	size_t i = 0;
+	double sum = 0;
+#if defined(__AVX512F__)
+	__m512d acc0 = _mm512_setzero_pd();
+	__m512d acc1 = _mm512_setzero_pd();
+	for (; i + 16 <= n; i += 16){
+		acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(a+i),_mm512_loadu_pd(b+i),acc0);
+		acc1 = _mm512_fmadd_pd(_mm512_loadu_pd(a+i+8),_mm512_loadu_pd(b+i+8),acc1);
+	}
+	for (; i + 8 <= n; i += 8){
+		acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(a+i),_mm512_loadu_pd(b+i),acc0);
+	}
+	if (i < n){
+		__mmask8 mask = (__mmask8)((1u << (n-i)) - 1);
+		acc1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask,a+i),_mm512_maskz_loadu_pd(mask,b+i),acc1);
+		i = n;
+	}
+	sum = _mm512_reduce_add_pd(_mm512_add_pd(acc0,acc1));
+#elif defined(__AVX2__)
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	for (; i + 8 <= n; i += 8){
+		acc0 = DecayMultiplyAdd(_mm256_loadu_pd(a+i),_mm256_loadu_pd(b+i),acc0);
+		acc1 = DecayMultiplyAdd(_mm256_loadu_pd(a+i+4),_mm256_loadu_pd(b+i+4),acc1);
+	}
+	for (; i + 4 <= n; i += 4){
+		acc0 = DecayMultiplyAdd(_mm256_loadu_pd(a+i),_mm256_loadu_pd(b+i),acc0);
+	}
+	sum = DecayHorizontalSum(_mm256_add_pd(acc0,acc1));
+#else
+	//Independent accumulators, so that the additions do not wait on each other.
+	double acc[4] = {0,0,0,0};
+	for (; i + 4 <= n; i += 4){
+		acc[0] += a[i]*b[i];
+		acc[1] += a[i+1]*b[i+1];
+		acc[2] += a[i+2]*b[i+2];
+		acc[3] += a[i+3]*b[i+3];
+	}
+	sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+	for (; i < n; i++){
+		sum += a[i]*b[i];
+	}
+	return sum;
+}
+
+//! Returns the dot product of a[0..n) and b[0..n), stored in single precision, accumulated in double precision.
+/*!
+Used by the screening mode of nuSQUIDSDecay: the operands take half the
+memory traffic of DecayDot() on doubles, and each product is widened to
+double before it is added, so that the sum does not lose the precision of
+the operands over long kernel bands.
+*/
+inline double DecayDot(const float* a, const float* b, size_t n){
+	size_t i = 0;
+	double sum = 0;
+#if defined(__AVX512F__)
+	__m512d acc0 = _mm512_setzero_pd();
+	__m512d acc1 = _mm512_setzero_pd();
+	for (; i + 16 <= n; i += 16){
+		acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(a+i)),_mm512_cvtps_pd(_mm256_loadu_ps(b+i)),acc0);
+		acc1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(a+i+8)),_mm512_cvtps_pd(_mm256_loadu_ps(b+i+8)),acc1);
+	}
+	for (; i + 8 <= n; i += 8){
+		acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(a+i)),_mm512_cvtps_pd(_mm256_loadu_ps(b+i)),acc0);
+	}
+	sum = _mm512_reduce_add_pd(_mm512_add_pd(acc0,acc1));
+#elif defined(__AVX2__)
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	for (; i + 8 <= n; i += 8){
+		acc0 = DecayMultiplyAdd(_mm256_cvtps_pd(_mm_loadu_ps(a+i)),_mm256_cvtps_pd(_mm_loadu_ps(b+i)),acc0);
+		acc1 = DecayMultiplyAdd(_mm256_cvtps_pd(_mm_loadu_ps(a+i+4)),_mm256_cvtps_pd(_mm_loadu_ps(b+i+4)),acc1);
+	}
+	for (; i + 4 <= n; i += 4){
+		acc0 = DecayMultiplyAdd(_mm256_cvtps_pd(_mm_loadu_ps(a+i)),_mm256_cvtps_pd(_mm_loadu_ps(b+i)),acc0);
+	}
+	sum = DecayHorizontalSum(_mm256_add_pd(acc0,acc1));
+#else
+	double acc[4] = {0,0,0,0};
+	for (; i + 4 <= n; i += 4){
+		acc[0] += double(a[i])*b[i];
+		acc[1] += double(a[i+1])*b[i+1];
+		acc[2] += double(a[i+2])*b[i+2];
+		acc[3] += double(a[i+3])*b[i+3];
+	}
+	sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+	for (; i < n; i++){
+		sum += double(a[i])*b[i];
+	}
+	return sum;
+}
+
+} // close nusquids namespace
+#endif // nusquids_decay_simd_H
@@ -0,0 +1,77 @@
+#ifndef nusquids_decay_snapshot_H
+#define nusquids_decay_snapshot_H
+
+/*
+Header implementing DecayEvolutionSnapshot, the step sizes taken by the
+integrator in an evolution of nuSQUIDSDecay, used to warm start the evolution
+of a similar problem. See nuSQUIDSDecay::Get_Snapshot().
+*/
+
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <limits>
+#include <stdexcept>
+
+namespace nusquids {
+
+//! Accepted steps of a numerical evolution.
+/*!
+The adaptive stepper starts every evolution from the step size given with
+Set_h(), and spends its first steps shrinking or growing it to the size the
+tolerances allow. Problems with nearby parameters settle on nearly the same
+steps, so the first step accepted in one is a good initial step for the other.
+*/
+struct DecayEvolutionSnapshot {
+	//! Start of each accepted step, relative to the start of the evolution.
+	std::vector<double> step_times;
+	//! Size of each accepted step.
+	std::vector<double> step_sizes;
+
+	//! Returns the size of the first accepted step, or 0 if there was none.
+	double Initial_Step() const { return step_sizes.empty() ? 0 : step_sizes.front(); }
+
+	//! Drops the steps, keeping the capacity of the vectors.
+	void Clear(){
+		step_times.clear();
+		step_sizes.clear();
+	}
+
+	//! Reserves room for nsteps steps.
+	void Reserve(size_t nsteps){
+		step_times.reserve(nsteps);
+		step_sizes.reserve(nsteps);
+	}
+
+	//! Writes the snapshot as text, to be read back with Read().
+	void Write(std::ostream& os) const {
+		std::streamsize precision = os.precision(std::numeric_limits<double>::max_digits10);
+		os << "DecayEvolutionSnapshot " << step_sizes.size() << '\n';
+		for (size_t i = 0; i < step_sizes.size(); i++){
+			os << step_times[i] << ' ' << step_sizes[i] << '\n';
+		}
+		os.precision(precision);
+	}
+
+	//! Reads a snapshot written by Write().
+	static DecayEvolutionSnapshot Read(std::istream& is){
+		DecayEvolutionSnapshot snapshot;
+		std::string tag;
+		size_t nsteps = 0;
+		if (!(is >> tag >> nsteps) || tag != "DecayEvolutionSnapshot"){
+			throw std::runtime_error("DecayEvolutionSnapshot: the stream does not hold a snapshot.");
+		}
+		snapshot.step_times.resize(nsteps);
+		snapshot.step_sizes.resize(nsteps);
+		for (size_t i = 0; i < nsteps; i++){
+			if (!(is >> snapshot.step_times[i] >> snapshot.step_sizes[i])){
+				throw std::runtime_error("DecayEvolutionSnapshot: the snapshot is truncated.");
+			}
+		}
+		return snapshot;
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_snapshot_H
@@ -0,0 +1,144 @@
+#ifndef nusquids_decay_stats_H
+#define nusquids_decay_stats_H
+
+/*
+Counters and timers of the nuSQUIDSDecay hot paths. They are only updated if
+the code is compiled with NUSQUIDS_DECAY_INSTRUMENTATION defined; otherwise
+the hooks compile to nothing and all the counters but the number of
+right-hand side evaluations stay at zero.
+*/
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <ostream>
+
+namespace nusquids {
+
+//! Number of calls and time spent in one instrumented function.
+struct DecayCounter {
+	unsigned long calls = 0;
+	//! Wall time [s] spent in the calls.
+	double seconds = 0;
+
+	DecayCounter& operator+=(const DecayCounter& other){
+		calls += other.calls;
+		seconds += other.seconds;
+		return *this;
+	}
+};
+
+//! Instrumentation of a nuSQUIDSDecay object. See nuSQUIDSDecay::Get_Stats().
+/*!
+Each derivative evaluation of the integrator calls AddToPreDerive() once, so
+prederive.calls is the number of right-hand side evaluations. The same number
+is kept in rhs_evaluations, which, unlike the rest, is counted in every build
+(it costs one increment per evaluation). The time of the decay terms is the
+time of gamma, interactions and prederive minus that of the nuSQuIDS terms
+they include (base_gamma and base_interactions).
+*/
+struct DecayStats {
+	//! True if the code was compiled with NUSQUIDS_DECAY_INSTRUMENTATION.
+#ifdef NUSQUIDS_DECAY_INSTRUMENTATION
+	static const bool enabled = true;
+#else
+	static const bool enabled = false;
+#endif
+	//! Right-hand side evaluations. Always counted, see above.
+	unsigned long rhs_evaluations = 0;
+	//! nuSQUIDSDecay::AddToPreDerive(), which includes the batched regeneration.
+	DecayCounter prederive;
+	//! nuSQUIDSDecay::GammaRho().
+	DecayCounter gamma;
+	//! nuSQUIDS::GammaRho(), called from nuSQUIDSDecay::GammaRho() with interactions on.
+	DecayCounter base_gamma;
+	//! nuSQUIDSDecay::InteractionsRho().
+	DecayCounter interactions;
+	//! nuSQUIDS::InteractionsRho(), called from nuSQUIDSDecay::InteractionsRho() with interactions on.
+	DecayCounter base_interactions;
+	//! Evolutions done with the analytic path instead of the integrator, see nuSQUIDSDecay::EvolveState().
+	unsigned long analytic_evolutions = 0;
+	//! Daughter nodes evaluated per regeneration channel, entry parent*numneu + daughter.
+	/*!
+	Each entry counts the (daughter energy, rho) pairs for which the regeneration
+	integral of the channel was summed.
+	*/
+	std::vector<unsigned long> channel_evaluations;
+
+	DecayStats& operator+=(const DecayStats& other){
+		rhs_evaluations += other.rhs_evaluations;
+		prederive += other.prederive;
+		gamma += other.gamma;
+		base_gamma += other.base_gamma;
+		interactions += other.interactions;
+		base_interactions += other.base_interactions;
+		analytic_evolutions += other.analytic_evolutions;
+		if (channel_evaluations.size() < other.channel_evaluations.size()){
+			channel_evaluations.resize(other.channel_evaluations.size(),0);
+		}
+		for (size_t i = 0; i < other.channel_evaluations.size(); i++){
+			channel_evaluations[i] += other.channel_evaluations[i];
+		}
+		return *this;
+	}
+
+	//! Writes the statistics as "name calls seconds" lines, for monitoring tools.
+	/*!
+	Channels are written as "channel_<parent>_<daughter> evaluations", and
+	only if they were evaluated.
+	\param os is the stream.
+	\param numneu is the number of neutrino states, to name the channels.
+	*/
+	void Write(std::ostream& os, unsigned int numneu) const {
+		os << "rhs_evaluations " << rhs_evaluations << '\n';
+		Write_Counter(os,"prederive",prederive);
+		Write_Counter(os,"gamma",gamma);
+		Write_Counter(os,"base_gamma",base_gamma);
+		Write_Counter(os,"interactions",interactions);
+		Write_Counter(os,"base_interactions",base_interactions);
+		os << "analytic_evolutions " << analytic_evolutions << '\n';
+		for (size_t c = 0; c < channel_evaluations.size() && numneu > 0; c++){
+			if (channel_evaluations[c] != 0){
+				os << "channel_" << c/numneu << '_' << c%numneu << ' ' << channel_evaluations[c] << '\n';
+			}
+		}
+	}
+
+private:
+	static void Write_Counter(std::ostream& os, const std::string& name, const DecayCounter& counter){
+		os << name << ' ' << counter.calls << ' ' << counter.seconds << '\n';
+	}
+};
+
+//! Adds one call, and the time until it goes out of scope, to a counter.
+class DecayTimer {
+private:
+	DecayCounter& counter;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	explicit DecayTimer(DecayCounter& counter_):
+	counter(counter_), start(std::chrono::steady_clock::now()) {}
+
+	~DecayTimer(){
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		counter.calls++;
+		counter.seconds += elapsed.count();
+	}
+
+	DecayTimer(const DecayTimer&)=delete;
+	DecayTimer& operator=(const DecayTimer&)=delete;
+};
+
+} // close nusquids namespace
+
+//Hooks used by nuSQUIDSDecay. They compile to nothing without NUSQUIDS_DECAY_INSTRUMENTATION.
+#ifdef NUSQUIDS_DECAY_INSTRUMENTATION
+#define NUSQUIDS_DECAY_TIME(counter) nusquids::DecayTimer nusquids_decay_timer_##counter(stats.counter)
+#define NUSQUIDS_DECAY_COUNT(statement) statement
+#else
+#define NUSQUIDS_DECAY_TIME(counter)
+#define NUSQUIDS_DECAY_COUNT(statement)
+#endif
+
+#endif // nusquids_decay_stats_H
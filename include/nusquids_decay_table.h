@@ -0,0 +1,516 @@
+#ifndef nusquids_decay_table_H
+#define nusquids_decay_table_H
+
+/*
+Header implementing DecayFluxTable, which serves the flux ratios of a decay
+scan at arbitrary (nu4mass, theta24, coupling) by interpolating the grid, and
+evaluates nuSQUIDSDecay on demand outside of it. See nusquids_decay_hdf5.h
+for the scan output it reads.
+*/
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+#include "nusquids_decay_scan.h"
+
+namespace nusquids {
+
+//! Parameters of one DecayFluxTable query.
+struct DecayFluxQuery {
+	//! Mass of the heaviest state [eV].
+	double nu4mass;
+	double theta24;
+	double coupling;
+};
+
+//! Flux ratios of a decay scan, interpolated in the scan parameters.
+/*!
+Each point of the grid holds a row of ne*numneu*2 values, indexed
+(ie*numneu + flavor)*2 + irho as DecayScanResult::flux: the final flux
+divided by the initial flux if the scan file has "initial_flux", and the
+final flux otherwise. The ratio of a component whose initial flux is zero,
+as the tau and sterile ones of the examples, is defined as 0, so that it
+interpolates to 0 instead of spreading NaN; such components carry no
+information in a ratio table. A query is the multilinear interpolation in
+(nu4mass, theta24, coupling) of the rows of the 8 grid points around it, so
+it costs a few multiply-adds per value and takes no lock.
+
+A query is outside the table if it lies outside the grid by more than the
+tolerance (see Set_Tolerance()), or if one of the grid points it needs was
+not evaluated. Such a query is evaluated by the function set with
+Set_Evaluator(), e.g. with a DecayScan, and the row is kept: later queries
+within the tolerance of it, in grid steps along every axis, return it.
+Without an evaluator these queries throw.
+
+Tables are read from scan files with From_Scan(), and saved with Save() to
+a flat binary file which Open() memory-maps, so that many processes share
+the pages of one table and opening it reads nothing.
+*/
+class DecayFluxTable {
+public:
+	//! Returns the row of a point outside the table, in the layout of the table.
+	typedef std::function<std::vector<double>(const DecayFluxQuery&)> Evaluator;
+
+private:
+	//! Layout of the files of Save() and Open(): the header, the axes, the rows, then the status bytes.
+	struct File_Header {
+		char magic[8];
+		uint64_t nmass, ntheta, ncoupling, ne, numneu, ratios;
+	};
+	static const char* Magic() { return "NUSQDFT1"; }
+
+	std::vector<double> nu4mass, theta24, coupling, energy;
+	unsigned int numneu = 0;
+	//! Number of values of each grid point.
+	size_t row = 0;
+	bool ratios = false;
+	//! Rows of every grid point, row-major in (mass, theta24, coupling), and their status (see DecayScanStore).
+	const double* values = nullptr;
+	const signed char* status = nullptr;
+	//! Storage of values and status, unless they are memory-mapped.
+	std::vector<double> owned_values;
+	std::vector<signed char> owned_status;
+	void* map = nullptr;
+	size_t map_size = 0;
+
+	double tolerance = 0.01;
+	Evaluator evaluator;
+
+	//! A row evaluated on demand.
+	struct Extra_Point {
+		DecayFluxQuery query;
+		std::vector<double> row;
+	};
+	mutable std::mutex extra_mutex;
+	mutable std::vector<Extra_Point> extra_points;
+
+	//! Returns a final flux divided by an initial flux, or 0 if the initial flux is zero. See the class description.
+	static double Ratio(double final_flux, double initial_flux){
+		return (initial_flux == 0) ? 0 : final_flux/initial_flux;
+	}
+
+	//! Finds the cell of x on an axis, and the weight of its upper node.
+	/*!
+	Returns false if x is outside the axis by more than #tolerance steps of the axis.
+	*/
+	bool Locate(const std::vector<double>& axis, double x, size_t& i, double& w) const {
+		if (axis.size() == 1){
+			i = 0;
+			w = 0;
+			return std::fabs(x - axis[0]) <= tolerance;
+		}
+		size_t last = axis.size()-1;
+		if (x <= axis[0]){
+			i = 0;
+			w = 0;
+			return axis[0] - x <= tolerance*(axis[1] - axis[0]);
+		}
+		if (x >= axis[last]){
+			i = last-1;
+			w = 1;
+			return x - axis[last] <= tolerance*(axis[last] - axis[last-1]);
+		}
+		i = std::upper_bound(axis.begin(),axis.end(),x) - axis.begin() - 1;
+		w = (x - axis[i])/(axis[i+1] - axis[i]);
+		return true;
+	}
+
+	//! Interpolates values [begin, begin+count) of the rows at a query. Returns false if it is outside the grid.
+	bool Interpolate(const DecayFluxQuery& q, size_t begin, size_t count, double* out) const {
+		size_t cell[3];
+		double w[3];
+		if (!Locate(nu4mass,q.nu4mass,cell[0],w[0]) || !Locate(theta24,q.theta24,cell[1],w[1])
+			|| !Locate(coupling,q.coupling,cell[2],w[2])){
+			return false;
+		}
+		std::fill(out,out+count,0.0);
+		for (unsigned int corner = 0; corner < 8; corner++){
+			double weight = 1;
+			size_t index[3];
+			for (unsigned int axis = 0; axis < 3; axis++){
+				bool upper = (corner >> axis) & 1;
+				weight *= upper ? w[axis] : 1 - w[axis];
+				index[axis] = cell[axis] + upper;
+			}
+			if (weight == 0){
+				continue;
+			}
+			size_t point = (index[0]*theta24.size() + index[1])*coupling.size() + index[2];
+			if (status[point] != 1 && status[point] != 2){
+				return false;
+			}
+			const double* corner_row = values + point*row + begin;
+			for (size_t k = 0; k < count; k++){
+				out[k] += weight*corner_row[k];
+			}
+		}
+		return true;
+	}
+
+	//! Returns the distance in grid steps between two queries: the largest over the axes.
+	/*!
+	The step of an axis is its mean spacing, or 1 if it has a single node.
+	*/
+	double Distance(const DecayFluxQuery& a, const DecayFluxQuery& b) const {
+		auto steps = [](const std::vector<double>& axis, double x, double y){
+			double step = (axis.size() > 1) ? (axis.back() - axis.front())/(axis.size()-1) : 1;
+			return std::fabs(x - y)/step;
+		};
+		return std::max(steps(nu4mass,a.nu4mass,b.nu4mass),
+					std::max(steps(theta24,a.theta24,b.theta24),steps(coupling,a.coupling,b.coupling)));
+	}
+
+	//! Copies values [begin, begin+count) of a row evaluated on demand near a query. Returns false if there is none.
+	/*!
+	extra_mutex must be held.
+	*/
+	bool Find_Extra(const DecayFluxQuery& q, size_t begin, size_t count, double* out) const {
+		for (const Extra_Point& extra : extra_points){
+			if (Distance(extra.query,q) <= tolerance){
+				std::copy(extra.row.begin()+begin,extra.row.begin()+begin+count,out);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//! Copies values [begin, begin+count) of the row of a query outside the grid, evaluating it if needed.
+	/*!
+	The evaluation runs without the lock, so that other threads can read the
+	rows already evaluated meanwhile. If another thread evaluated a row near
+	the query in the meantime, that row is kept and returned instead.
+	*/
+	void Query_Outside(const DecayFluxQuery& q, size_t begin, size_t count, double* out) const {
+		{
+			std::lock_guard<std::mutex> lock(extra_mutex);
+			if (Find_Extra(q,begin,count,out)){
+				return;
+			}
+		}
+		if (!evaluator){
+			throw std::runtime_error("DecayFluxTable: the query is outside the table, and no evaluator was set.");
+		}
+		Extra_Point extra{q,evaluator(q)};
+		if (extra.row.size() != row){
+			throw std::runtime_error("DecayFluxTable: the evaluator returned a row of the wrong size.");
+		}
+		std::lock_guard<std::mutex> lock(extra_mutex);
+		if (Find_Extra(q,begin,count,out)){
+			return;
+		}
+		std::copy(extra.row.begin()+begin,extra.row.begin()+begin+count,out);
+		extra_points.push_back(std::move(extra));
+	}
+
+	void Query_Range(const DecayFluxQuery& q, size_t begin, size_t count, double* out) const {
+		if (!Interpolate(q,begin,count,out)){
+			Query_Outside(q,begin,count,out);
+		}
+	}
+
+	void Check_Axes() const {
+		for (const std::vector<double>* axis : {&nu4mass,&theta24,&coupling}){
+			if (axis->empty()){
+				throw std::runtime_error("DecayFluxTable: every axis needs at least one node.");
+			}
+			for (size_t i = 1; i < axis->size(); i++){
+				if (!((*axis)[i] > (*axis)[i-1])){
+					throw std::runtime_error("DecayFluxTable: the axes must be increasing.");
+				}
+			}
+		}
+	}
+
+	void Unmap(){
+		if (map){
+			munmap(map,map_size);
+		}
+		map = nullptr;
+		map_size = 0;
+	}
+
+	static std::vector<double> Read_Axis(hid_t file, const std::string& name){
+		hsize_t size = 0;
+		if (H5LTget_dataset_info(file,name.c_str(),&size,NULL,NULL) < 0){
+			throw std::runtime_error("DecayFluxTable: reading the axis " + name + " failed.");
+		}
+		std::vector<double> axis(size);
+		if (H5LTread_dataset_double(file,name.c_str(),axis.data()) < 0){
+			throw std::runtime_error("DecayFluxTable: reading the axis " + name + " failed.");
+		}
+		return axis;
+	}
+
+	static void Read_Scan(hid_t file, DecayFluxTable& table){
+		table.nu4mass = Read_Axis(file,"nu4mass");
+		table.theta24 = Read_Axis(file,"theta24");
+		table.coupling = Read_Axis(file,"coupling");
+		table.energy = Read_Axis(file,"energy");
+		hsize_t dims[6];
+		int rank = 0;
+		if (H5LTget_dataset_ndims(file,"flux",&rank) < 0 || rank != 6
+			|| H5LTget_dataset_info(file,"flux",dims,NULL,NULL) < 0){
+			throw std::runtime_error("DecayFluxTable: the file has no flux dataset.");
+		}
+		size_t npoints = table.nu4mass.size()*table.theta24.size()*table.coupling.size();
+		if (dims[0]*dims[1]*dims[2] != npoints || dims[3] != table.energy.size() || dims[5] != 2){
+			throw std::runtime_error("DecayFluxTable: the flux does not match the axes of the file.");
+		}
+		table.numneu = dims[4];
+		table.row = dims[3]*dims[4]*dims[5];
+		table.owned_values.resize(npoints*table.row);
+		table.owned_status.resize(npoints);
+		if (H5LTread_dataset_double(file,"flux",table.owned_values.data()) < 0
+			|| H5LTread_dataset(file,"status",H5T_NATIVE_SCHAR,table.owned_status.data()) < 0){
+			throw std::runtime_error("DecayFluxTable: reading the fluxes failed.");
+		}
+		table.ratios = H5LTfind_dataset(file,"initial_flux") > 0;
+		if (table.ratios){
+			std::vector<double> initial(table.row);
+			if (H5LTread_dataset_double(file,"initial_flux",initial.data()) < 0){
+				throw std::runtime_error("DecayFluxTable: reading the initial flux failed.");
+			}
+			for (size_t point = 0; point < npoints; point++){
+				for (size_t k = 0; k < table.row; k++){
+					double& value = table.owned_values[point*table.row + k];
+					value = Ratio(value,initial[k]);
+				}
+			}
+		}
+	}
+
+	DecayFluxTable() = default;
+
+public:
+	//! Builds a table from rows in memory.
+	/*!
+	\param axes are the scan axes.
+	\param energy_ are the energy nodes.
+	\param numneu_ is the number of states.
+	\param values_ are the rows of every point, indexed by DecayScanPoint::index.
+	\param status_ is 1 (evaluated) or 2 (interpolated) for the points whose row is valid, per DecayScanPoint::index.
+	\param ratios_ is true if the rows are flux ratios, false if they are fluxes.
+	*/
+	DecayFluxTable(const DecayScanAxes& axes, std::vector<double> energy_, unsigned int numneu_,
+				   std::vector<double> values_, std::vector<signed char> status_, bool ratios_):
+	nu4mass(axes.nu4mass), theta24(axes.theta24), coupling(axes.coupling), energy(std::move(energy_)),
+	numneu(numneu_), row(energy.size()*numneu_*2), ratios(ratios_),
+	owned_values(std::move(values_)), owned_status(std::move(status_)){
+		Check_Axes();
+		if (owned_status.size() != axes.Size() || owned_values.size() != axes.Size()*row){
+			throw std::runtime_error("DecayFluxTable: the rows do not match the axes.");
+		}
+		values = owned_values.data();
+		status = owned_status.data();
+	}
+
+	DecayFluxTable(const DecayFluxTable&)=delete;
+	DecayFluxTable& operator=(const DecayFluxTable&)=delete;
+
+	~DecayFluxTable(){ Unmap(); }
+
+	//! Reads the output of a scan, written by DecayScanStore.
+	/*!
+	The points which were not evaluated, or failed, are outside the table.
+	\param fname is the path of the HDF5 file.
+	*/
+	static std::unique_ptr<DecayFluxTable> From_Scan(const std::string& fname){
+		std::unique_ptr<DecayFluxTable> table(new DecayFluxTable());
+		hid_t file = H5Fopen(fname.c_str(),H5F_ACC_RDONLY,H5P_DEFAULT);
+		if (file < 0){
+			throw std::runtime_error("DecayFluxTable: opening " + fname + " failed.");
+		}
+		try{
+			Read_Scan(file,*table);
+		}
+		catch(...){
+			H5Fclose(file);
+			throw;
+		}
+		H5Fclose(file);
+		table->Check_Axes();
+		table->values = table->owned_values.data();
+		table->status = table->owned_status.data();
+		return table;
+	}
+
+	//! Writes the grid of the table to a file for Open(). Points evaluated on demand are not written.
+	void Save(const std::string& fname) const {
+		std::ofstream os(fname,std::ios::binary);
+		File_Header header;
+		std::memcpy(header.magic,Magic(),8);
+		header.nmass = nu4mass.size();
+		header.ntheta = theta24.size();
+		header.ncoupling = coupling.size();
+		header.ne = energy.size();
+		header.numneu = numneu;
+		header.ratios = ratios;
+		size_t npoints = nu4mass.size()*theta24.size()*coupling.size();
+		os.write(reinterpret_cast<const char*>(&header),sizeof(header));
+		for (const std::vector<double>* axis : {&nu4mass,&theta24,&coupling,&energy}){
+			os.write(reinterpret_cast<const char*>(axis->data()),axis->size()*sizeof(double));
+		}
+		os.write(reinterpret_cast<const char*>(values),npoints*row*sizeof(double));
+		os.write(reinterpret_cast<const char*>(status),npoints);
+		if (!os){
+			throw std::runtime_error("DecayFluxTable: writing " + fname + " failed.");
+		}
+	}
+
+	//! Memory-maps a file written by Save(). The file must not change while the table is open.
+	static std::unique_ptr<DecayFluxTable> Open(const std::string& fname){
+		std::unique_ptr<DecayFluxTable> table(new DecayFluxTable());
+		int fd = open(fname.c_str(),O_RDONLY);
+		if (fd < 0){
+			throw std::runtime_error("DecayFluxTable: opening " + fname + " failed.");
+		}
+		struct stat st;
+		void* map = MAP_FAILED;
+		if (fstat(fd,&st) == 0 && (size_t)st.st_size >= sizeof(File_Header)){
+			map = mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		}
+		close(fd);
+		if (map == MAP_FAILED){
+			throw std::runtime_error("DecayFluxTable: mapping " + fname + " failed.");
+		}
+		table->map = map;
+		table->map_size = st.st_size;
+
+		const File_Header* header = static_cast<const File_Header*>(map);
+		if (std::memcmp(header->magic,Magic(),8) != 0){
+			throw std::runtime_error("DecayFluxTable: " + fname + " is not a flux table.");
+		}
+		size_t npoints = header->nmass*header->ntheta*header->ncoupling;
+		table->numneu = header->numneu;
+		table->row = header->ne*header->numneu*2;
+		table->ratios = header->ratios;
+		size_t naxes = header->nmass + header->ntheta + header->ncoupling + header->ne;
+		if (table->map_size != sizeof(File_Header) + (naxes + npoints*table->row)*sizeof(double) + npoints){
+			throw std::runtime_error("DecayFluxTable: " + fname + " is truncated.");
+		}
+		const double* data = reinterpret_cast<const double*>(header+1);
+		table->nu4mass.assign(data,data+header->nmass); data += header->nmass;
+		table->theta24.assign(data,data+header->ntheta); data += header->ntheta;
+		table->coupling.assign(data,data+header->ncoupling); data += header->ncoupling;
+		table->energy.assign(data,data+header->ne); data += header->ne;
+		table->values = data;
+		table->status = reinterpret_cast<const signed char*>(data + npoints*table->row);
+		table->Check_Axes();
+		return table;
+	}
+
+	//! Sets how far, in grid steps, a query may lie outside the grid, or from a point evaluated on demand. Default: 0.01.
+	void Set_Tolerance(double tolerance_) { tolerance = tolerance_; }
+
+	//! Sets the function which evaluates the queries outside the table.
+	/*!
+	It is called without a lock, so concurrent queries outside the table may
+	call it from several threads at once, and it must be thread safe. Two
+	threads may then both evaluate the same point; the first row stored is kept.
+	*/
+	void Set_Evaluator(Evaluator evaluator_) { evaluator = evaluator_; }
+
+	//! Evaluates the queries outside the table with a scan on the same energy nodes and number of states.
+	/*!
+	Each such query evaluates one point with DecayScan::Evaluate(), on the
+	calling thread, and divides it by DecayScanSettings::initial_flux if the
+	table holds flux ratios. The point has no grid indices (they are all
+	std::numeric_limits<size_t>::max()). Each evaluation builds its own
+	object, and its own body if DecayScanSettings::make_body is set, so
+	concurrent queries can evaluate points at the same time.
+	*/
+	void Set_Evaluator(std::shared_ptr<const DecayScan> scan){
+		const DecayScanSettings& settings = scan->Get_Settings();
+		if (settings.e_nodes.size() != energy.size() || settings.numneu != numneu){
+			throw std::runtime_error("DecayFluxTable: the scan does not match the table.");
+		}
+		bool divide = ratios;
+		evaluator = [scan,divide](const DecayFluxQuery& q){
+			DecayScanPoint point;
+			point.index = point.imass = point.itheta = point.icoupling = std::numeric_limits<size_t>::max();
+			point.nu4mass = q.nu4mass;
+			point.theta24 = q.theta24;
+			point.coupling = q.coupling;
+			DecayScanResult result = scan->Evaluate(point);
+			if (!result.success){
+				throw std::runtime_error("DecayFluxTable: evaluating a point failed: " + result.error);
+			}
+			if (divide){
+				const DecayScanSettings& s = scan->Get_Settings();
+				const marray<double,3>& initial = *s.initial_flux;
+				for (unsigned int ie = 0; ie < s.e_nodes.size(); ie++){
+					for (unsigned int flv = 0; flv < s.numneu; flv++){
+						for (unsigned int irho = 0; irho < 2; irho++){
+							double& value = result.flux[(ie*s.numneu + flv)*2 + irho];
+							value = Ratio(value,initial[ie][irho][flv]);
+						}
+					}
+				}
+			}
+			return result.flux;
+		};
+	}
+
+	//! Returns the row at a query: ne*numneu*2 values, see the class description.
+	std::vector<double> Query(const DecayFluxQuery& q) const {
+		std::vector<double> out(row);
+		Query_Range(q,0,row,out.data());
+		return out;
+	}
+
+	//! Writes the rows of several queries to out, which must hold queries.size()*Row_Size() values.
+	void Query(const std::vector<DecayFluxQuery>& queries, double* out) const {
+		for (size_t n = 0; n < queries.size(); n++){
+			Query_Range(queries[n],0,row,out + n*row);
+		}
+	}
+
+	//! Returns one value at a query.
+	double Value(const DecayFluxQuery& q, unsigned int ie, unsigned int flavor, unsigned int irho) const {
+		double out;
+		Query_Range(q,(ie*numneu + flavor)*2 + irho,1,&out);
+		return out;
+	}
+
+	//! Writes one value of several queries to out, which must hold queries.size() values.
+	void Values(const std::vector<DecayFluxQuery>& queries, unsigned int ie, unsigned int flavor,
+				unsigned int irho, double* out) const {
+		size_t k = (ie*numneu + flavor)*2 + irho;
+		for (size_t n = 0; n < queries.size(); n++){
+			Query_Range(queries[n],k,1,out + n);
+		}
+	}
+
+	//! Returns the number of values of a row.
+	size_t Row_Size() const { return row; }
+
+	//! Returns true if the rows are flux ratios, false if they are final fluxes.
+	bool Holds_Ratios() const { return ratios; }
+
+	//! Returns the energy nodes.
+	const std::vector<double>& Get_Energies() const { return energy; }
+
+	//! Returns the number of points evaluated on demand so far.
+	size_t Num_Extra_Points() const {
+		std::lock_guard<std::mutex> lock(extra_mutex);
+		return extra_points.size();
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_table_H
@@ -0,0 +1,179 @@
+#ifndef nusquids_decay_threads_H
+#define nusquids_decay_threads_H
+
+/*
+Minimal persistent thread pool used by nuSQUIDSDecay to split work over
+energy nodes, and by DecayScan to distribute scan points. See the
+nuSQUIDSDecay and DecayScan documentation for details.
+*/
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+
+namespace nusquids {
+
+//! Fixed-size pool of worker threads running fork-join parallel loops.
+/*!
+The calling thread takes part in every loop as thread 0, so a pool of size n
+starts n-1 workers. Workers sleep between loops, which makes the pool cheap to
+keep around for the whole evolution. A pool runs one loop at a time and must
+not be shared by objects evolving concurrently.
+*/
+class DecayThreadPool {
+private:
+	//! Worker threads, excluding the calling thread.
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	//! Signals workers that a new job is available (or that the pool is stopping).
+	std::condition_variable start_cv;
+	//! Signals the calling thread that all workers finished the current job.
+	std::condition_variable done_cv;
+	//! The job of the current loop, called with the thread index.
+	const std::function<void(unsigned int)>* job=nullptr;
+	//! Incremented for every job, so that workers never run one twice.
+	unsigned long generation=0;
+	//! Number of workers which have not finished the current job.
+	unsigned int pending=0;
+	bool stop=false;
+	//! First exception thrown by a worker during the current job.
+	std::exception_ptr error;
+
+	void Worker_Loop(unsigned int thread){
+		unsigned long seen=0;
+		while(true){
+			const std::function<void(unsigned int)>* current;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_cv.wait(lock,[&]{ return stop || generation != seen; });
+				if (stop){
+					return;
+				}
+				seen=generation;
+				current=job;
+			}
+			try{
+				(*current)(thread);
+			}
+			catch(...){
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error){
+					error=std::current_exception();
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--pending == 0){
+					done_cv.notify_one();
+				}
+			}
+		}
+	}
+
+	//! Runs job(thread) on every thread of the pool and waits for all of them.
+	void Run(const std::function<void(unsigned int)>& job_){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job=&job_;
+			pending=workers.size();
+			error=nullptr;
+			generation++;
+		}
+		start_cv.notify_all();
+		std::exception_ptr local_error;
+		try{
+			job_(0);
+		}
+		catch(...){
+			local_error=std::current_exception();
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock,[&]{ return pending == 0; });
+		job=nullptr;
+		if (local_error){
+			std::rethrow_exception(local_error);
+		}
+		if (error){
+			std::rethrow_exception(error);
+		}
+	}
+
+public:
+	//! Starts the pool.
+	/*!
+	\param nthreads is the total number of threads, including the calling thread.
+	*/
+	explicit DecayThreadPool(unsigned int nthreads){
+		for (unsigned int thread=1; thread<nthreads; thread++){
+			workers.emplace_back(&DecayThreadPool::Worker_Loop,this,thread);
+		}
+	}
+
+	DecayThreadPool(const DecayThreadPool&)=delete;
+	DecayThreadPool& operator=(const DecayThreadPool&)=delete;
+
+	//! Stops and joins the workers.
+	~DecayThreadPool(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop=true;
+		}
+		start_cv.notify_all();
+		for (std::thread& worker : workers){
+			worker.join();
+		}
+	}
+
+	//! Returns the total number of threads, including the calling thread.
+	unsigned int Get_NumThreads() const { return workers.size()+1; }
+
+	//! Splits [0,n) into one contiguous chunk per thread and processes them in parallel.
+	/*!
+	Static chunking keeps the partition identical from call to call, so loops whose
+	threads write distinct elements of an array need no further synchronization.
+	\param n is the number of iterations.
+	\param func is called as func(begin,end,thread) for each non-empty chunk.
+	*/
+	void ParallelFor(size_t n, const std::function<void(size_t,size_t,unsigned int)>& func){
+		unsigned int nthreads=Get_NumThreads();
+		if (nthreads == 1 || n < 2){
+			if (n > 0){
+				func(0,n,0);
+			}
+			return;
+		}
+		std::function<void(unsigned int)> chunk=[&](unsigned int thread){
+			size_t begin=(n*thread)/nthreads;
+			size_t end=(n*(thread+1))/nthreads;
+			if (begin < end){
+				func(begin,end,thread);
+			}
+		};
+		Run(chunk);
+	}
+
+	//! Processes the iterations of [0,n) in parallel, handing them out one at a time.
+	/*!
+	Every thread takes the next unprocessed iteration as soon as it is done with
+	its previous one, so iterations of very uneven cost are balanced over the
+	threads. Iterations are handed out in increasing order.
+	\param n is the number of iterations.
+	\param func is called as func(i,thread) for each iteration i.
+	*/
+	void ParallelForDynamic(size_t n, const std::function<void(size_t,unsigned int)>& func){
+		std::atomic<size_t> next(0);
+		std::function<void(unsigned int)> take=[&](unsigned int thread){
+			for (size_t i=next++; i<n; i=next++){
+				func(i,thread);
+			}
+		};
+		Run(take);
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_threads_H
@@ -0,0 +1,240 @@
+#ifndef nusquids_decay_xsection_H
+#define nusquids_decay_xsection_H
+
+/*
+Header implementing DecayCrossSectionCache, a table of the cross sections
+on the energy nodes of a propagation, which can be shared by every object of
+a scan and saved to disk.
+*/
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+#include <nuSQuIDS/nuSQuIDS.h>
+
+namespace nusquids {
+
+//! Cross sections tabulated on the energy nodes of a propagation.
+/*!
+nuSQuIDS builds the interaction arrays of every new object with interactions
+by querying its cross sections at each energy node (total) and pair of nodes
+(differential). With cross sections interpolated from tables, such as
+NeutrinoDISCrossSectionsFromTablesExtended, this is a large part of setting
+up an object. The cache does these queries once, for the active flavors,
+both neutrino types and the CC and NC currents:
+ - total[flavor][type][current][ie], at every node,
+ - differential[flavor][type][current][ie1][ie2], for ie2 < ie1, the pairs
+   nuSQuIDS uses for the energy loss of the neutrino.
+Queries at the nodes are then a lookup, and any other one (other energies,
+sterile flavors, GR) is passed to the underlying cross sections.
+
+The table is keyed by Grid_Hash() of the nodes, so a file saved with Save()
+is only loaded for the grid it was computed on. The cache is read only once
+built, so a single object can be shared by concurrent nuSQuIDS objects, e.g.
+through DecayScanSettings::ncs and Library().
+*/
+class DecayCrossSectionCache : public NeutrinoCrossSections {
+private:
+	static const unsigned int nflavor = 3;
+	static const unsigned int ntype = 2;
+	static const unsigned int ncurrent = 2;
+
+	//! Cross sections used for the table and for the queries away from the nodes.
+	std::shared_ptr<const NeutrinoCrossSections> xs;
+	std::vector<double> energies;
+	uint64_t hash;
+	std::vector<double> total;
+	std::vector<double> differential;
+
+	size_t ne() const { return energies.size(); }
+
+	size_t Channel(unsigned int flavor, unsigned int type, unsigned int current) const {
+		return (flavor*ntype + type)*ncurrent + current;
+	}
+
+	//! True if the query can be answered by the table.
+	static bool Tabulated(NeutrinoFlavor flavor, Current current){
+		return (flavor == electron || flavor == muon || flavor == tau) && (current == CC || current == NC);
+	}
+
+	//! Returns the node at energy E, or -1 if E is not a node.
+	long Node(double E) const {
+		auto it = std::lower_bound(energies.begin(),energies.end(),E*(1 - 1e-12));
+		if (it == energies.end() || std::fabs(*it - E) > 1e-12*std::fabs(E)){
+			return -1;
+		}
+		return it - energies.begin();
+	}
+
+	void Compute(){
+		const size_t n = ne();
+		total.assign(nflavor*ntype*ncurrent*n,0);
+		differential.assign(nflavor*ntype*ncurrent*n*n,0);
+		for (unsigned int flavor = 0; flavor < nflavor; flavor++){
+			for (unsigned int type = 0; type < ntype; type++){
+				for (unsigned int current = 0; current < ncurrent; current++){
+					NeutrinoFlavor f = static_cast<NeutrinoFlavor>(flavor);
+					NeutrinoType t = static_cast<NeutrinoType>(type);
+					Current c = (current == 0) ? CC : NC;
+					size_t channel = Channel(flavor,type,current);
+					for (size_t ie1 = 0; ie1 < n; ie1++){
+						total[channel*n + ie1] = xs->TotalCrossSection(energies[ie1],f,t,c);
+						for (size_t ie2 = 0; ie2 < ie1; ie2++){
+							differential[(channel*n + ie1)*n + ie2] = xs->SingleDifferentialCrossSection(energies[ie1],energies[ie2],f,t,c);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	DecayCrossSectionCache(std::shared_ptr<const NeutrinoCrossSections> xs_, const marray<double,1>& e_nodes, bool compute):
+	xs(xs_), energies(e_nodes.begin(),e_nodes.end()), hash(Grid_Hash(e_nodes)){
+		if (!xs){
+			throw std::runtime_error("DecayCrossSectionCache: the cross sections are null.");
+		}
+		for (size_t ie = 1; ie < energies.size(); ie++){
+			if (!(energies[ie] > energies[ie-1])){
+				throw std::runtime_error("DecayCrossSectionCache: the energy nodes must be increasing.");
+			}
+		}
+		if (compute){
+			Compute();
+		}
+	}
+
+	static void Check(herr_t status, const std::string& what){
+		if (status < 0){
+			throw std::runtime_error("DecayCrossSectionCache: " + what + " failed.");
+		}
+	}
+
+public:
+	//! Tabulates xs on the energy nodes e_nodes.
+	/*!
+	\param xs_ are the cross sections, e.g. NeutrinoDISCrossSectionsFromTablesExtended.
+	\param e_nodes are the energy nodes of the propagation, in the units nuSQuIDS passes to the cross sections.
+	*/
+	DecayCrossSectionCache(std::shared_ptr<const NeutrinoCrossSections> xs_, const marray<double,1>& e_nodes):
+	DecayCrossSectionCache(xs_,e_nodes,true){}
+
+	//! Returns a hash of the energy nodes, which identifies the grid a table was computed on.
+	/*!
+	FNV-1a over the bits of the nodes, so only identical grids match.
+	*/
+	static uint64_t Grid_Hash(const marray<double,1>& e_nodes){
+		uint64_t h = 14695981039346656037ull;
+		for (double E : e_nodes){
+			unsigned char bytes[sizeof(double)];
+			std::memcpy(bytes,&E,sizeof(double));
+			for (unsigned char b : bytes){
+				h = (h ^ b)*1099511628211ull;
+			}
+		}
+		return h;
+	}
+
+	//! Returns the hash of the grid of the table, see Grid_Hash().
+	uint64_t GetGridHash() const { return hash; }
+
+	//! Writes the table to an HDF5 file.
+	void Save(const std::string& fname) const {
+		hid_t file = H5Fcreate(fname.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,H5P_DEFAULT);
+		if (file < 0){
+			throw std::runtime_error("DecayCrossSectionCache: creating " + fname + " failed.");
+		}
+		hsize_t n = ne();
+		hsize_t total_dims[4] = {nflavor,ntype,ncurrent,n};
+		hsize_t differential_dims[5] = {nflavor,ntype,ncurrent,n,n};
+		unsigned long long_hash = hash;
+		herr_t status = H5LTmake_dataset_double(file,"energy",1,&n,energies.data());
+		if (status >= 0){ status = H5LTmake_dataset_double(file,"total",4,total_dims,total.data()); }
+		if (status >= 0){ status = H5LTmake_dataset_double(file,"differential",5,differential_dims,differential.data()); }
+		if (status >= 0){ status = H5LTset_attribute_ulong(file,"energy","grid_hash",&long_hash,1); }
+		H5Fclose(file);
+		Check(status,"writing " + fname);
+	}
+
+	//! Reads a table written by Save().
+	/*!
+	\param fname is the path of the file.
+	\param xs_ are the cross sections the table was computed from, used for the queries away from the nodes.
+	\param e_nodes are the energy nodes of the propagation.
+	Throws if the file was computed on a different grid.
+	*/
+	static std::shared_ptr<DecayCrossSectionCache> Load(const std::string& fname,
+			std::shared_ptr<const NeutrinoCrossSections> xs_, const marray<double,1>& e_nodes){
+		std::shared_ptr<DecayCrossSectionCache> cache(new DecayCrossSectionCache(xs_,e_nodes,false));
+		hid_t file = H5Fopen(fname.c_str(),H5F_ACC_RDONLY,H5P_DEFAULT);
+		if (file < 0){
+			throw std::runtime_error("DecayCrossSectionCache: opening " + fname + " failed.");
+		}
+		unsigned long file_hash = 0;
+		int rank = 0;
+		hsize_t n = 0;
+		herr_t status = H5LTget_attribute_ulong(file,"energy","grid_hash",&file_hash);
+		if (status >= 0){ status = H5LTget_dataset_ndims(file,"energy",&rank); }
+		if (status >= 0 && rank == 1){ status = H5LTget_dataset_info(file,"energy",&n,NULL,NULL); }
+		if (status < 0 || rank != 1 || file_hash != cache->hash || n != cache->ne()){
+			H5Fclose(file);
+			Check(status,"reading " + fname);
+			throw std::runtime_error("DecayCrossSectionCache: " + fname + " was computed on a different energy grid.");
+		}
+		cache->total.resize(nflavor*ntype*ncurrent*n);
+		cache->differential.resize(nflavor*ntype*ncurrent*n*n);
+		status = H5LTread_dataset_double(file,"total",cache->total.data());
+		if (status >= 0){ status = H5LTread_dataset_double(file,"differential",cache->differential.data()); }
+		H5Fclose(file);
+		Check(status,"reading " + fname);
+		return cache;
+	}
+
+	//! Loads the table from fname if it exists and matches the grid, and otherwise computes it and saves it there.
+	static std::shared_ptr<DecayCrossSectionCache> Load_Or_Compute(const std::string& fname,
+			std::shared_ptr<const NeutrinoCrossSections> xs_, const marray<double,1>& e_nodes){
+		if (std::ifstream(fname).good()){
+			try{
+				return Load(fname,xs_,e_nodes);
+			}
+			catch(std::runtime_error&){}
+		}
+		std::shared_ptr<DecayCrossSectionCache> cache = std::make_shared<DecayCrossSectionCache>(xs_,e_nodes);
+		cache->Save(fname);
+		return cache;
+	}
+
+	double TotalCrossSection(double Enu, NeutrinoFlavor flavor, NeutrinoType neutype, Current current) const override {
+		long ie = Tabulated(flavor,current) ? Node(Enu) : -1;
+		if (ie < 0){
+			return xs->TotalCrossSection(Enu,flavor,neutype,current);
+		}
+		return total[Channel(flavor,neutype,current == NC)*ne() + ie];
+	}
+
+	double SingleDifferentialCrossSection(double E1, double E2, NeutrinoFlavor flavor, NeutrinoType neutype, Current current) const override {
+		long ie1 = Tabulated(flavor,current) ? Node(E1) : -1;
+		long ie2 = (ie1 > 0) ? Node(E2) : -1;
+		if (ie2 < 0 || ie2 >= ie1){
+			return xs->SingleDifferentialCrossSection(E1,E2,flavor,neutype,current);
+		}
+		return differential[(Channel(flavor,neutype,current == NC)*ne() + ie1)*ne() + ie2];
+	}
+
+	//! Returns a cross section library with the table for the isoscalar target, to pass to nuSQUIDSDecay.
+	static std::shared_ptr<CrossSectionLibrary> Library(std::shared_ptr<const DecayCrossSectionCache> cache){
+		std::shared_ptr<CrossSectionLibrary> library = std::make_shared<CrossSectionLibrary>();
+		library->addTarget(isoscalar_nucleon,cache);
+		return library;
+	}
+};
+
+} // close nusquids namespace
+#endif // nusquids_decay_xsection_H